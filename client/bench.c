@@ -0,0 +1,313 @@
+/* bench.c
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ *
+ * Microbenchmarks for the encoders, the DNS and dnscat packet code, and the
+ * DNS driver's query building. Run it with 'make bench' (which builds it
+ * optimized, and without TESTMEMORY).
+ *
+ * Each benchmark is run with twice as many iterations as the last time till
+ * a run takes at least BENCH_MIN_TIME, then its time and the number of trips
+ * to the heap (see memory_get_heap_allocations()) are divided by the
+ * iterations. The results go to stdout as tab-separated lines (with a header
+ * that starts with '#'), so they're easy to compare between releases. The
+ * arguments, if any, are the names of the benchmarks to run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "dns.h"
+#include "driver_dns.h"
+#include "encode.h"
+#include "log.h"
+#include "memory.h"
+#include "packet.h"
+#include "select_group.h"
+#include "types.h"
+
+/* How long (in microseconds) the timed run of each benchmark has to be. */
+#define BENCH_MIN_TIME 200000
+
+/* How much data goes into each packet or string (this much still fits in a
+ * query for BENCH_DOMAIN once it's hex encoded). */
+#define BENCH_DATA_LENGTH 64
+
+#define BENCH_DOMAIN "skullseclabs.org"
+#define BENCH_QUESTION "0123456789abcdef0123456789abcdef." BENCH_DOMAIN
+
+/* Where driver_dns_send's queries go (the discard port, on this machine). */
+#define BENCH_DNS_HOST "127.0.0.1"
+#define BENCH_DNS_PORT 9
+
+typedef void(bench_function_t)(size_t iterations);
+
+typedef struct
+{
+  char             *name;
+  bench_function_t *function;
+} bench_t;
+
+/* What the benchmarks work on; it's all built by setup(). */
+static arena_t        *arena;
+static uint8_t         data[BENCH_DATA_LENGTH];
+static char           *hex_string;
+static char           *base32_string;
+static dns_t          *dns;
+static uint8_t        *dns_bytes;
+static size_t          dns_bytes_length;
+static packet_t       *packet;
+static uint8_t        *packet_bytes;
+static size_t          packet_bytes_length;
+static select_group_t *group;
+static driver_dns_t   *driver_dns;
+
+/* Results go here, so the compiler can't decide they aren't needed. */
+static volatile size_t sink;
+
+static void bench_hex_encode(size_t iterations)
+{
+  size_t i;
+
+  for(i = 0; i < iterations; i++)
+  {
+    sink = (size_t) hex_encode(data, BENCH_DATA_LENGTH, arena);
+    arena_reset(arena);
+  }
+}
+
+static void bench_hex_decode(size_t iterations)
+{
+  size_t i;
+  size_t length;
+
+  for(i = 0; i < iterations; i++)
+  {
+    length = -1; /* -1 means the string is NUL-terminated. */
+    sink = (size_t) hex_decode(hex_string, &length, arena);
+    arena_reset(arena);
+  }
+}
+
+static void bench_base32_encode(size_t iterations)
+{
+  size_t i;
+
+  for(i = 0; i < iterations; i++)
+  {
+    sink = (size_t) base32_encode(data, BENCH_DATA_LENGTH, arena);
+    arena_reset(arena);
+  }
+}
+
+static void bench_base32_decode(size_t iterations)
+{
+  size_t i;
+  size_t length;
+
+  for(i = 0; i < iterations; i++)
+  {
+    length = -1; /* -1 means the string is NUL-terminated. */
+    sink = (size_t) base32_decode(base32_string, &length, arena);
+    arena_reset(arena);
+  }
+}
+
+static void bench_dns_to_packet(size_t iterations)
+{
+  size_t   i;
+  size_t   length;
+  uint8_t *bytes;
+
+  for(i = 0; i < iterations; i++)
+  {
+    bytes = dns_to_packet(dns, &length);
+    sink = length;
+    safe_free(bytes);
+  }
+}
+
+static void bench_dns_create_from_packet(size_t iterations)
+{
+  size_t i;
+
+  for(i = 0; i < iterations; i++)
+  {
+    sink = (size_t) dns_create_from_packet(dns_bytes, dns_bytes_length, arena);
+    arena_reset(arena);
+  }
+}
+
+static void bench_packet_to_bytes(size_t iterations)
+{
+  size_t i;
+  size_t length;
+
+  for(i = 0; i < iterations; i++)
+  {
+    sink = (size_t) packet_to_bytes(packet, &length, arena);
+    arena_reset(arena);
+  }
+}
+
+/* How io_thread.c hands a packet to the I/O thread. */
+static void bench_packet_write(size_t iterations)
+{
+  size_t  i;
+  uint8_t out[MAX_PACKET_SIZE];
+
+  for(i = 0; i < iterations; i++)
+    sink = packet_write(packet, out, MAX_PACKET_SIZE);
+}
+
+static void bench_packet_parse(size_t iterations)
+{
+  size_t i;
+
+  for(i = 0; i < iterations; i++)
+  {
+    sink = (size_t) packet_parse(packet_bytes, packet_bytes_length, arena);
+    arena_reset(arena);
+  }
+}
+
+/* Builds a query from a serialized packet and sends it, the same as the I/O
+ * thread does for each packet; that includes the sendmsg() and looking up the
+ * (numeric) address. */
+static void bench_driver_dns_send(size_t iterations)
+{
+  size_t i;
+
+  for(i = 0; i < iterations; i++)
+  {
+    driver_dns_send(driver_dns, packet_bytes, packet_bytes_length);
+
+    /* Nothing ever answers, but we don't want the driver to start probing. */
+    driver_dns->unanswered = 0;
+  }
+}
+
+static bench_t benches[] =
+{
+  { "hex_encode",             bench_hex_encode },
+  { "hex_decode",             bench_hex_decode },
+  { "base32_encode",          bench_base32_encode },
+  { "base32_decode",          bench_base32_decode },
+  { "dns_to_packet",          bench_dns_to_packet },
+  { "dns_create_from_packet", bench_dns_create_from_packet },
+  { "packet_to_bytes",        bench_packet_to_bytes },
+  { "packet_write",           bench_packet_write },
+  { "packet_parse",           bench_packet_parse },
+  { "driver_dns_send",        bench_driver_dns_send },
+  { NULL, NULL }
+};
+
+static void setup()
+{
+  size_t i;
+
+  for(i = 0; i < BENCH_DATA_LENGTH; i++)
+    data[i] = (uint8_t) (i * 7);
+
+  arena = arena_create();
+
+  hex_string    = hex_encode(data, BENCH_DATA_LENGTH, NULL);
+  base32_string = base32_encode(data, BENCH_DATA_LENGTH, NULL);
+
+  /* A response like the server sends: the question, and a TXT answer. */
+  dns = dns_create(DNS_OPCODE_QUERY, DNS_FLAG_QR | DNS_FLAG_RD | DNS_FLAG_RA, DNS_RCODE_SUCCESS, NULL);
+  dns->trn_id = 0x1234;
+  dns_add_question(dns, BENCH_QUESTION, DNS_TYPE_TEXT, DNS_CLASS_IN);
+  dns_add_answer_TEXT(dns, BENCH_QUESTION, DNS_CLASS_IN, 1, (uint8_t*)hex_string, strlen(hex_string));
+  dns_bytes = dns_to_packet(dns, &dns_bytes_length);
+
+  packet       = packet_create_msg(0x1234, 0x5678, 0x9abc, data, BENCH_DATA_LENGTH);
+  packet_bytes = packet_to_bytes(packet, &packet_bytes_length, NULL);
+
+  group      = select_group_create();
+  driver_dns = driver_dns_create_threaded(group, BENCH_DOMAIN, NULL);
+  driver_dns->dns_host = safe_strdup(BENCH_DNS_HOST);
+  driver_dns->dns_port = BENCH_DNS_PORT;
+}
+
+static void cleanup()
+{
+  driver_dns_destroy(driver_dns);
+  select_group_destroy(group);
+
+  safe_free(packet_bytes);
+  packet_destroy(packet);
+  safe_free(dns_bytes);
+  dns_destroy(dns);
+  safe_free(base32_string);
+  safe_free(hex_string);
+
+  arena_destroy(arena);
+}
+
+static double elapsed(struct timeval *start, struct timeval *end)
+{
+  return ((end->tv_sec - start->tv_sec) * 1000000.0) + (end->tv_usec - start->tv_usec);
+}
+
+static void run(bench_t *bench)
+{
+  struct timeval start;
+  struct timeval end;
+  size_t         allocations;
+  size_t         iterations;
+  double         time;
+
+  /* A warm-up, so the arena and the pools are already grown. */
+  bench->function(1);
+
+  for(iterations = 1; ; iterations *= 2)
+  {
+    allocations = memory_get_heap_allocations();
+    gettimeofday(&start, NULL);
+    bench->function(iterations);
+    gettimeofday(&end, NULL);
+    allocations = memory_get_heap_allocations() - allocations;
+
+    time = elapsed(&start, &end);
+    if(time >= BENCH_MIN_TIME)
+      break;
+  }
+
+  printf("%s\t%.1f\t%.2f\t%lu\n", bench->name, (time * 1000.0) / iterations, (double) allocations / iterations, (unsigned long) iterations);
+  fflush(stdout);
+}
+
+static NBBOOL is_selected(char *name, int argc, char *argv[])
+{
+  int i;
+
+  if(argc < 2)
+    return TRUE;
+
+  for(i = 1; i < argc; i++)
+    if(!strcmp(argv[i], name))
+      return TRUE;
+
+  return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+  size_t i;
+
+  setup();
+
+  printf("# benchmark\tns/op\tallocs/op\titerations\n");
+  for(i = 0; benches[i].name; i++)
+    if(is_selected(benches[i].name, argc, argv))
+      run(&benches[i]);
+
+  cleanup();
+  print_memory();
+
+  return 0;
+}
@@ -112,23 +112,34 @@ static uint32_t big_endian_to_host_32(uint32_t data)
 /* Create a new packet buffer */
 buffer_t *buffer_create(BYTE_ORDER_t byte_order)
 {
-  buffer_t *new_buffer = safe_malloc(sizeof(buffer_t));
+  return buffer_create_arena(byte_order, NULL);
+}
+
+/* Create a new packet buffer, with data.  The data shouldn't include the packet header,
+ * it will be added.  The length is the length of the data, without the header. */
+buffer_t *buffer_create_with_data(BYTE_ORDER_t byte_order, const void *data, const size_t length)
+{
+  return buffer_create_with_data_arena(byte_order, data, length, NULL);
+}
+
+buffer_t *buffer_create_arena(BYTE_ORDER_t byte_order, arena_t *arena)
+{
+  buffer_t *new_buffer = arena_alloc(arena, sizeof(buffer_t));
 
   new_buffer->byte_order     = byte_order;
   new_buffer->valid          = TRUE;
   new_buffer->position       = 0;
   new_buffer->max_length     = STARTING_LENGTH;
   new_buffer->current_length = 0;
-  new_buffer->data           = safe_malloc(STARTING_LENGTH * sizeof(char));
+  new_buffer->data           = arena_alloc(arena, STARTING_LENGTH * sizeof(char));
+  new_buffer->arena          = arena;
 
   return new_buffer;
 }
 
-/* Create a new packet buffer, with data.  The data shouldn't include the packet header,
- * it will be added.  The length is the length of the data, without the header. */
-buffer_t *buffer_create_with_data(BYTE_ORDER_t byte_order, const void *data, const size_t length)
+buffer_t *buffer_create_with_data_arena(BYTE_ORDER_t byte_order, const void *data, const size_t length, arena_t *arena)
 {
-  buffer_t *new_buffer = buffer_create(byte_order);
+  buffer_t *new_buffer = buffer_create_arena(byte_order, arena);
   if(!new_buffer)
     DIE_MEM();
 
@@ -144,6 +155,10 @@ void buffer_destroy(buffer_t *buffer)
     DIE("Program attempted to use deleted buffer.");
   buffer->valid = FALSE;
 
+  /* Arena buffers go away when the arena is reset. */
+  if(buffer->arena)
+    return;
+
   memset(buffer->data, 0, buffer->max_length);
   safe_free(buffer->data);
 
@@ -154,13 +169,13 @@ void buffer_destroy(buffer_t *buffer)
 buffer_t *buffer_duplicate(buffer_t *base)
 {
   /* Allocate memory. */
-  buffer_t *new = safe_malloc(sizeof(buffer_t));
+  buffer_t *new = arena_alloc(base->arena, sizeof(buffer_t));
 
   /* Make an exact copy (won't copy pointers properly). */
   memcpy(new, base, sizeof(buffer_t));
 
   /* Create a new 'data' pointer. */
-  new->data = safe_malloc(new->max_length);
+  new->data = arena_alloc(new->arena, new->max_length);
 
   /* Copy the data into the new data pointer. */
   memcpy(new->data, base->data, new->max_length);
@@ -219,8 +234,7 @@ uint8_t *buffer_create_string(buffer_t *buffer, size_t *length)
   if(!buffer->valid)
     DIE("Program attempted to use deleted buffer.");
 
-  ret = safe_malloc(buffer_get_length(buffer));
-  memcpy(ret, buffer->data, buffer_get_length(buffer));
+  ret = arena_memcpy(buffer->arena, buffer->data, buffer_get_length(buffer));
 
   if(length)
     *length = buffer_get_length(buffer);
@@ -230,7 +244,19 @@ uint8_t *buffer_create_string(buffer_t *buffer, size_t *length)
 
 uint8_t *buffer_create_string_and_destroy(buffer_t *buffer, size_t *length)
 {
-  uint8_t *ret = buffer_create_string(buffer, length);
+  uint8_t *ret;
+
+  /* The arena owns the data either way, so there's no need to copy it. */
+  if(buffer->arena)
+  {
+    ret = buffer->data;
+    if(length)
+      *length = buffer_get_length(buffer);
+  }
+  else
+  {
+    ret = buffer_create_string(buffer, length);
+  }
 
   buffer_destroy(buffer);
 
@@ -254,7 +280,7 @@ uint8_t *buffer_read_remaining_bytes(buffer_t *buffer, size_t *length, size_t ma
     *length = max_bytes;
 
   /* Allocate room for that many bytes */
-  ret = safe_malloc(*length);
+  ret = arena_alloc(buffer->arena, *length);
 
   /* Copy the data into the new buffer */
   if(consume)
@@ -290,6 +316,7 @@ buffer_t *buffer_add_int16(buffer_t *buffer, const uint16_t data)
     case BO_HOST:          converted = host_to_host_16(data);          break;
     case BO_LITTLE_ENDIAN: converted = host_to_little_endian_16(data); break;
     case BO_BIG_ENDIAN:    converted = host_to_big_endian_16(data);    break;
+    default:               DIE("Unknown byte order.");
   }
 
   buffer_add_bytes(buffer, &converted, 2);
@@ -310,6 +337,7 @@ buffer_t *buffer_add_int32(buffer_t *buffer, const uint32_t data)
     case BO_HOST:          converted = host_to_host_32(data);          break;
     case BO_LITTLE_ENDIAN: converted = host_to_little_endian_32(data); break;
     case BO_BIG_ENDIAN:    converted = host_to_big_endian_32(data);    break;
+    default:               DIE("Unknown byte order.");
   }
 
   buffer_add_bytes(buffer, &converted, 4);
@@ -349,8 +377,10 @@ buffer_t *buffer_add_unicode(buffer_t *buffer, const char *data)
   return buffer;
 }
 
-buffer_t *buffer_add_bytes(buffer_t *buffer, const void *data, const size_t length)
+uint8_t *buffer_add_record(buffer_t *buffer, const size_t length)
 {
+  uint8_t *record;
+
   if(!buffer->valid)
     DIE("Program attempted to use deleted buffer.");
 
@@ -374,13 +404,29 @@ buffer_t *buffer_add_bytes(buffer_t *buffer, const void *data, const size_t leng
     }
     while(buffer->current_length + length > buffer->max_length);
 
-    buffer->data = safe_realloc(buffer->data, buffer->max_length);
+    if(buffer->arena)
+    {
+      uint8_t *new_data = arena_alloc(buffer->arena, buffer->max_length);
+      memcpy(new_data, buffer->data, buffer->current_length);
+      buffer->data = new_data;
+    }
+    else
+    {
+      buffer->data = safe_realloc(buffer->data, buffer->max_length);
+    }
   }
 
-  memcpy(buffer->data + buffer->current_length, data, length);
+  record = buffer->data + buffer->current_length;
 
   buffer->current_length += length;
 
+  return record;
+}
+
+buffer_t *buffer_add_bytes(buffer_t *buffer, const void *data, const size_t length)
+{
+  memcpy(buffer_add_record(buffer, length), data, length);
+
   return buffer;
 }
 
@@ -414,6 +460,7 @@ buffer_t *buffer_add_int16_at(buffer_t *buffer,     const uint16_t data, size_t
     case BO_HOST:          converted = host_to_host_16(data);          break;
     case BO_LITTLE_ENDIAN: converted = host_to_little_endian_16(data); break;
     case BO_BIG_ENDIAN:    converted = host_to_big_endian_16(data);    break;
+    default:               DIE("Unknown byte order.");
   }
 
   return buffer_add_bytes_at(buffer, &converted, 2, offset);
@@ -432,6 +479,7 @@ buffer_t *buffer_add_int32_at(buffer_t *buffer,     const uint32_t data, size_t
     case BO_HOST:          converted = host_to_host_32(data);          break;
     case BO_LITTLE_ENDIAN: converted = host_to_little_endian_32(data); break;
     case BO_BIG_ENDIAN:    converted = host_to_big_endian_32(data);    break;
+    default:               DIE("Unknown byte order.");
   }
 
   return buffer_add_bytes_at(buffer, &converted, 4, offset);
@@ -868,6 +916,141 @@ uint8_t *buffer_get(buffer_t *buffer, size_t *length)
   return buffer->data;
 }
 
+void buffer_view_init(buffer_view_t *view, BYTE_ORDER_t byte_order, const void *data, size_t length)
+{
+  view->byte_order = byte_order;
+  view->data       = (const uint8_t*) data;
+  view->length     = length;
+  view->position   = 0;
+}
+
+void buffer_view_slice(buffer_view_t *view, buffer_view_t *slice, size_t length)
+{
+  buffer_view_init(slice, view->byte_order, buffer_view_read_next_bytes(view, length), length);
+}
+
+size_t buffer_view_get_length(buffer_view_t *view)
+{
+  return view->length;
+}
+
+size_t buffer_view_get_current_offset(buffer_view_t *view)
+{
+  return view->position;
+}
+
+void buffer_view_set_current_offset(buffer_view_t *view, size_t position)
+{
+  view->position = position;
+}
+
+size_t buffer_view_get_remaining_bytes(buffer_view_t *view)
+{
+  if(view->position > view->length)
+    return 0;
+  return view->length - view->position;
+}
+
+NBBOOL buffer_view_can_read(buffer_view_t *view, size_t length)
+{
+  return buffer_view_can_read_at(view, view->position, length);
+}
+
+NBBOOL buffer_view_can_read_at(buffer_view_t *view, size_t offset, size_t length)
+{
+  if(offset + length < offset)
+    DIE("Overflow");
+
+  return offset + length <= view->length;
+}
+
+void buffer_view_consume(buffer_view_t *view, size_t count)
+{
+  buffer_view_read_next_bytes(view, count);
+}
+
+uint8_t buffer_view_read_next_int8(buffer_view_t *view)
+{
+  uint8_t ret = buffer_view_read_int8_at(view, view->position);
+  view->position += 1;
+  return ret;
+}
+
+uint16_t buffer_view_read_next_int16(buffer_view_t *view)
+{
+  uint16_t ret = buffer_view_read_int16_at(view, view->position);
+  view->position += 2;
+  return ret;
+}
+
+uint32_t buffer_view_read_next_int32(buffer_view_t *view)
+{
+  uint32_t ret = buffer_view_read_int32_at(view, view->position);
+  view->position += 4;
+  return ret;
+}
+
+const uint8_t *buffer_view_read_next_bytes(buffer_view_t *view, size_t length)
+{
+  const uint8_t *ret = buffer_view_read_bytes_at(view, view->position, length);
+  view->position += length;
+  return ret;
+}
+
+const uint8_t *buffer_view_read_remaining_bytes(buffer_view_t *view, size_t *length)
+{
+  *length = buffer_view_get_remaining_bytes(view);
+
+  return buffer_view_read_next_bytes(view, *length);
+}
+
+uint8_t buffer_view_read_int8_at(buffer_view_t *view, size_t offset)
+{
+  return *buffer_view_read_bytes_at(view, offset, 1);
+}
+
+uint16_t buffer_view_read_int16_at(buffer_view_t *view, size_t offset)
+{
+  uint16_t ret;
+
+  memcpy(&ret, buffer_view_read_bytes_at(view, offset, 2), 2);
+
+  switch(view->byte_order)
+  {
+    case BO_NETWORK:       ret = network_to_host_16(ret);       break;
+    case BO_HOST:          ret = host_to_host_16(ret);          break;
+    case BO_LITTLE_ENDIAN: ret = little_endian_to_host_16(ret); break;
+    case BO_BIG_ENDIAN:    ret = big_endian_to_host_16(ret);    break;
+  }
+
+  return ret;
+}
+
+uint32_t buffer_view_read_int32_at(buffer_view_t *view, size_t offset)
+{
+  uint32_t ret;
+
+  memcpy(&ret, buffer_view_read_bytes_at(view, offset, 4), 4);
+
+  switch(view->byte_order)
+  {
+    case BO_NETWORK:       ret = network_to_host_32(ret);       break;
+    case BO_HOST:          ret = host_to_host_32(ret);          break;
+    case BO_LITTLE_ENDIAN: ret = little_endian_to_host_32(ret); break;
+    case BO_BIG_ENDIAN:    ret = big_endian_to_host_32(ret);    break;
+  }
+
+  return ret;
+}
+
+const uint8_t *buffer_view_read_bytes_at(buffer_view_t *view, size_t offset, size_t length)
+{
+  if(!buffer_view_can_read_at(view, offset, length))
+    DIE("Program read off the end of the buffer.");
+
+  return view->data + offset;
+}
+
 #if 0
 int main(int argc, char *argv[])
 {
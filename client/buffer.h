@@ -23,6 +23,7 @@
 
 #include <stdlib.h> /* For "size_t". */
 
+#include "memory.h"
 #include "types.h"
 
 typedef enum
@@ -33,6 +34,16 @@ typedef enum
   BO_BIG_ENDIAN,    /* Use big endian byte ordering (0x12345678 => 12 34 56 78). */
 } BYTE_ORDER_t;
 
+/* Big endian (network order) fields, read from or written to a pointer. For
+ * codecs whose byte order never changes, these skip the checks and the switch
+ * that the buffer functions go through for every field; the caller checks the
+ * length once for the whole record (with buffer_add_record() or
+ * buffer_view_read_next_bytes()) and then fills it in or reads it out. */
+#define BE_GET16(p)    ((uint16_t)(((uint16_t)(p)[0] << 8) | (uint16_t)(p)[1]))
+#define BE_GET32(p)    ((uint32_t)(((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3]))
+#define BE_PUT16(p, v) ((p)[0] = (uint8_t)((v) >> 8), (p)[1] = (uint8_t)(v))
+#define BE_PUT32(p, v) ((p)[0] = (uint8_t)((v) >> 24), (p)[1] = (uint8_t)((v) >> 16), (p)[2] = (uint8_t)((v) >> 8), (p)[3] = (uint8_t)(v))
+
 /* This struct shouldn't be accessed directly */
 typedef struct
 {
@@ -56,6 +67,10 @@ typedef struct
    * re-use it (again) */
   NBBOOL valid;
 
+  /* The arena the buffer (and everything it returns) is allocated from, or
+   * NULL for the heap. */
+  arena_t *arena;
+
 } buffer_t;
 
 /* Create a new packet buffer */
@@ -64,6 +79,13 @@ buffer_t *buffer_create(BYTE_ORDER_t byte_order);
 /* Create a new packet buffer, with data. */
 buffer_t *buffer_create_with_data(BYTE_ORDER_t byte_order, const void *data, const size_t length);
 
+/* The same, but allocated from an arena (see memory.h), along with the strings
+ * it returns; buffer_destroy() doesn't free anything, and
+ * buffer_create_string_and_destroy() hands back the buffer's own data instead
+ * of a copy. */
+buffer_t *buffer_create_arena(BYTE_ORDER_t byte_order, arena_t *arena);
+buffer_t *buffer_create_with_data_arena(BYTE_ORDER_t byte_order, const void *data, const size_t length, arena_t *arena);
+
 /* Destroy the buffer and free resources.  If this isn't used, memory will leak. */
 void buffer_destroy(buffer_t *buffer);
 
@@ -114,6 +136,11 @@ buffer_t *buffer_add_unicode(buffer_t *buffer,   const char *data);
 buffer_t *buffer_add_bytes(buffer_t *buffer,     const void *data, const size_t length);
 buffer_t *buffer_add_buffer(buffer_t *buffer,    const buffer_t *source);
 
+/* Add room for a fixed-size record to the end of the buffer, and return a
+ * pointer to it (good till the buffer's next change), so its fields can be
+ * filled in with the BE_PUT macros below after a single check. */
+uint8_t  *buffer_add_record(buffer_t *buffer,    const size_t length);
+
 /* Add data to the middle of a buffer. These functions won't write past the end of the buffer, so it's
  * up to the programmer to be careful. */
 buffer_t *buffer_add_int8_at(buffer_t *buffer,      const uint8_t data, size_t offset);
@@ -172,6 +199,46 @@ NBBOOL buffer_can_read_ntstring_at(buffer_t *buffer, size_t offset, size_t max_l
 NBBOOL buffer_can_read_unicode_at(buffer_t *buffer, size_t offset, size_t max_length);
 NBBOOL buffer_can_read_bytes_at(buffer_t *buffer, size_t offset, size_t length);
 
+/* A buffer_view_t reads memory that belongs to something else (a datagram
+ * that was just received, say) in place: nothing's copied, and the reads that
+ * return data return pointers into that memory, so they're only good as long
+ * as it is. Like the buffer_read_*() functions, reading off the end is fatal,
+ * so check untrusted data with buffer_view_can_read() first. Views don't
+ * need to be freed (they're usually on the stack). */
+typedef struct
+{
+  BYTE_ORDER_t   byte_order;
+  const uint8_t *data;
+  size_t         length;
+  size_t         position;
+} buffer_view_t;
+
+/* Point a view at some data. */
+void           buffer_view_init(buffer_view_t *view, BYTE_ORDER_t byte_order, const void *data, size_t length);
+
+/* Point 'slice' at the next 'length' bytes of a view (and skip over them). */
+void           buffer_view_slice(buffer_view_t *view, buffer_view_t *slice, size_t length);
+
+size_t         buffer_view_get_length(buffer_view_t *view);
+size_t         buffer_view_get_current_offset(buffer_view_t *view);
+void           buffer_view_set_current_offset(buffer_view_t *view, size_t position);
+size_t         buffer_view_get_remaining_bytes(buffer_view_t *view);
+
+NBBOOL         buffer_view_can_read(buffer_view_t *view, size_t length);
+NBBOOL         buffer_view_can_read_at(buffer_view_t *view, size_t offset, size_t length);
+
+void           buffer_view_consume(buffer_view_t *view, size_t count);
+uint8_t        buffer_view_read_next_int8(buffer_view_t *view);
+uint16_t       buffer_view_read_next_int16(buffer_view_t *view);
+uint32_t       buffer_view_read_next_int32(buffer_view_t *view);
+const uint8_t *buffer_view_read_next_bytes(buffer_view_t *view, size_t length);
+const uint8_t *buffer_view_read_remaining_bytes(buffer_view_t *view, size_t *length);
+
+uint8_t        buffer_view_read_int8_at(buffer_view_t *view, size_t offset);
+uint16_t       buffer_view_read_int16_at(buffer_view_t *view, size_t offset);
+uint32_t       buffer_view_read_int32_at(buffer_view_t *view, size_t offset);
+const uint8_t *buffer_view_read_bytes_at(buffer_view_t *view, size_t offset, size_t length);
+
 /* Print out the buffer in a nice format -- useful for debugging. */
 void buffer_print(buffer_t *buffer);
 
@@ -27,20 +27,22 @@
 
 #include "dns.h"
 
-static void buffer_add_dns_name(buffer_t *buffer, char *name)
+/* The fixed-size parts that follow a name: a question's type and class, and
+ * a resource record's type, class and time to live. */
+#define QUESTION_RECORD_LENGTH 4
+#define RR_RECORD_LENGTH       8
+
+void dns_buffer_add_name(buffer_t *buffer, char *name)
 {
-  char *domain_base = safe_strdup(name);
   char *domain_start;
   char *domain_end;
 
-  domain_start = domain_base;
+  domain_start = name;
   while((domain_end = strchr(domain_start, '.')))
   {
-    /* Set the end of the string to null. */
-    *domain_end = '\0';
     /* Add it to the buffer. */
-    buffer_add_int8(buffer, strlen(domain_start));
-    buffer_add_string(buffer, domain_start);
+    buffer_add_int8(buffer, domain_end - domain_start);
+    buffer_add_bytes(buffer, domain_start, domain_end - domain_start);
 
     /* Move the 'start' string to the next character. */
     domain_start = domain_end + 1;
@@ -54,55 +56,69 @@ static void buffer_add_dns_name(buffer_t *buffer, char *name)
 
   /* Add the final null byte. */
   buffer_add_int8(buffer, 0x00);
-
-  /* Can't forget to free our pointer. */
-  safe_free(domain_base);
 }
 
-static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t *real_length)
+/* Returns NULL if the name runs off the end of the packet or doesn't make
+ * sense (including a pointer that doesn't point back to an earlier name, which
+ * could otherwise loop forever). */
+static char *view_read_dns_name_at(buffer_view_t *view, uint32_t offset, uint32_t *real_length, arena_t *arena)
 {
   uint8_t  piece_length;
   uint32_t pos = 0;
-  buffer_t *ret = buffer_create(BO_NETWORK);
+  buffer_t *ret = buffer_create_arena(BO_NETWORK, arena);
 
   /* Read the first character -- it's the size of the initial string. */
-  piece_length = buffer_read_int8_at(buffer, offset + pos);
+  if(!buffer_view_can_read_at(view, offset + pos, 1))
+  {
+    buffer_destroy(ret);
+    return NULL;
+  }
+  piece_length = buffer_view_read_int8_at(view, offset + pos);
   pos++;
 
   while(piece_length)
   {
     if(piece_length & 0x80)
     {
-      if(piece_length == 0xc0)
+      uint8_t relative_pos;
+      char *new_data;
+
+      if(piece_length != 0xc0 || !buffer_view_can_read_at(view, offset + pos, 1))
       {
-        uint8_t relative_pos = buffer_read_int8_at(buffer, offset + pos);
-        char *new_data;
-        pos++;
+        buffer_destroy(ret);
+        return NULL;
+      }
 
-        new_data = buffer_read_dns_name_at(buffer, relative_pos, NULL);
-        buffer_add_string(ret, new_data);
-        safe_free(new_data);
+      relative_pos = buffer_view_read_int8_at(view, offset + pos);
+      pos++;
 
-        /* Setting piece_length to 0 makes the loop end. */
-        piece_length = 0;
-      }
-      else
+      new_data = relative_pos < offset ? view_read_dns_name_at(view, relative_pos, NULL, arena) : NULL;
+      if(!new_data)
       {
-        fprintf(stderr, "DNS server returned an unknown character in the string: 0x%02x\n", piece_length);
-        DIE("Couldn't process string");
+        buffer_destroy(ret);
+        return NULL;
       }
+      buffer_add_string(ret, new_data);
+      arena_free(arena, new_data);
+
+      /* Setting piece_length to 0 makes the loop end. */
+      piece_length = 0;
     }
     else
     {
-      uint8_t *piece = (uint8_t*) safe_malloc(piece_length);
-      buffer_read_bytes_at(buffer, offset + pos, piece, piece_length);
-      buffer_add_bytes(ret, piece, piece_length);
-      safe_free(piece);
+      /* The piece, then the next length. */
+      if(!buffer_view_can_read_at(view, offset + pos, piece_length + 1))
+      {
+        buffer_destroy(ret);
+        return NULL;
+      }
+
+      buffer_add_bytes(ret, buffer_view_read_bytes_at(view, offset + pos, piece_length), piece_length);
 
       pos = pos + piece_length;
 
       /* Read the next length. */
-      piece_length = buffer_read_int8_at(buffer, offset + pos);
+      piece_length = buffer_view_read_int8_at(view, offset + pos);
 
       /* If the next piece exists, add a period. */
       if(piece_length)
@@ -122,36 +138,34 @@ static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t
   return (char*)buffer_create_string_and_destroy(ret, NULL);
 }
 
-static char *buffer_read_next_dns_name(buffer_t *buffer)
+static char *view_read_next_dns_name(buffer_view_t *view, arena_t *arena)
 {
   char *result;
   uint32_t actual_length;
 
-  result = buffer_read_dns_name_at(buffer, buffer_get_current_offset(buffer), &actual_length);
-  buffer_set_current_offset(buffer, buffer_get_current_offset(buffer) + actual_length);
+  result = view_read_dns_name_at(view, buffer_view_get_current_offset(view), &actual_length, arena);
+  if(result)
+    buffer_view_consume(view, actual_length);
 
   return result;
 }
 
-static char *buffer_read_ipv4_address_at(buffer_t *buffer, uint32_t offset, char result[16])
+static char *view_read_ipv4_address_at(buffer_view_t *view, uint32_t offset, char result[16])
 {
 #ifdef WIN32
   printf("NOT IMPLEMENTED!\n");
   exit(1);
 #else
-  uint8_t addr[4];
-
-  buffer_read_bytes_at(buffer, offset, addr, 4);
-  inet_ntop(AF_INET, addr, result, 16);
+  inet_ntop(AF_INET, buffer_view_read_bytes_at(view, offset, 4), result, 16);
 #endif
 
   return result;
 }
 
-static char *buffer_read_next_ipv4_address(buffer_t *buffer, char result[16])
+static char *view_read_next_ipv4_address(buffer_view_t *view, char result[16])
 {
-  buffer_read_ipv4_address_at(buffer, buffer_get_current_offset(buffer), result);
-  buffer_set_current_offset(buffer, buffer_get_current_offset(buffer) + 4);
+  view_read_ipv4_address_at(view, buffer_view_get_current_offset(view), result);
+  buffer_view_consume(view, 4);
 
   return result;
 }
@@ -177,25 +191,22 @@ static buffer_t *buffer_add_ipv4_address(buffer_t *buffer, char *address)
   return buffer;
 }
 
-static char *buffer_read_ipv6_address_at(buffer_t *buffer, uint32_t offset, char result[40])
+static char *view_read_ipv6_address_at(buffer_view_t *view, uint32_t offset, char result[40])
 {
 #ifdef WIN32
   printf("NOT IMPLEMENTED!\n");
   exit(1);
 #else
-  uint8_t addr[16];
-
-  buffer_read_bytes_at(buffer, offset, addr, 16);
-  inet_ntop(AF_INET6, addr, result, 40);
+  inet_ntop(AF_INET6, buffer_view_read_bytes_at(view, offset, 16), result, 40);
 #endif
 
   return result;
 }
 
-static char *buffer_read_next_ipv6_address(buffer_t *buffer, char result[40])
+static char *view_read_next_ipv6_address(buffer_view_t *view, char result[40])
 {
-  buffer_read_ipv6_address_at(buffer, buffer_get_current_offset(buffer), result);
-  buffer_set_current_offset(buffer, buffer_get_current_offset(buffer) + 16);
+  view_read_ipv6_address_at(view, buffer_view_get_current_offset(view), result);
+  buffer_view_consume(view, 16);
 
   return result;
 }
@@ -228,17 +239,83 @@ buffer_t *buffer_add_ipv6_address(buffer_t *buffer, char *address)
   return buffer;
 }
 
-static dns_t *dns_create_internal()
+/* A dns_t is created and destroyed for every packet in and out, and nearly
+ * always has one question or one answer, so those come from pools; only the
+ * rare bigger arrays go to the heap. If the dns_t is in an arena, it all comes
+ * from the arena instead. */
+static pool_t dns_pool          = POOL_INITIALIZER(dns_t);
+static pool_t question_pool     = POOL_INITIALIZER(question_t);
+static pool_t answer_pool       = POOL_INITIALIZER(answer_t);
+static pool_t answer_types_pool = POOL_INITIALIZER(answer_types_t);
+
+static question_t *questions_alloc(dns_t *dns, size_t count)
+{
+  if(dns->arena)
+    return (question_t*) arena_alloc(dns->arena, count * sizeof(question_t));
+
+  if(count == 1)
+    return (question_t*) safe_pool_alloc(&question_pool);
+
+  return (question_t*) safe_malloc(count * sizeof(question_t));
+}
+
+static void questions_free(dns_t *dns, question_t *questions, size_t count)
 {
-  dns_t *dns = (dns_t*) safe_malloc(sizeof(dns_t));
-  memset(dns, 0, sizeof(dns_t));
+  if(dns->arena)
+    return;
+
+  if(count == 1)
+    safe_pool_free(&question_pool, questions);
+  else
+    safe_free(questions);
+}
+
+static answer_t *answers_alloc(dns_t *dns, size_t count)
+{
+  if(dns->arena)
+    return (answer_t*) arena_alloc(dns->arena, count * sizeof(answer_t));
+
+  if(count == 1)
+    return (answer_t*) safe_pool_alloc(&answer_pool);
+
+  return (answer_t*) safe_malloc(count * sizeof(answer_t));
+}
+
+static void answers_free(dns_t *dns, answer_t *answers, size_t count)
+{
+  if(dns->arena)
+    return;
+
+  if(count == 1)
+    safe_pool_free(&answer_pool, answers);
+  else
+    safe_free(answers);
+}
+
+static answer_types_t *answer_types_alloc(dns_t *dns)
+{
+  if(dns->arena)
+    return (answer_types_t*) arena_alloc(dns->arena, sizeof(answer_types_t));
+
+  return (answer_types_t*) safe_pool_alloc(&answer_types_pool);
+}
+
+static dns_t *dns_create_internal(arena_t *arena)
+{
+  dns_t *dns;
+
+  if(arena)
+    dns = (dns_t*) arena_alloc(arena, sizeof(dns_t));
+  else
+    dns = (dns_t*) safe_pool_alloc(&dns_pool);
+  dns->arena = arena;
 
   return dns;
 }
 
-dns_t *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode)
+dns_t *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode, arena_t *arena)
 {
-  dns_t *dns = dns_create_internal();
+  dns_t *dns = dns_create_internal(arena);
 
   dns->trn_id = rand() & 0xFFFF;
   dns->opcode = opcode;
@@ -248,19 +325,33 @@ dns_t *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode)
   return dns;
 }
 
-dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
+/* Does the work for dns_create_from_packet(). Everything that's read is
+ * checked first; if the packet's cut short (or doesn't make sense), this
+ * gives up and returns NULL, leaving whatever it built so far behind (see
+ * dns_create_from_packet()). */
+static dns_t *dns_parse(uint8_t *packet, size_t length, arena_t *arena)
 {
   uint16_t i;
-  buffer_t *buffer = buffer_create_with_data(BO_NETWORK, packet, length);
-  dns_t *dns = dns_create_internal();
+  buffer_view_t view;
+  const uint8_t *record;
+  dns_t *dns;
   uint16_t flags;
 
-  dns->trn_id           = buffer_read_next_int16(buffer);
-  flags                 = buffer_read_next_int16(buffer);
-  dns->question_count   = buffer_read_next_int16(buffer);
-  dns->answer_count     = buffer_read_next_int16(buffer);
-  dns->authority_count  = buffer_read_next_int16(buffer);
-  dns->additional_count = buffer_read_next_int16(buffer);
+  /* The packet's parsed in place. The fixed-size parts are read as records
+   * (see the BE_ macros in buffer.h). */
+  buffer_view_init(&view, BO_NETWORK, packet, length);
+
+  if(!buffer_view_can_read(&view, DNS_HEADER_LENGTH))
+    return NULL;
+
+  dns = dns_create_internal(arena);
+  record = buffer_view_read_next_bytes(&view, DNS_HEADER_LENGTH);
+  dns->trn_id           = BE_GET16(record);
+  flags                 = BE_GET16(record + 2);
+  dns->question_count   = BE_GET16(record + 4);
+  dns->answer_count     = BE_GET16(record + 6);
+  dns->authority_count  = BE_GET16(record + 8);
+  dns->additional_count = BE_GET16(record + 10);
 
   /* Parse the 'flags' field:
    * +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
@@ -275,80 +366,123 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
 
   if(dns->question_count)
   {
-    dns->questions = (question_t*) safe_malloc(dns->question_count * sizeof(question_t));
+    dns->questions = questions_alloc(dns, dns->question_count);
     for(i = 0; i < dns->question_count; i++)
     {
-      dns->questions[i].name = buffer_read_next_dns_name(buffer);
-      dns->questions[i].type  = buffer_read_next_int16(buffer);
-      dns->questions[i].class = buffer_read_next_int16(buffer);
+      dns->questions[i].name = view_read_next_dns_name(&view, arena);
+      if(!dns->questions[i].name || !buffer_view_can_read(&view, QUESTION_RECORD_LENGTH))
+        return NULL;
+
+      record = buffer_view_read_next_bytes(&view, QUESTION_RECORD_LENGTH);
+      dns->questions[i].type  = BE_GET16(record);
+      dns->questions[i].class = BE_GET16(record + 2);
     }
   }
 
   if(dns->answer_count)
   {
-    dns->answers = (answer_t*) safe_malloc(dns->answer_count * sizeof(answer_t));
+    dns->answers = answers_alloc(dns, dns->answer_count);
     for(i = 0; i < dns->answer_count; i++)
     {
-      dns->answers[i].question = buffer_read_next_dns_name(buffer); /* The question. */
-      dns->answers[i].type     = buffer_read_next_int16(buffer); /* Type. */
-      dns->answers[i].class    = buffer_read_next_int16(buffer); /* Class. */
-      dns->answers[i].ttl      = buffer_read_next_int32(buffer); /* Time to live. */
-      dns->answers[i].answer   = (answer_types_t *) safe_malloc(sizeof(answer_types_t));
+      dns->answers[i].question = view_read_next_dns_name(&view, arena); /* The question. */
+      if(!dns->answers[i].question || !buffer_view_can_read(&view, RR_RECORD_LENGTH))
+        return NULL;
+
+      record = buffer_view_read_next_bytes(&view, RR_RECORD_LENGTH);
+      dns->answers[i].type     = BE_GET16(record); /* Type. */
+      dns->answers[i].class    = BE_GET16(record + 2); /* Class. */
+      dns->answers[i].ttl      = BE_GET32(record + 4); /* Time to live. */
+      dns->answers[i].answer   = answer_types_alloc(dns);
 
       if(dns->answers[i].type == DNS_TYPE_A) /* 0x0001 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care) */
+        if(!buffer_view_can_read(&view, 2 + 4))
+          return NULL;
 
-        dns->answers[i].answer->A.address = safe_malloc(16);
-        buffer_read_next_ipv4_address(buffer, dns->answers[i].answer->A.address);
+        buffer_view_read_next_int16(&view); /* String size (don't care) */
+
+        dns->answers[i].answer->A.address = arena_alloc(arena, 16);
+        view_read_next_ipv4_address(&view, dns->answers[i].answer->A.address);
       }
       else if(dns->answers[i].type == DNS_TYPE_NS) /* 0x0002 */
       {
-        buffer_read_next_int16(buffer); /* String size. */
-        dns->answers[i].answer->NS.name = buffer_read_next_dns_name(buffer); /* The answer. */
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size. */
+        dns->answers[i].answer->NS.name = view_read_next_dns_name(&view, arena); /* The answer. */
+        if(!dns->answers[i].answer->NS.name)
+          return NULL;
       }
       else if(dns->answers[i].type == DNS_TYPE_CNAME) /* 0x0005 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->CNAME.name = buffer_read_next_dns_name(buffer); /* The answer. */
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->answers[i].answer->CNAME.name = view_read_next_dns_name(&view, arena); /* The answer. */
+        if(!dns->answers[i].answer->CNAME.name)
+          return NULL;
       }
       else if(dns->answers[i].type == DNS_TYPE_MX) /* 0x000F */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->MX.preference = buffer_read_next_int16(buffer); /* Preference. */
-        dns->answers[i].answer->MX.name       = buffer_read_next_dns_name(buffer); /* The answer. */
+        if(!buffer_view_can_read(&view, 2 + 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->answers[i].answer->MX.preference = buffer_view_read_next_int16(&view); /* Preference. */
+        dns->answers[i].answer->MX.name       = view_read_next_dns_name(&view, arena); /* The answer. */
+        if(!dns->answers[i].answer->MX.name)
+          return NULL;
       }
       else if(dns->answers[i].type == DNS_TYPE_TEXT) /* 0x0010 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->TEXT.length = buffer_read_next_int8(buffer); /* The actual length. */
-        dns->answers[i].answer->TEXT.text = safe_malloc(dns->answers[i].answer->TEXT.length); /* Allocate room for the answer. */
-        buffer_read_next_bytes(buffer, dns->answers[i].answer->TEXT.text, dns->answers[i].answer->TEXT.length); /* Read the answer. */
+        if(!buffer_view_can_read(&view, 3))
+          return NULL;
+
+        record = buffer_view_read_next_bytes(&view, 3); /* String size (don't care), then the actual length. */
+        dns->answers[i].answer->TEXT.length = record[2];
+        if(!buffer_view_can_read(&view, dns->answers[i].answer->TEXT.length))
+          return NULL;
+
+        dns->answers[i].answer->TEXT.text = arena_alloc(arena, dns->answers[i].answer->TEXT.length + 1); /* Allocate room for the answer (and a terminator). */
+        memcpy(dns->answers[i].answer->TEXT.text, buffer_view_read_next_bytes(&view, dns->answers[i].answer->TEXT.length), dns->answers[i].answer->TEXT.length); /* Read the answer. */
       }
 #ifndef WIN32
       else if(dns->answers[i].type == DNS_TYPE_AAAA) /* 0x001C */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
+        if(!buffer_view_can_read(&view, 2 + 16))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
 
-        dns->answers[i].answer->AAAA.address = safe_malloc(40);
-        buffer_read_next_ipv6_address(buffer, dns->answers[i].answer->AAAA.address);
+        dns->answers[i].answer->AAAA.address = arena_alloc(arena, 40);
+        view_read_next_ipv6_address(&view, dns->answers[i].answer->AAAA.address);
       }
 #endif
       else if(dns->answers[i].type == DNS_TYPE_NB) /* 0x0020 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
+        if(!buffer_view_can_read(&view, 2 + 2 + 4))
+          return NULL;
 
-        dns->answers[i].answer->NB.flags   = buffer_read_next_int16(buffer);
-        dns->answers[i].answer->NB.address = safe_malloc(16);
-        buffer_read_next_ipv4_address(buffer, dns->answers[i].answer->NB.address);
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+
+        dns->answers[i].answer->NB.flags   = buffer_view_read_next_int16(&view);
+        dns->answers[i].answer->NB.address = arena_alloc(arena, 16);
+        view_read_next_ipv4_address(&view, dns->answers[i].answer->NB.address);
       }
       else if(dns->answers[i].type == DNS_TYPE_NBSTAT) /* 0x0021 */
       {
         uint8_t j;
+        size_t  stats_length;
+        uint16_t size;
+
+        if(!buffer_view_can_read(&view, 2 + 1))
+          return NULL;
 
-        uint16_t size = buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->NBSTAT.name_count = buffer_read_next_int8(buffer);
-        dns->answers[i].answer->NBSTAT.names      = (NBSTAT_name_t*) safe_malloc(sizeof(NBSTAT_name_t) * dns->answers[i].answer->NBSTAT.name_count);
+        size = buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->answers[i].answer->NBSTAT.name_count = buffer_view_read_next_int8(&view);
+        dns->answers[i].answer->NBSTAT.names      = (NBSTAT_name_t*) arena_alloc(arena, sizeof(NBSTAT_name_t) * dns->answers[i].answer->NBSTAT.name_count);
 
         /* Read the list of names. */
         for(j = 0; j < dns->answers[i].answer->NBSTAT.name_count; j++)
@@ -356,8 +490,12 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
           char  tmp[16];
           char *end;
 
+          /* The name, then its flags. */
+          if(!buffer_view_can_read(&view, 16 + 2))
+            return NULL;
+
           /* Read the full name. */
-          buffer_read_next_bytes(buffer, tmp, 16);
+          memcpy(tmp, buffer_view_read_next_bytes(&view, 16), 16);
 
           /* The type is the last byte -- read it then terminate the string properly. */
           dns->answers[i].answer->NBSTAT.names[j].name_type = tmp[15];
@@ -369,22 +507,31 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
             *end = 0;
 
           /* Save this name. */
-          dns->answers[i].answer->NBSTAT.names[j].name = safe_strdup(tmp);
+          dns->answers[i].answer->NBSTAT.names[j].name = arena_strdup(arena, tmp);
 
           /* Finally, read the flags. */
-          dns->answers[i].answer->NBSTAT.names[j].name_flags = buffer_read_next_int16(buffer);
+          dns->answers[i].answer->NBSTAT.names[j].name_flags = buffer_view_read_next_int16(&view);
         }
 
         /* Read the rest of the data -- for a bit of safety so we don't read too far, do some math to figure out exactly what's left. */
-        buffer_read_next_bytes(buffer, dns->answers[i].answer->NBSTAT.stats, MIN(64, size - 1 - (dns->answers[i].answer->NBSTAT.name_count * 16)));
+        stats_length = MIN(64, size - 1 - (dns->answers[i].answer->NBSTAT.name_count * 16));
+        if(!buffer_view_can_read(&view, stats_length))
+          return NULL;
+        memcpy(dns->answers[i].answer->NBSTAT.stats, buffer_view_read_next_bytes(&view, stats_length), stats_length);
       }
       else
       {
         uint16_t size;
 
         fprintf(stderr, "WARNING: Don't know how to parse an answer of type 0x%04x (discarding)\n", dns->answers[i].type);
-        size = buffer_read_next_int16(buffer);
-        buffer_consume(buffer, size);
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        size = buffer_view_read_next_int16(&view);
+        if(!buffer_view_can_read(&view, size))
+          return NULL;
+
+        buffer_view_consume(&view, size);
       }
     }
   }
@@ -392,74 +539,113 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
   /* TODO */
   if(dns->authority_count)
   {
-    dns->authorities = (authority_t*) safe_malloc(dns->question_count * sizeof(question_t));
+    dns->authorities = (authority_t*) arena_alloc(arena, dns->question_count * sizeof(question_t));
   }
 
   if(dns->additional_count)
   {
-    dns->additionals = (additional_t*) safe_malloc(dns->additional_count * sizeof(additional_t));
+    dns->additionals = (additional_t*) arena_alloc(arena, dns->additional_count * sizeof(additional_t));
     for(i = 0; i < dns->additional_count; i++)
     {
-      dns->additionals[i].question   = buffer_read_next_dns_name(buffer); /* The question. */
-      dns->additionals[i].type       = buffer_read_next_int16(buffer); /* Type. */
-      dns->additionals[i].class      = buffer_read_next_int16(buffer); /* Class. */
-      dns->additionals[i].ttl        = buffer_read_next_int32(buffer); /* Time to live. */
-      dns->additionals[i].additional = (additional_types_t *) safe_malloc(sizeof(additional_types_t));
+      dns->additionals[i].question   = view_read_next_dns_name(&view, arena); /* The question. */
+      if(!dns->additionals[i].question || !buffer_view_can_read(&view, RR_RECORD_LENGTH))
+        return NULL;
+
+      record = buffer_view_read_next_bytes(&view, RR_RECORD_LENGTH);
+      dns->additionals[i].type       = BE_GET16(record); /* Type. */
+      dns->additionals[i].class      = BE_GET16(record + 2); /* Class. */
+      dns->additionals[i].ttl        = BE_GET32(record + 4); /* Time to live. */
+      dns->additionals[i].additional = (additional_types_t *) arena_alloc(arena, sizeof(additional_types_t));
 
       if(dns->additionals[i].type == DNS_TYPE_A) /* 0x0001 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care) */
+        if(!buffer_view_can_read(&view, 2 + 4))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care) */
 
-        dns->additionals[i].additional->A.address = safe_malloc(16);
-        buffer_read_next_ipv4_address(buffer, dns->additionals[i].additional->A.address);
+        dns->additionals[i].additional->A.address = arena_alloc(arena, 16);
+        view_read_next_ipv4_address(&view, dns->additionals[i].additional->A.address);
       }
       else if(dns->additionals[i].type == DNS_TYPE_NS) /* 0x0002 */
       {
-        buffer_read_next_int16(buffer); /* String size. */
-        dns->additionals[i].additional->NS.name = buffer_read_next_dns_name(buffer); /* The additional. */
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size. */
+        dns->additionals[i].additional->NS.name = view_read_next_dns_name(&view, arena); /* The additional. */
+        if(!dns->additionals[i].additional->NS.name)
+          return NULL;
       }
       else if(dns->additionals[i].type == DNS_TYPE_CNAME) /* 0x0005 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->CNAME.name = buffer_read_next_dns_name(buffer); /* The additional. */
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->additionals[i].additional->CNAME.name = view_read_next_dns_name(&view, arena); /* The additional. */
+        if(!dns->additionals[i].additional->CNAME.name)
+          return NULL;
       }
       else if(dns->additionals[i].type == DNS_TYPE_MX) /* 0x000F */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->MX.preference = buffer_read_next_int16(buffer); /* Preference. */
-        dns->additionals[i].additional->MX.name       = buffer_read_next_dns_name(buffer); /* The additional. */
+        if(!buffer_view_can_read(&view, 2 + 2))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->additionals[i].additional->MX.preference = buffer_view_read_next_int16(&view); /* Preference. */
+        dns->additionals[i].additional->MX.name       = view_read_next_dns_name(&view, arena); /* The additional. */
+        if(!dns->additionals[i].additional->MX.name)
+          return NULL;
       }
       else if(dns->additionals[i].type == DNS_TYPE_TEXT) /* 0x0010 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->TEXT.length = buffer_read_next_int8(buffer); /* The actual length. */
-        dns->additionals[i].additional->TEXT.text = safe_malloc(dns->additionals[i].additional->TEXT.length); /* Allocate room for the additional. */
-        buffer_read_next_bytes(buffer, dns->additionals[i].additional->TEXT.text, dns->additionals[i].additional->TEXT.length); /* Read the additional. */
+        if(!buffer_view_can_read(&view, 3))
+          return NULL;
+
+        record = buffer_view_read_next_bytes(&view, 3); /* String size (don't care), then the actual length. */
+        dns->additionals[i].additional->TEXT.length = record[2];
+        if(!buffer_view_can_read(&view, dns->additionals[i].additional->TEXT.length))
+          return NULL;
+
+        dns->additionals[i].additional->TEXT.text = arena_alloc(arena, dns->additionals[i].additional->TEXT.length + 1); /* Allocate room for the additional (and a terminator). */
+        memcpy(dns->additionals[i].additional->TEXT.text, buffer_view_read_next_bytes(&view, dns->additionals[i].additional->TEXT.length), dns->additionals[i].additional->TEXT.length); /* Read the additional. */
       }
 #ifndef WIN32
       else if(dns->additionals[i].type == DNS_TYPE_AAAA) /* 0x001C */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
+        if(!buffer_view_can_read(&view, 2 + 16))
+          return NULL;
 
-        dns->additionals[i].additional->AAAA.address = safe_malloc(40);
-        buffer_read_next_ipv6_address(buffer, dns->additionals[i].additional->AAAA.address);
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
+
+        dns->additionals[i].additional->AAAA.address = arena_alloc(arena, 40);
+        view_read_next_ipv6_address(&view, dns->additionals[i].additional->AAAA.address);
       }
 #endif
       else if(dns->additionals[i].type == DNS_TYPE_NB) /* 0x0020 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
+        if(!buffer_view_can_read(&view, 2 + 2 + 4))
+          return NULL;
+
+        buffer_view_read_next_int16(&view); /* String size (don't care). */
 
-        dns->additionals[i].additional->NB.flags   = buffer_read_next_int16(buffer);
-        dns->additionals[i].additional->NB.address = safe_malloc(16);
-        buffer_read_next_ipv4_address(buffer, dns->additionals[i].additional->NB.address);
+        dns->additionals[i].additional->NB.flags   = buffer_view_read_next_int16(&view);
+        dns->additionals[i].additional->NB.address = arena_alloc(arena, 16);
+        view_read_next_ipv4_address(&view, dns->additionals[i].additional->NB.address);
       }
       else if(dns->additionals[i].type == DNS_TYPE_NBSTAT) /* 0x0021 */
       {
         uint8_t j;
+        size_t  stats_length;
+        uint16_t size;
+
+        if(!buffer_view_can_read(&view, 2 + 1))
+          return NULL;
 
-        uint16_t size = buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->NBSTAT.name_count = buffer_read_next_int8(buffer);
-        dns->additionals[i].additional->NBSTAT.names      = (NBSTAT_name_t*) safe_malloc(sizeof(NBSTAT_name_t) * dns->additionals[i].additional->NBSTAT.name_count);
+        size = buffer_view_read_next_int16(&view); /* String size (don't care). */
+        dns->additionals[i].additional->NBSTAT.name_count = buffer_view_read_next_int8(&view);
+        dns->additionals[i].additional->NBSTAT.names      = (NBSTAT_name_t*) arena_alloc(arena, sizeof(NBSTAT_name_t) * dns->additionals[i].additional->NBSTAT.name_count);
 
         /* Read the list of names. */
         for(j = 0; j < dns->additionals[i].additional->NBSTAT.name_count; j++)
@@ -467,8 +653,12 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
           char  tmp[16];
           char *end;
 
+          /* The name, then its flags. */
+          if(!buffer_view_can_read(&view, 16 + 2))
+            return NULL;
+
           /* Read the full name. */
-          buffer_read_next_bytes(buffer, tmp, 16);
+          memcpy(tmp, buffer_view_read_next_bytes(&view, 16), 16);
 
           /* The type is the last byte -- read it then terminate the string properly. */
           dns->additionals[i].additional->NBSTAT.names[j].name_type = tmp[15];
@@ -480,35 +670,69 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
             *end = 0;
 
           /* Save this name. */
-          dns->additionals[i].additional->NBSTAT.names[j].name = safe_strdup(tmp);
+          dns->additionals[i].additional->NBSTAT.names[j].name = arena_strdup(arena, tmp);
 
           /* Finally, read the flags. */
-          dns->additionals[i].additional->NBSTAT.names[j].name_flags = buffer_read_next_int16(buffer);
+          dns->additionals[i].additional->NBSTAT.names[j].name_flags = buffer_view_read_next_int16(&view);
         }
 
         /* Read the rest of the data -- for a bit of safety so we don't read too far, do some math to figure out exactly what's left. */
-        buffer_read_next_bytes(buffer, dns->additionals[i].additional->NBSTAT.stats, MIN(64, size - 1 - (dns->additionals[i].additional->NBSTAT.name_count * 16)));
+        stats_length = MIN(64, size - 1 - (dns->additionals[i].additional->NBSTAT.name_count * 16));
+        if(!buffer_view_can_read(&view, stats_length))
+          return NULL;
+        memcpy(dns->additionals[i].additional->NBSTAT.stats, buffer_view_read_next_bytes(&view, stats_length), stats_length);
       }
       else
       {
         uint16_t size;
 
 /*        fprintf(stderr, "WARNING: Don't know how to parse an additional of type 0x%04x (discarding)\n", dns->additionals[i].type);*/
-        size = buffer_read_next_int16(buffer);
-        buffer_consume(buffer, size);
+        if(!buffer_view_can_read(&view, 2))
+          return NULL;
+
+        size = buffer_view_read_next_int16(&view);
+        if(!buffer_view_can_read(&view, size))
+          return NULL;
+
+        buffer_view_consume(&view, size);
       }
     }
   }
 
-  buffer_destroy(buffer);
 
   return dns;
 }
 
+dns_t *dns_create_from_packet(uint8_t *packet, size_t length, arena_t *arena)
+{
+  arena_t *scratch;
+  dns_t   *dns;
+
+  /* A bad packet is only found partway through parsing it, and half a dns_t
+   * can't be taken apart. That's no problem in an arena (it's reset anyway);
+   * otherwise, the packet's checked by parsing it into a scratch arena
+   * first. */
+  if(!arena)
+  {
+    scratch = arena_create();
+    dns     = dns_parse(packet, length, scratch);
+    arena_destroy(scratch);
+
+    if(!dns)
+      return NULL;
+  }
+
+  return dns_parse(packet, length, arena);
+}
+
 void dns_destroy(dns_t *dns)
 {
   uint32_t i;
 
+  /* Arena dns_ts go away when the arena is reset. */
+  if(dns->arena)
+    return;
+
   if(dns->questions)
   {
     /* Free the names. */
@@ -516,7 +740,7 @@ void dns_destroy(dns_t *dns)
       safe_free(dns->questions[i].name);
 
     /* Free the question. */
-    safe_free(dns->questions);
+    questions_free(dns, dns->questions, dns->question_count);
   }
 
   if(dns->answers)
@@ -563,9 +787,9 @@ void dns_destroy(dns_t *dns)
           safe_free(dns->answers[i].answer->NBSTAT.names[j].name);
         safe_free(dns->answers[i].answer->NBSTAT.names);
       }
-      safe_free(dns->answers[i].answer);
+      safe_pool_free(&answer_types_pool, dns->answers[i].answer);
     }
-    safe_free(dns->answers);
+    answers_free(dns, dns->answers, dns->answer_count);
   }
 
   if(dns->authorities)
@@ -622,7 +846,7 @@ void dns_destroy(dns_t *dns)
     safe_free(dns->additionals);
   }
 
-  safe_free(dns);
+  safe_pool_free(&dns_pool, dns);
 }
 
 void dns_set_trn_id(dns_t *dns, uint16_t trn_id)
@@ -653,12 +877,17 @@ void dns_add_question(dns_t *dns, char *name, dns_type_t type, dns_class_t class
   /* Create or embiggen the questions array (this isn't efficient, but it typically
    * isn't called much. */
   if(dns->questions)
-    dns->questions = (question_t*) safe_realloc(dns->questions, sizeof(question_t) * dns->question_count);
+  {
+    question_t *questions = questions_alloc(dns, dns->question_count);
+    memcpy(questions, dns->questions, sizeof(question_t) * (dns->question_count - 1));
+    questions_free(dns, dns->questions, dns->question_count - 1);
+    dns->questions = questions;
+  }
   else
-    dns->questions = (question_t*) safe_malloc(sizeof(question_t));
+    dns->questions = questions_alloc(dns, 1);
 
   /* Set up the last element. */
-  (dns->questions[dns->question_count - 1]).name  = safe_strdup(name);
+  (dns->questions[dns->question_count - 1]).name  = arena_strdup(dns->arena, name);
   (dns->questions[dns->question_count - 1]).type  = type;
   (dns->questions[dns->question_count - 1]).class = class;
 }
@@ -711,12 +940,17 @@ static void dns_add_answer(dns_t *dns, char *question, dns_type_t type, dns_clas
   /* Create or embiggen the answers array (this isn't efficient, but it typically
    * isn't called much. */
   if(dns->answers)
-    dns->answers = (answer_t*) safe_realloc(dns->answers, sizeof(answer_t) * dns->answer_count);
+  {
+    answer_t *answers = answers_alloc(dns, dns->answer_count);
+    memcpy(answers, dns->answers, sizeof(answer_t) * (dns->answer_count - 1));
+    answers_free(dns, dns->answers, dns->answer_count - 1);
+    dns->answers = answers;
+  }
   else
-    dns->answers = (answer_t*) safe_malloc(sizeof(answer_t));
+    dns->answers = answers_alloc(dns, 1);
 
   /* Set up the last element. */
-  (dns->answers[dns->answer_count - 1]).question  = safe_strdup(question);
+  (dns->answers[dns->answer_count - 1]).question  = arena_strdup(dns->arena, question);
   (dns->answers[dns->answer_count - 1]).type      = type;
   (dns->answers[dns->answer_count - 1]).class     = class;
   (dns->answers[dns->answer_count - 1]).ttl       = ttl;
@@ -726,37 +960,37 @@ static void dns_add_answer(dns_t *dns, char *question, dns_type_t type, dns_clas
 
 void dns_add_answer_A(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *address)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
-  answer->A.address      = safe_strdup(address);
+  answer_types_t *answer = answer_types_alloc(dns);
+  answer->A.address      = arena_strdup(dns->arena, address);
   dns_add_answer(dns, question, DNS_TYPE_A, class, ttl, answer);
 }
 
 void dns_add_answer_NS(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, char *name)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
-  answer->NS.name        = safe_strdup(name);
+  answer_types_t *answer = answer_types_alloc(dns);
+  answer->NS.name        = arena_strdup(dns->arena, name);
   dns_add_answer(dns, question, DNS_TYPE_NS, class, ttl, answer);
 }
 
 void dns_add_answer_CNAME(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *name)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
-  answer->CNAME.name     = safe_strdup(name);
+  answer_types_t *answer = answer_types_alloc(dns);
+  answer->CNAME.name     = arena_strdup(dns->arena, name);
   dns_add_answer(dns, question, DNS_TYPE_CNAME, class, ttl, answer);
 }
 
 void dns_add_answer_MX(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, uint16_t preference, char *name)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
+  answer_types_t *answer = answer_types_alloc(dns);
   answer->MX.preference  = preference;
-  answer->MX.name        = safe_strdup(name);
+  answer->MX.name        = arena_strdup(dns->arena, name);
   dns_add_answer(dns, question, DNS_TYPE_MX, class, ttl, answer);
 }
 
 void dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
-  uint8_t *text_copy     = safe_malloc(length);
+  answer_types_t *answer = answer_types_alloc(dns);
+  uint8_t *text_copy     = arena_alloc(dns->arena, length);
   memcpy(text_copy, text, length);
   answer->TEXT.text      = text_copy;
   answer->TEXT.length    = length;
@@ -766,8 +1000,8 @@ void dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_
 #ifndef WIN32
 void dns_add_answer_AAAA(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, char *address)
 {
-  answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
-  answer->AAAA.address   = safe_strdup(address);
+  answer_types_t *answer = answer_types_alloc(dns);
+  answer->AAAA.address   = arena_strdup(dns->arena, address);
   dns_add_answer(dns, question, DNS_TYPE_AAAA, class, ttl, answer);
 }
 #endif
@@ -810,9 +1044,9 @@ void dns_add_answer_NB(dns_t *dns,  char *question, uint8_t question_type, char
   /* Add the question as usual. */
   encoded = (char*)buffer_create_string_and_destroy(buffer, NULL);
 
-  answer = safe_malloc(sizeof(answer_types_t));
+  answer = answer_types_alloc(dns);
   answer->NB.flags     = flags;
-  answer->NB.address   = safe_strdup(address);
+  answer->NB.address   = arena_strdup(dns->arena, address);
   dns_add_answer(dns, encoded, DNS_TYPE_NB, class, ttl, answer);
 
   safe_free(encoded);
@@ -827,12 +1061,17 @@ static void dns_add_additional(dns_t *dns, char *question, dns_type_t type, dns_
   /* Create or embiggen the additionals array (this isn't efficient, but it typically
    * isn't called much. */
   if(dns->additionals)
-    dns->additionals = (additional_t*) safe_realloc(dns->additionals, sizeof(additional_t) * dns->additional_count);
+  {
+    additional_t *additionals = (additional_t*) arena_alloc(dns->arena, sizeof(additional_t) * dns->additional_count);
+    memcpy(additionals, dns->additionals, sizeof(additional_t) * (dns->additional_count - 1));
+    arena_free(dns->arena, dns->additionals);
+    dns->additionals = additionals;
+  }
   else
-    dns->additionals = (additional_t*) safe_malloc(sizeof(additional_t));
+    dns->additionals = (additional_t*) arena_alloc(dns->arena, sizeof(additional_t));
 
   /* Set up the last element. */
-  (dns->additionals[dns->additional_count - 1]).question   = safe_strdup(question);
+  (dns->additionals[dns->additional_count - 1]).question   = arena_strdup(dns->arena, question);
   (dns->additionals[dns->additional_count - 1]).type       = type;
   (dns->additionals[dns->additional_count - 1]).class      = class;
   (dns->additionals[dns->additional_count - 1]).ttl        = ttl;
@@ -841,37 +1080,37 @@ static void dns_add_additional(dns_t *dns, char *question, dns_type_t type, dns_
 
 void dns_add_additional_A(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *address)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
-  additional->A.address      = safe_strdup(address);
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
+  additional->A.address      = arena_strdup(dns->arena, address);
   dns_add_additional(dns, question, DNS_TYPE_A, class, ttl, additional);
 }
 
 void dns_add_additional_NS(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, char *name)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
-  additional->NS.name        = safe_strdup(name);
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
+  additional->NS.name        = arena_strdup(dns->arena, name);
   dns_add_additional(dns, question, DNS_TYPE_NS, class, ttl, additional);
 }
 
 void dns_add_additional_CNAME(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *name)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
-  additional->CNAME.name     = safe_strdup(name);
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
+  additional->CNAME.name     = arena_strdup(dns->arena, name);
   dns_add_additional(dns, question, DNS_TYPE_CNAME, class, ttl, additional);
 }
 
 void dns_add_additional_MX(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, uint16_t preference, char *name)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
   additional->MX.preference  = preference;
-  additional->MX.name        = safe_strdup(name);
+  additional->MX.name        = arena_strdup(dns->arena, name);
   dns_add_additional(dns, question, DNS_TYPE_MX, class, ttl, additional);
 }
 
 void dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
-  uint8_t *text_copy     = safe_malloc(length);
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
+  uint8_t *text_copy     = arena_alloc(dns->arena, length);
   memcpy(text_copy, text, length);
   additional->TEXT.text      = text_copy;
   additional->TEXT.length    = length;
@@ -881,8 +1120,8 @@ void dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uin
 #ifndef WIN32
 void dns_add_additional_AAAA(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, char *address)
 {
-  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
-  additional->AAAA.address   = safe_strdup(address);
+  additional_types_t *additional = arena_alloc(dns->arena, sizeof(additional_types_t));
+  additional->AAAA.address   = arena_strdup(dns->arena, address);
   dns_add_additional(dns, question, DNS_TYPE_AAAA, class, ttl, additional);
 }
 #endif
@@ -925,21 +1164,34 @@ void dns_add_additional_NB(dns_t *dns,  char *question, uint8_t question_type, c
   /* Add the question as usual. */
   encoded = (char*)buffer_create_string_and_destroy(buffer, NULL);
 
-  additional = safe_malloc(sizeof(additional_types_t));
+  additional = arena_alloc(dns->arena, sizeof(additional_types_t));
   additional->NB.flags     = flags;
-  additional->NB.address   = safe_strdup(address);
+  additional->NB.address   = arena_strdup(dns->arena, address);
   dns_add_additional(dns, encoded, DNS_TYPE_NB, class, ttl, additional);
 
   safe_free(encoded);
 }
 
+void dns_write_query_header(uint8_t *header, uint16_t trn_id, dns_flag_t flags)
+{
+  assert((flags & 0x8780) == flags);
+
+  BE_PUT16(header,      trn_id);
+  BE_PUT16(header + 2,  DNS_OPCODE_QUERY | flags | DNS_RCODE_SUCCESS);
+  BE_PUT16(header + 4,  1); /* Questions. */
+  BE_PUT16(header + 6,  0); /* Answers. */
+  BE_PUT16(header + 8,  0); /* Authorities. */
+  BE_PUT16(header + 10, 0); /* Additionals. */
+}
+
 uint8_t *dns_to_packet(dns_t *dns, size_t *length)
 {
   uint16_t i;
   uint16_t flags;
+  uint8_t *record;
 
   /* Create the buffer. */
-  buffer_t *buffer = buffer_create(BO_NETWORK);
+  buffer_t *buffer = buffer_create_arena(BO_NETWORK, dns->arena);
 
   /* Validate and format the flags:
    * +--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+--+
@@ -956,28 +1208,31 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
   flags = dns->opcode | dns->flags | dns->rcode;
 
   /* Marshall the base stuff. */
-  buffer_add_int16(buffer, dns->trn_id);
-  buffer_add_int16(buffer, flags);
-  buffer_add_int16(buffer, dns->question_count);
-  buffer_add_int16(buffer, dns->answer_count);
-  buffer_add_int16(buffer, dns->authority_count);
-  buffer_add_int16(buffer, dns->additional_count);
+  record = buffer_add_record(buffer, DNS_HEADER_LENGTH);
+  BE_PUT16(record,      dns->trn_id);
+  BE_PUT16(record + 2,  flags);
+  BE_PUT16(record + 4,  dns->question_count);
+  BE_PUT16(record + 6,  dns->answer_count);
+  BE_PUT16(record + 8,  dns->authority_count);
+  BE_PUT16(record + 10, dns->additional_count);
 
   /* Marshall the other fields. */
   for(i = 0; i < dns->question_count; i++)
   {
-    buffer_add_dns_name(buffer, (char*)dns->questions[i].name);
-    buffer_add_int16(buffer, dns->questions[i].type);
-    buffer_add_int16(buffer, dns->questions[i].class);
+    dns_buffer_add_name(buffer, (char*)dns->questions[i].name);
+    record = buffer_add_record(buffer, QUESTION_RECORD_LENGTH);
+    BE_PUT16(record,     dns->questions[i].type);
+    BE_PUT16(record + 2, dns->questions[i].class);
   }
 
   for(i = 0; i < dns->answer_count; i++)
   {
-    buffer_add_dns_name(buffer, (char*)dns->answers[i].question); /* Pointer to the name. */
+    dns_buffer_add_name(buffer, (char*)dns->answers[i].question); /* Pointer to the name. */
 /*    buffer_add_int16(buffer, 0xc00c);*/
-    buffer_add_int16(buffer, dns->answers[i].type); /* Type. */
-    buffer_add_int16(buffer, dns->answers[i].class); /* Class. */
-    buffer_add_int32(buffer, dns->answers[i].ttl); /* Time to live. */
+    record = buffer_add_record(buffer, RR_RECORD_LENGTH);
+    BE_PUT16(record,     dns->answers[i].type); /* Type. */
+    BE_PUT16(record + 2, dns->answers[i].class); /* Class. */
+    BE_PUT32(record + 4, dns->answers[i].ttl); /* Time to live. */
 
     if(dns->answers[i].type == DNS_TYPE_A)
     {
@@ -987,18 +1242,18 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
     else if(dns->answers[i].type == DNS_TYPE_NS)
     {
       buffer_add_int16(buffer, strlen(dns->answers[i].answer->NS.name) + 2);
-      buffer_add_dns_name(buffer, dns->answers[i].answer->NS.name);
+      dns_buffer_add_name(buffer, dns->answers[i].answer->NS.name);
     }
     else if(dns->answers[i].type == DNS_TYPE_CNAME)
     {
       buffer_add_int16(buffer, strlen(dns->answers[i].answer->CNAME.name) + 2);
-      buffer_add_dns_name(buffer, dns->answers[i].answer->CNAME.name);
+      dns_buffer_add_name(buffer, dns->answers[i].answer->CNAME.name);
     }
     else if(dns->answers[i].type == DNS_TYPE_MX)
     {
       buffer_add_int16(buffer, strlen(dns->answers[i].answer->MX.name) + 2 + 2);
       buffer_add_int16(buffer, dns->answers[i].answer->MX.preference);
-      buffer_add_dns_name(buffer, dns->answers[i].answer->MX.name);
+      dns_buffer_add_name(buffer, dns->answers[i].answer->MX.name);
     }
     else if(dns->answers[i].type == DNS_TYPE_TEXT)
     {
@@ -1032,11 +1287,12 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
 
   for(i = 0; i < dns->additional_count; i++)
   {
-    buffer_add_dns_name(buffer, (char*)dns->additionals[i].question); /* Pointer to the name. */
+    dns_buffer_add_name(buffer, (char*)dns->additionals[i].question); /* Pointer to the name. */
 /*    buffer_add_int16(buffer, 0xc00c);*/
-    buffer_add_int16(buffer, dns->additionals[i].type); /* Type. */
-    buffer_add_int16(buffer, dns->additionals[i].class); /* Class. */
-    buffer_add_int32(buffer, dns->additionals[i].ttl); /* Time to live. */
+    record = buffer_add_record(buffer, RR_RECORD_LENGTH);
+    BE_PUT16(record,     dns->additionals[i].type); /* Type. */
+    BE_PUT16(record + 2, dns->additionals[i].class); /* Class. */
+    BE_PUT32(record + 4, dns->additionals[i].ttl); /* Time to live. */
 
     if(dns->additionals[i].type == DNS_TYPE_A)
     {
@@ -1046,18 +1302,18 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
     else if(dns->additionals[i].type == DNS_TYPE_NS)
     {
       buffer_add_int16(buffer, strlen(dns->additionals[i].additional->NS.name) + 2);
-      buffer_add_dns_name(buffer, dns->additionals[i].additional->NS.name);
+      dns_buffer_add_name(buffer, dns->additionals[i].additional->NS.name);
     }
     else if(dns->additionals[i].type == DNS_TYPE_CNAME)
     {
       buffer_add_int16(buffer, strlen(dns->additionals[i].additional->CNAME.name) + 2);
-      buffer_add_dns_name(buffer, dns->additionals[i].additional->CNAME.name);
+      dns_buffer_add_name(buffer, dns->additionals[i].additional->CNAME.name);
     }
     else if(dns->additionals[i].type == DNS_TYPE_MX)
     {
       buffer_add_int16(buffer, strlen(dns->additionals[i].additional->MX.name) + 2 + 2);
       buffer_add_int16(buffer, dns->additionals[i].additional->MX.preference);
-      buffer_add_dns_name(buffer, dns->additionals[i].additional->MX.name);
+      dns_buffer_add_name(buffer, dns->additionals[i].additional->MX.name);
     }
     else if(dns->additionals[i].type == DNS_TYPE_TEXT)
     {
@@ -1161,7 +1417,7 @@ void dns_print(dns_t *dns)
 dns_t *dns_create_error(uint16_t trn_id, question_t question)
 {
   /* Create the DNS packet. */
-  dns_t *dns = dns_create(DNS_OPCODE_QUERY, DNS_FLAG_QR, DNS_RCODE_NAME_ERROR);
+  dns_t *dns = dns_create(DNS_OPCODE_QUERY, DNS_FLAG_QR, DNS_RCODE_NAME_ERROR, NULL);
   dns->trn_id = trn_id;
 
   /* Echo back the question. */
@@ -19,8 +19,13 @@
 #ifndef __DNS_H__
 #define __DNS_H__
 
+#include "buffer.h"
+#include "memory.h"
 #include "types.h"
 
+/* The length of the fixed part of a DNS packet. */
+#define DNS_HEADER_LENGTH 12
+
 /* Define a list of dns types. Windows defines these automatically,
  * so we need to wrap this in an #ifdef block. */
 #ifndef DNS_TYPE_A
@@ -370,14 +375,21 @@ typedef struct
   answer_t     *answers;
   authority_t  *authorities;
   additional_t *additionals;
+
+  /* Where everything above is allocated from, if it isn't the heap. */
+  arena_t      *arena;
 } dns_t;
 
-/* Allocate memory for a blank dns structure. Should be freed with dns_free(). */
-dns_t   *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode);
+/* Allocate memory for a blank dns structure. Should be freed with dns_free().
+ * If an arena is given (see memory.h), the structure and everything that's
+ * added to it come from the arena, and dns_destroy() does nothing. */
+dns_t   *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode, arena_t *arena);
 
 /* Take a DNS packet as a stream of bytes, and create a dns_t structure from it.
- * Should also be cleaned up with dns_destroy(). */
-dns_t   *dns_create_from_packet(uint8_t *packet, size_t length);
+ * Should also be cleaned up with dns_destroy(). The arena works the same way
+ * as it does for dns_create(). Returns NULL if the packet is cut short or
+ * otherwise malformed. */
+dns_t   *dns_create_from_packet(uint8_t *packet, size_t length, arena_t *arena);
 
 /* De-allocate memory and resources from a dns object. */
 void     dns_destroy(dns_t *dns);
@@ -412,9 +424,17 @@ void     dns_add_additional_AAAA(dns_t *dns,  char *question, dns_class_t class,
 #endif
 void     dns_add_additional_NB(dns_t *dns,  char *question, uint8_t question_type, char *scope, dns_class_t class, uint32_t ttl, uint16_t flags, char *address);
 
-/* Convert a DNS request into a packet that can be sent on port 53. Memory has to be freed. */
+/* Convert a DNS request into a packet that can be sent on port 53. Memory has to be freed
+ * (unless the dns_t is in an arena, in which case the packet is too). */
 uint8_t *dns_to_packet(dns_t *dns, size_t *length);
 
+/* Add a name to a buffer the way it's sent on the wire (as labels). */
+void     dns_buffer_add_name(buffer_t *buffer, char *name);
+
+/* Write the header of a query with one question (DNS_HEADER_LENGTH bytes), for
+ * when the rest of the query is sent from elsewhere. */
+void     dns_write_query_header(uint8_t *header, uint16_t trn_id, dns_flag_t flags);
+
 /* Print the DNS request. Useful for debugging. */
 void     dns_print(dns_t *dns);
 
@@ -6,6 +6,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,6 +27,7 @@
 #include "driver_exec.h"
 #include "driver_listener.h"
 #include "driver_socks4.h"
+#include "io_thread.h"
 
 /* Default options */
 #define VERSION "0.00"
@@ -46,6 +48,20 @@ driver_socks4_t   *driver_socks4   = NULL;
 /* Output drivers. */
 driver_dns_t     *driver_dns     = NULL;
 
+/* The thread the output driver runs on (if --iothread is set). */
+io_thread_t      *io_thread      = NULL;
+
+#ifdef SIGUSR1
+/* Set by SIGUSR1, which asks for the memory stats (they're printed from the
+ * main loop, since it isn't safe to from a signal handler). */
+static volatile sig_atomic_t memory_stats_requested = 0;
+
+static void request_memory_stats(int signal)
+{
+  memory_stats_requested = 1;
+}
+#endif
+
 static SELECT_RESPONSE_t timeout(void *group, void *param)
 {
   message_post_heartbeat();
@@ -60,6 +76,9 @@ static void cleanup()
   message_post_shutdown();
   message_cleanup();
 
+  if(io_thread)
+    io_thread_destroy(io_thread);
+
   if(group)
     select_group_destroy(group);
 
@@ -74,6 +93,8 @@ static void cleanup()
   if(driver_socks4)
     driver_socks4_destroy(driver_socks4);
 
+  log_cleanup();
+
   print_memory();
 }
 
@@ -89,6 +110,17 @@ void usage(char *name, char *message)
 "                         the server list\n"
 " --tunnel <host:port>    Requests the server to forward all messages to the\n"
 "                         given server and port on the user's behalf.\n"
+" --longpoll              Ask the server to hold idle polls until it has data\n"
+"                         (lower latency and fewer queries while idle)\n"
+" --fec <copies|auto>     Send this many redundant copies of each packet, to\n"
+"                         ride out drops without waiting to retransmit;\n"
+"                         'auto' picks the count based on packet loss\n"
+" --iothread              Do the DNS traffic on a thread of its own, so busy\n"
+"                         local connections can't hold it up\n"
+" --queue                 Queue messages between the sessions and drivers, and\n"
+"                         handle them in batches once per loop\n"
+" --uring                 Use io_uring for socket I/O when the kernel supports\n"
+"                         it (falls back to epoll/select)\n"
 "\n"
 "Input options:\n"
 " --console --stdin       Send/receive output to the console [default]\n"
@@ -107,6 +139,8 @@ void usage(char *name, char *message)
 "Debug options:\n"
 " -d                      Display more debug info (can be used multiple times)\n"
 " -q                      Display less debug info (can be used multiple times)\n"
+" --trace <module>        Display all debug info from one part of the program:\n"
+"                         session, packet, dns, drivers, or messages\n"
 "\n"
 "%s\n"
 "\n"
@@ -126,6 +160,11 @@ int main(int argc, char *argv[])
     {"name",    required_argument, 0, 0}, /* Name */
     {"n",       required_argument, 0, 0},
     {"tunnel",  required_argument, 0, 0}, /* Tunnel */
+    {"longpoll", no_argument,      0, 0}, /* Long-polling */
+    {"fec",     required_argument, 0, 0}, /* Forward error correction */
+    {"iothread", no_argument,      0, 0}, /* Separate I/O thread */
+    {"uring",   no_argument,       0, 0}, /* io_uring */
+    {"queue",   no_argument,       0, 0}, /* Queued message bus */
 
     /* Console options. */
     {"stdin",   no_argument,       0, 0}, /* Enable console (default) */
@@ -152,6 +191,7 @@ int main(int argc, char *argv[])
     /* Debug options */
     {"d",       no_argument,       0, 0}, /* More debug */
     {"q",       no_argument,       0, 0}, /* Less debug */
+    {"trace",   required_argument, 0, 0}, /* All debug, for one module */
     {0,         0,                 0, 0}  /* End */
   };
 
@@ -172,6 +212,9 @@ int main(int argc, char *argv[])
 
   NBBOOL            input_set = FALSE;
   NBBOOL            output_set = FALSE;
+  char             *domain = NULL;
+  NBBOOL            use_io_thread = FALSE;
+  NBBOOL            use_uring = FALSE;
 
   log_level_t       min_log_level = LOG_LEVEL_WARNING;
 
@@ -221,6 +264,41 @@ int main(int argc, char *argv[])
           tunnel.host = optarg;
           tunnel.port = atoi(colon + 1);
         }
+        else if(!strcmp(option_name, "longpoll"))
+        {
+          message_post_config_int("longpoll", TRUE);
+        }
+        else if(!strcmp(option_name, "fec"))
+        {
+          char *end;
+          long  copies;
+
+          if(!strcmp(optarg, "auto"))
+          {
+            message_post_config_int("fec_auto", TRUE);
+          }
+          else
+          {
+            /* All of it has to be a number (atoi() would take "abc" as 0). */
+            copies = strtol(optarg, &end, 10);
+            if(end == optarg || *end != '\0' || copies < 0 || copies != (int)copies)
+              usage(argv[0], "--fec must be a number of copies or 'auto'");
+
+            message_post_config_int("fec_copies", (int)copies);
+          }
+        }
+        else if(!strcmp(option_name, "iothread"))
+        {
+          use_io_thread = TRUE;
+        }
+        else if(!strcmp(option_name, "uring"))
+        {
+          use_uring = TRUE;
+        }
+        else if(!strcmp(option_name, "queue"))
+        {
+          message_set_queued(TRUE);
+        }
 
         /* Console-specific options. */
         else if(!strcmp(option_name, "stdin"))
@@ -268,7 +346,7 @@ int main(int argc, char *argv[])
             usage(argv[0], "More than one of --dns and --tcp can't be set!");
 
           output_set = TRUE;
-          driver_dns = driver_dns_create(group, optarg);
+          domain = optarg;
         }
         else if(!strcmp(option_name, "dnshost") || !strcmp(option_name, "host"))
         {
@@ -290,6 +368,12 @@ int main(int argc, char *argv[])
           min_log_level++;
           log_set_min_console_level(min_log_level);
         }
+        else if(!strcmp(option_name, "trace"))
+        {
+          if(log_get_module(optarg) == LOG_MODULE_COUNT)
+            usage(argv[0], "Unknown module for --trace");
+          log_set_module_level(log_get_module(optarg), LOG_LEVEL_INFO);
+        }
         else
         {
           usage(argv[0], "Unknown option");
@@ -317,7 +401,28 @@ int main(int argc, char *argv[])
       usage(argv[0], "Please provide a domain (either with --dns or at the end of the commandline)");
       exit(1);
     }
-    driver_dns = driver_dns_create(group, argv[optind]);
+    domain = argv[optind];
+  }
+
+  /* Now that we know whether it gets its own thread, create the output
+   * driver. */
+  if(use_io_thread)
+  {
+    io_thread  = io_thread_create(group, domain);
+    driver_dns = io_thread->driver_dns;
+  }
+  else
+  {
+    driver_dns = driver_dns_create(group, domain);
+  }
+
+  /* Switch the groups over once all their sockets are in. */
+  if(use_uring)
+  {
+    if(!select_group_use_uring(group))
+      LOG_WARNING("io_uring isn't available; using the usual select_group instead");
+    if(io_thread && !select_group_use_uring(io_thread->group))
+      LOG_WARNING("io_uring isn't available for the I/O thread; it's using the usual select_group instead");
   }
 
   if(driver_console)
@@ -370,8 +475,33 @@ int main(int argc, char *argv[])
 
   /* Add the timeout function */
   select_set_timeout(group, timeout, NULL);
+
+#ifdef SIGUSR1
+  {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = request_memory_stats;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+  }
+#endif
+
   while(TRUE)
+  {
+#ifdef SIGUSR1
+    if(memory_stats_requested)
+    {
+      memory_stats_requested = 0;
+      print_memory_stats();
+    }
+#endif
+
+    /* Handle whatever the last loop queued up (if the bus is queued) before
+     * waiting for more. */
+    message_flush();
     select_group_do_select(group, 1000);
+  }
 
   return 0;
 }
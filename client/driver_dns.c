@@ -2,10 +2,13 @@
  * Created July/2013
  * By Ron Bowes
  */
+#define LOG_MODULE LOG_MODULE_DNS
+
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "buffer.h"
 #include "dns.h"
@@ -21,6 +24,19 @@
 
 #define MAX_FIELD_LENGTH 63
 #define MAX_DNS_LENGTH   255
+#define MAX_TXT_LENGTH   255
+
+/* The most labels the encoded data can be split into. */
+#define MAX_LABELS       (MAX_DNS_LENGTH / MAX_FIELD_LENGTH + 1)
+
+/* Path probing: the shortest packet that's worth using at all, how long to
+ * wait for each probe (seconds), how many times to try each length before
+ * writing it off, and how many queries in a row can go unanswered before we
+ * assume the path changed and probe it again. */
+#define PROBE_MIN_LENGTH  24
+#define PROBE_TIMEOUT     1
+#define PROBE_ATTEMPTS    2
+#define REPROBE_THRESHOLD 8
 
 static size_t max_dnscat_length(char *domain, encoding_type_t type)
 {
@@ -46,23 +62,221 @@ static size_t max_dnscat_length(char *domain, encoding_type_t type)
   return get_decoded_size(type, available_size);
 }
 
-static SELECT_RESPONSE_t dns_data_closed(void *group, int socket, void *param)
+/* Give up on everything (see 'exit_status' in driver_dns.h). On the I/O
+ * thread, this returns, and the driver stops sending while it waits. */
+static void driver_exit(driver_dns_t *driver, int status)
 {
-  LOG_FATAL("DNS socket closed!");
-  exit(0);
+  if(!driver->to_sessions)
+    exit(status);
 
-  return SELECT_OK;
+  driver->is_closed = TRUE;
+  __atomic_store_n(&driver->exit_status, status, __ATOMIC_RELEASE);
+  ring_wake(driver->to_sessions);
+}
+
+/* A datagram socket never closes (an empty datagram is just ignored), but it can fail. */
+static SELECT_RESPONSE_t dns_data_error(void *group, int socket, int err, void *param)
+{
+  LOG_FATAL("DNS socket error: %d", err);
+  driver_exit((driver_dns_t*) param, 0);
+
+  return SELECT_CLOSE_REMOVE;
+}
+
+static void send_packet(driver_dns_t *driver, packet_t *packet);
+
+/* Tell the sessions about a setting, either directly or (if we're on the I/O
+ * thread) through the ring. */
+static void post_config_int(driver_dns_t *driver, char *name, int value)
+{
+  ring_slot_t *slot;
+
+  if(!driver->to_sessions)
+  {
+    message_post_config_int(name, value);
+    return;
+  }
+
+  slot = ring_get_free_slot(driver->to_sessions);
+  if(!slot)
+  {
+    LOG_ERROR("The session thread isn't keeping up; dropping config: %s => %d", name, value);
+    return;
+  }
+
+  slot->type   = DNS_SLOT_CONFIG;
+  slot->value  = value;
+  slot->length = strlen(name) + 1;
+  strncpy((char*)slot->data, name, RING_SLOT_SIZE);
+  slot->data[RING_SLOT_SIZE - 1] = '\0';
+  ring_push(driver->to_sessions);
+}
+
+/* Hand an incoming packet to the sessions, the same way. */
+static void post_packet_in(driver_dns_t *driver, packet_t *packet, uint8_t *data, size_t length)
+{
+  ring_slot_t *slot;
+
+  if(!driver->to_sessions)
+  {
+    message_post_packet_in(packet);
+    return;
+  }
+
+  /* Like any other lost packet, the server will send it again. */
+  slot = length <= RING_SLOT_SIZE ? ring_get_free_slot(driver->to_sessions) : NULL;
+  if(!slot)
+  {
+    LOG_WARNING("The session thread isn't keeping up; dropping an incoming packet");
+    return;
+  }
+
+  slot->type   = DNS_SLOT_PACKET_IN;
+  slot->length = length;
+  memcpy(slot->data, data, length);
+  ring_push(driver->to_sessions);
+}
+
+static void probe_send(driver_dns_t *driver)
+{
+  packet_t *packet;
+
+  /* Upstream probes are padded out to the length being tested and ask for the
+   * smallest possible reply; downstream probes are the other way around. */
+  if(driver->probe_state == PROBE_STATE_UPSTREAM)
+    packet = packet_create_ping(PACKET_PING_SIZE, driver->probe_length - PACKET_PING_SIZE);
+  else
+    packet = packet_create_ping(driver->probe_length, 0);
+
+  driver->probe_packet_id = packet->packet_id;
+  driver->probe_sent      = time(NULL);
+  driver->probe_attempts++;
+
+  LOG_INFO("Probing %s with %u bytes (attempt %d)", driver->probe_state == PROBE_STATE_UPSTREAM ? "upstream" : "downstream", (unsigned int)driver->probe_length, driver->probe_attempts);
+  send_packet(driver, packet);
+  packet_destroy(packet);
+}
+
+static void probe_direction(driver_dns_t *driver, probe_state_t state)
+{
+  driver->probe_state = state;
+  driver->probe_good  = 0;
+
+  if(state == PROBE_STATE_UPSTREAM)
+    driver->probe_bad = max_dnscat_length(driver->domain, HEX) + 1;
+  else
+    driver->probe_bad = get_decoded_size(HEX, MAX_TXT_LENGTH) + 1;
+
+  /* Try the biggest length first; on a clean path that's the only probe. */
+  driver->probe_length   = driver->probe_bad - 1;
+  driver->probe_attempts = 0;
+  probe_send(driver);
+}
+
+static void probe_start(driver_dns_t *driver)
+{
+  LOG_WARNING("Probing the DNS path for the largest usable packet sizes...");
+  probe_direction(driver, PROBE_STATE_UPSTREAM);
+}
+
+static void probe_finish(driver_dns_t *driver)
+{
+  LOG_WARNING("DNS path probe finished: %u bytes upstream, %u bytes downstream", (unsigned int)driver->max_upstream, (unsigned int)driver->max_downstream);
+
+  driver->probe_state = PROBE_STATE_IDLE;
+  driver->unanswered  = 0;
+
+  post_config_int(driver, "max_packet_length",     driver->max_upstream);
+  post_config_int(driver, "max_downstream_length", driver->max_downstream);
+}
+
+static void probe_result(driver_dns_t *driver, NBBOOL success)
+{
+  if(success)
+    driver->probe_good = driver->probe_length;
+  else
+    driver->probe_bad = driver->probe_length;
+  driver->probe_attempts = 0;
+
+  if(driver->probe_good == 0)
+  {
+    /* Make sure the shortest length works before searching above it. */
+    if(driver->probe_bad > PROBE_MIN_LENGTH)
+    {
+      driver->probe_length = PROBE_MIN_LENGTH;
+      probe_send(driver);
+      return;
+    }
+
+    /* Nothing got through, which usually means the server doesn't understand
+     * PINGs; keep whatever sizes we were already using. */
+    LOG_ERROR("No probes made it through the DNS path; keeping the current packet sizes");
+    probe_finish(driver);
+    return;
+  }
+
+  if(driver->probe_bad - driver->probe_good > 1)
+  {
+    driver->probe_length = (driver->probe_good + driver->probe_bad) / 2;
+    probe_send(driver);
+    return;
+  }
+
+  /* This direction is narrowed down as far as it goes. */
+  if(driver->probe_state == PROBE_STATE_UPSTREAM)
+  {
+    driver->max_upstream = driver->probe_good;
+    probe_direction(driver, PROBE_STATE_DOWNSTREAM);
+  }
+  else
+  {
+    driver->max_downstream = driver->probe_good;
+    probe_finish(driver);
+  }
+}
+
+static void probe_check_timeout(driver_dns_t *driver)
+{
+  if(driver->probe_state == PROBE_STATE_IDLE)
+    return;
+
+  if(time(NULL) - driver->probe_sent < PROBE_TIMEOUT)
+    return;
+
+  if(driver->probe_attempts < PROBE_ATTEMPTS)
+    probe_send(driver);
+  else
+    probe_result(driver, FALSE);
+}
+
+static void handle_ping(driver_dns_t *driver, packet_t *packet, size_t length)
+{
+  if(driver->probe_state == PROBE_STATE_IDLE || packet->packet_id != driver->probe_packet_id)
+  {
+    LOG_INFO("Received a stale PING response; ignoring");
+    return;
+  }
+
+  /* A downstream probe only counts if all of it arrived, untouched. */
+  if(driver->probe_state == PROBE_STATE_DOWNSTREAM)
+    probe_result(driver, packet->body.ping.is_intact && length == driver->probe_length);
+  else
+    probe_result(driver, TRUE);
 }
 
 static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
 {
   driver_dns_t *driver_dns = param;
-  dns_t        *dns        = dns_create_from_packet(data, length);
+  dns_t        *dns        = dns_create_from_packet(data, length, driver_dns->in_arena);
 
-  LOG_INFO("DNS response received (%d bytes)", length);
+  LOG_INFO("DNS response received (%u bytes)", (unsigned int)length);
 
-  /* TODO */
-  if(dns->rcode != DNS_RCODE_SUCCESS)
+  /* Anything we can't make sense of is dropped. */
+  if(!dns)
+  {
+    LOG_ERROR("Couldn't parse the DNS response; ignoring it");
+  }
+  else if(dns->rcode != DNS_RCODE_SUCCESS)
   {
     /* TODO: Handle errors more gracefully */
     switch(dns->rcode)
@@ -110,19 +324,27 @@ static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, uint8_t *data,
     {
       /* Loop through the part of the answer before the 'domain' */
       size_t   length = dns->answers[0].answer->TEXT.length;
-      uint8_t *data = decode(HEX, answer, &length);
-
-      /* Pass the buffer to the caller */
-      if(length > 0)
-      {
-        /* Parse the dnscat packet. */
-        packet_t *packet = packet_parse(data, length);
+      uint8_t *data = decode(HEX, answer, &length, driver_dns->in_arena);
 
-        /* Pass the data elsewhere. */
-        message_post_packet_in(packet);
+      /* Parse the dnscat packet; one that's cut short or that we don't
+       * understand is dropped. */
+      packet_t *packet = data ? packet_parse(data, length, driver_dns->in_arena) : NULL;
 
-        packet_destroy(packet);
-        safe_free(data);
+      if(!packet)
+      {
+        LOG_ERROR("Couldn't parse the dnscat packet in the DNS response; ignoring it");
+      }
+      else
+      {
+        /* Any answer at all means the path is still alive. */
+        driver_dns->unanswered = 0;
+
+        /* PINGs belong to the path probe; everything else goes to the
+         * sessions. */
+        if(packet->packet_type == PACKET_TYPE_PING)
+          handle_ping(driver_dns, packet, length);
+        else
+          post_packet_in(driver_dns, packet, data, length);
       }
     }
   }
@@ -131,66 +353,137 @@ static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, uint8_t *data,
     LOG_ERROR("Unknown DNS type returned");
   }
 
-  dns_destroy(dns);
+  /* Everything above was allocated from the arena. */
+  arena_reset(driver_dns->in_arena);
 
   return SELECT_OK;
 }
 
 static void handle_start(driver_dns_t *driver)
 {
-  message_post_config_int("max_packet_length", max_dnscat_length(driver->domain, HEX));
+  /* Until the probe says otherwise, assume the longest names DNS allows and
+   * let the server decide how long its responses are. */
+  driver->max_upstream   = max_dnscat_length(driver->domain, HEX);
+  driver->max_downstream = 0;
+
+  /* The sessions hold off until the probe posts the sizes. */
+  probe_start(driver);
 }
 
-/* This function expects to receive the proper length of data. */
-static void handle_packet_out(driver_dns_t *driver, packet_t *packet)
+/* This function expects to receive the proper length of data. When it's done,
+ * it resets the outgoing arena, so 'data' can be from there. */
+static void send_bytes(driver_dns_t *driver, uint8_t *data, size_t length)
 {
-  size_t        i;
-  dns_t        *dns;
-  buffer_t     *buffer;
-  uint8_t      *encoded_bytes;
-  size_t        encoded_length;
-  uint8_t      *dns_bytes;
-  size_t        dns_length;
-
-  size_t        length;
-  uint8_t      *data = packet_to_bytes(packet, &length);
-  char         *encoded_string;
+  size_t          i;
+  char           *encoded_string;
+  size_t          encoded_length;
+  size_t          name_length;
+  uint8_t         header[DNS_HEADER_LENGTH];
+  uint8_t         label_lengths[MAX_LABELS];
+  size_t          label_count = 0;
+  data_segment_t  segments[2 + (MAX_LABELS * 2)];
+  size_t          segment_count = 0;
+
+  /* The socket's gone, and we're just waiting for the main thread to exit. */
+  if(driver->is_closed)
+    return;
 
   assert(driver->s != -1); /* Make sure we have a valid socket. */
   assert(data); /* Make sure they aren't trying to send NULL. */
   assert(length > 0); /* Make sure they aren't trying to send 0 bytes. */
   assert(length <= max_dnscat_length(driver->domain, HEX));
 
-  buffer = buffer_create(BO_BIG_ENDIAN);
+  /* The query's sent in pieces, straight from where they are: the header, then
+   * each label of the encoded data (its length, then the label itself, which
+   * points into the encoded string), then the suffix. */
+  dns_write_query_header(header, rand() & 0xFFFF, DNS_FLAG_RD);
+  segments[segment_count].data   = header;
+  segments[segment_count].length = DNS_HEADER_LENGTH;
+  segment_count++;
 
   /* Encode the string appropriately. */
-  encoded_string = encode(HEX, data, length);
+  encoded_string = encode(HEX, data, length, driver->out_arena);
+  encoded_length = strlen(encoded_string);
+
+  for(i = 0; i < encoded_length; i += MAX_FIELD_LENGTH)
+  {
+    label_lengths[label_count] = MIN(MAX_FIELD_LENGTH, encoded_length - i);
+
+    segments[segment_count].data   = &label_lengths[label_count];
+    segments[segment_count].length = 1;
+    segment_count++;
+
+    segments[segment_count].data   = encoded_string + i;
+    segments[segment_count].length = label_lengths[label_count];
+    segment_count++;
+
+    label_count++;
+  }
+
+  segments[segment_count].data   = driver->query_suffix;
+  segments[segment_count].length = driver->query_suffix_length;
+  segment_count++;
+
+  /* Double-check we didn't mess up the length (as labels, the name takes one
+   * more byte than it would as a string). */
+  name_length = encoded_length + label_count + driver->query_suffix_length - 4;
+  assert(name_length <= MAX_DNS_LENGTH + 1);
+
+  LOG_INFO("Sending DNS query for: %s.%s to %s:%d", encoded_string, driver->domain, driver->dns_host, driver->dns_port);
+  udp_send_segments(driver->s, driver->dns_host, driver->dns_port, segments, segment_count);
+
+  arena_reset(driver->out_arena);
+}
+
+static void send_packet(driver_dns_t *driver, packet_t *packet)
+{
+  uint8_t data[MAX_PACKET_SIZE];
+  size_t  length = packet_write(packet, data, MAX_PACKET_SIZE);
+
+  /* The sessions never make a packet longer than we can send. */
+  assert(length);
+
+  send_bytes(driver, data, length);
+}
 
-  /* Add the periods as needed. */
-  for(i = 0; i < strlen(encoded_string); i += MAX_FIELD_LENGTH)
+/* Keep track of how many queries have been sent since we heard back. */
+static void count_sent(driver_dns_t *driver, int count)
+{
+  /* If the path has gone quiet, its capacity may have changed under us. */
+  driver->unanswered += count;
+  if(driver->probe_state == PROBE_STATE_IDLE && driver->unanswered >= REPROBE_THRESHOLD)
   {
-    buffer_add_bytes(buffer, encoded_string + i, MIN(MAX_FIELD_LENGTH, strlen(encoded_string) - i));
-    buffer_add_int8(buffer, '.');
+    LOG_WARNING("%d queries in a row went unanswered", driver->unanswered);
+    probe_start(driver);
   }
-  safe_free(encoded_string);
+  else
+  {
+    probe_check_timeout(driver);
+  }
+}
 
-  buffer_add_ntstring(buffer, driver->domain);
-  encoded_bytes = buffer_create_string_and_destroy(buffer, &encoded_length);
+static void handle_packet_out(driver_dns_t *driver, uint8_t *data, size_t length)
+{
+  send_bytes(driver, data, length);
+  count_sent(driver, 1);
+}
 
-  /* Double-check we didn't mess up the length. */
-  assert(encoded_length <= MAX_DNS_LENGTH);
+/* Send a batch of packets (see message_subscribe_batch()) back to back, and
+ * only do the bookkeeping once. */
+static void handle_packet_out_batch(message_t *messages, size_t count, void *d)
+{
+  driver_dns_t *driver = (driver_dns_t*) d;
+  size_t        i;
 
-  dns = dns_create(DNS_OPCODE_QUERY, DNS_FLAG_RD, DNS_RCODE_SUCCESS);
-  dns_add_question(dns, (char*)encoded_bytes, DNS_TYPE_TEXT, DNS_CLASS_IN);
-  dns_bytes = dns_to_packet(dns, &dns_length);
+  for(i = 0; i < count; i++)
+    send_packet(driver, messages[i].message.packet_out.packet);
 
-  LOG_INFO("Sending DNS query for: %s to %s:%d", encoded_bytes, driver->dns_host, driver->dns_port);
-  udp_send(driver->s, driver->dns_host, driver->dns_port, dns_bytes, dns_length);
+  count_sent(driver, count);
+}
 
-  safe_free(data);
-  safe_free(dns_bytes);
-  safe_free(encoded_bytes);
-  dns_destroy(dns);
+static void handle_heartbeat(driver_dns_t *driver)
+{
+  probe_check_timeout(driver);
 }
 
 static void handle_message(message_t *message, void *d)
@@ -203,8 +496,8 @@ static void handle_message(message_t *message, void *d)
       handle_start(driver_dns);
       break;
 
-    case MESSAGE_PACKET_OUT:
-      handle_packet_out(driver_dns, message->message.packet_out.packet);
+    case MESSAGE_HEARTBEAT:
+      handle_heartbeat(driver_dns);
       break;
 
     default:
@@ -213,9 +506,10 @@ static void handle_message(message_t *message, void *d)
   }
 }
 
-driver_dns_t *driver_dns_create(select_group_t *group, char *domain)
+static driver_dns_t *create(select_group_t *group, char *domain)
 {
   driver_dns_t *driver_dns = (driver_dns_t*) safe_malloc(sizeof(driver_dns_t));
+  buffer_t     *suffix;
 
   /* Create the actual DNS socket. */
   LOG_INFO("Creating UDP (DNS) socket");
@@ -229,21 +523,68 @@ driver_dns_t *driver_dns_create(select_group_t *group, char *domain)
   /* Set the domain. */
   driver_dns->domain   = domain;
 
+  /* Build the part of the query that never changes. */
+  suffix = buffer_create(BO_NETWORK);
+  dns_buffer_add_name(suffix, domain);
+  buffer_add_int16(suffix, DNS_TYPE_TEXT);
+  buffer_add_int16(suffix, DNS_CLASS_IN);
+  driver_dns->query_suffix = buffer_create_string_and_destroy(suffix, &driver_dns->query_suffix_length);
+
+  driver_dns->in_arena  = arena_create();
+  driver_dns->out_arena = arena_create();
+
+  driver_dns->exit_status = -1;
+
   /* If it succeeds, add it to the select_group */
-  select_group_add_socket(group, driver_dns->s, SOCKET_TYPE_STREAM, driver_dns);
+  select_group_add_socket(group, driver_dns->s, SOCKET_TYPE_DATAGRAM, driver_dns);
   select_set_recv(group, driver_dns->s, recv_socket_callback);
-  select_set_closed(group, driver_dns->s, dns_data_closed);
+  select_set_error(group, driver_dns->s, dns_data_error);
+
+  return driver_dns;
+}
+
+driver_dns_t *driver_dns_create(select_group_t *group, char *domain)
+{
+  driver_dns_t *driver_dns = create(group, domain);
 
   /* Subscribe to the messages we care about. */
   message_subscribe(MESSAGE_START, handle_message, driver_dns);
-  message_subscribe(MESSAGE_PACKET_OUT, handle_message, driver_dns);
+  message_subscribe_batch(MESSAGE_PACKET_OUT, handle_packet_out_batch, driver_dns);
+  message_subscribe(MESSAGE_HEARTBEAT,  handle_message, driver_dns);
+
+  return driver_dns;
+}
+
+driver_dns_t *driver_dns_create_threaded(select_group_t *group, char *domain, ring_t *to_sessions)
+{
+  driver_dns_t *driver_dns = create(group, domain);
+
+  driver_dns->to_sessions = to_sessions;
 
   return driver_dns;
 }
 
+void driver_dns_start(driver_dns_t *driver)
+{
+  handle_start(driver);
+}
+
+void driver_dns_send(driver_dns_t *driver, uint8_t *data, size_t length)
+{
+  handle_packet_out(driver, data, length);
+}
+
+void driver_dns_heartbeat(driver_dns_t *driver)
+{
+  handle_heartbeat(driver);
+}
+
 void driver_dns_destroy(driver_dns_t *driver)
 {
   if(driver->dns_host)
     safe_free(driver->dns_host);
+  safe_free(driver->query_suffix);
+  arena_destroy(driver->in_arena);
+  arena_destroy(driver->out_arena);
   safe_free(driver);
 }
@@ -1,22 +1,87 @@
 #ifndef __DRIVER_DNS_H__
 #define __DRIVER_DNS_H__
 
+#include <time.h>
+
+#include "memory.h"
+#include "ring.h"
 #include "select_group.h"
 #include "session.h"
 
+typedef enum
+{
+  PROBE_STATE_IDLE,       /* Not probing; the sizes we have are in use. */
+  PROBE_STATE_UPSTREAM,   /* Looking for the longest query that reaches the server. */
+  PROBE_STATE_DOWNSTREAM, /* Looking for the longest response that makes it back. */
+} probe_state_t;
+
+/* What the driver puts in the ring back to the sessions, when it's running on
+ * the I/O thread (see io_thread.h). */
+typedef enum
+{
+  DNS_SLOT_PACKET_IN, /* A dnscat packet from the server ('data'). */
+  DNS_SLOT_CONFIG,    /* A setting ('data' is the name, 'value' the value). */
+} dns_slot_type_t;
+
 typedef struct
 {
   int        s;
 
   char      *domain;
   char      *dns_host;
+
+  /* The end of every query: the domain (as labels), then the type and class.
+   * It's built once, and sent as it is each time. */
+  uint8_t   *query_suffix;
+  size_t     query_suffix_length;
   int        dns_port;
 
   NBBOOL     is_closed;
 
+  /* The largest dnscat packets that survive the path in each direction (a
+   * max_downstream of 0 means we don't know, and the server picks). */
+  size_t     max_upstream;
+  size_t     max_downstream;
+
+  /* The number of queries sent since we last heard anything back. */
+  int        unanswered;
+
+  /* The state of the path probe. 'probe_good' is the longest length that's
+   * known to work (0 if none has yet), and 'probe_bad' the shortest that's
+   * known not to; the search narrows the space between them. */
+  probe_state_t probe_state;
+  size_t        probe_good;
+  size_t        probe_bad;
+  size_t        probe_length;
+  uint16_t      probe_packet_id;
+  int           probe_attempts;
+  time_t        probe_sent;
+
+  /* When the driver has a thread to itself, it hands packets and settings to
+   * the sessions through this instead of posting messages (NULL otherwise). */
+  ring_t       *to_sessions;
+
+  /* Only the main thread can exit (the cleanup that runs belongs to it), so
+   * when the driver can't go on while it's on the I/O thread, it sets this to
+   * the status to exit with, and wakes the main thread up. -1 otherwise. */
+  int           exit_status;
+
+  /* Scratch memory for handling one response and for building one query
+   * (see memory.h); each is reset when it's done. They're separate because
+   * handling a response can send a query. */
+  arena_t      *in_arena;
+  arena_t      *out_arena;
 } driver_dns_t;
 
 driver_dns_t *driver_dns_create(select_group_t *group, char *domain);
 void          driver_dns_destroy();
 
+/* For running the driver on its own thread: it doesn't subscribe to any
+ * messages, so whoever owns the thread calls the functions below instead,
+ * and everything it would post goes into 'to_sessions'. */
+driver_dns_t *driver_dns_create_threaded(select_group_t *group, char *domain, ring_t *to_sessions);
+void          driver_dns_start(driver_dns_t *driver);
+void          driver_dns_send(driver_dns_t *driver, uint8_t *data, size_t length);
+void          driver_dns_heartbeat(driver_dns_t *driver);
+
 #endif
@@ -1,3 +1,6 @@
+#define LOG_MODULE LOG_MODULE_DRIVERS
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -88,6 +91,9 @@ static void handle_start(driver_exec_t *driver)
   close(driver->pipe_stdin[PIPE_READ]);
   close(driver->pipe_stdout[PIPE_WRITE]);
 
+  /* Nothing else reads from the pipe, so it can be non-blocking (which lets it be read till it's empty). */
+  fcntl(driver->pipe_stdout[PIPE_READ], F_SETFL, O_NONBLOCK);
+
   /* Add the sub-process's stdout as a socket. */
   select_group_add_socket(driver->group, driver->pipe_stdout[PIPE_READ], SOCKET_TYPE_STREAM, driver);
   select_set_recv(driver->group,   driver->pipe_stdout[PIPE_READ], exec_callback);
@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_DRIVERS
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -20,10 +22,35 @@ typedef struct _listener_client_t
   uint16_t           session_id;
   driver_listener_t *driver;
 
-  struct _listener_client_t *next;
+  NBBOOL             is_paused;  /* Set when we've asked the session to hold off. */
+  NBBOOL             is_closing; /* Set when the session's gone, but there's still data to send. */
+  NBBOOL             is_session_closed;
 } client_entry_t;
 
-static client_entry_t *first_client = NULL;
+/* Once this much data is waiting on a client that isn't reading it, ask the
+ * session to stop taking more from the server till it catches up. */
+#define MAX_QUEUED 65536
+
+static void handle_data_in(message_t *message, void *c);
+static void handle_session_closed(message_t *message, void *c);
+
+/* Have the session's data (and its closing) come straight to the client. */
+static void subscribe_client(client_entry_t *client)
+{
+  message_subscribe_session(MESSAGE_DATA_IN,        client->session_id, handle_data_in,        client);
+  message_subscribe_session(MESSAGE_SESSION_CLOSED, client->session_id, handle_session_closed, client);
+}
+
+/* The client belongs to both its socket and its session; it's freed once
+ * they're both gone. */
+static void client_release(client_entry_t *client)
+{
+  if(client->s != -1 || !client->is_session_closed)
+    return;
+
+  safe_free(client->address);
+  safe_free(client);
+}
 
 static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, size_t length, char *addr, uint16_t port, void *c)
 {
@@ -40,11 +67,40 @@ static SELECT_RESPONSE_t client_closed(void *group, int socket, void *c)
 
   message_post_close_session(client->session_id);
 
-  /* TODO: Unlink it from the entry list. */
+  client->s = -1;
+  client_release(client);
 
   return SELECT_CLOSE_REMOVE;
 }
 
+static SELECT_RESPONSE_t client_error(void *group, int socket, int err, void *c)
+{
+  LOG_WARNING("Error on listener socket %d (%d), closing", socket, err);
+
+  return client_closed(group, socket, c);
+}
+
+static SELECT_RESPONSE_t client_drained(void *group, int socket, void *c)
+{
+  client_entry_t *client = (client_entry_t*) c;
+
+  /* If the session's already gone, we were just waiting to finish sending. */
+  if(client->is_closing)
+  {
+    client->s = -1;
+    client_release(client);
+    return SELECT_CLOSE_REMOVE;
+  }
+
+  if(client->is_paused)
+  {
+    client->is_paused = FALSE;
+    message_post_resume_session(client->session_id);
+  }
+
+  return SELECT_OK;
+}
+
 static SELECT_RESPONSE_t listener_closed(void *group, int socket, void *c)
 {
   LOG_FATAL("Listener socket went away!");
@@ -57,21 +113,28 @@ static SELECT_RESPONSE_t listener_accept(void *group, int s, void *d)
 {
   driver_listener_t *driver = (driver_listener_t*) d;
   client_entry_t *client = safe_malloc(sizeof(client_entry_t));
+  char           *address;
 
-  client->s          = tcp_accept(s, &client->address, &client->port);
+  /* (The address tcp_accept() returns is overwritten by the next one.) */
+  client->s          = tcp_accept(s, &address, &client->port);
+  client->address    = safe_strdup(address);
   if(driver->tunnel_host)
     client->session_id = message_post_create_session_with_tunnel(driver->tunnel_host, driver->tunnel_port);
   else
     client->session_id = message_post_create_session();
+  subscribe_client(client);
   client->driver     = driver;
-  client->next       = first_client;
-  first_client       = client;
+  client->is_paused  = FALSE;
+  client->is_closing = FALSE;
+  client->is_session_closed = FALSE;
 
   LOG_WARNING("Received a connection from %s:%d (created session %d)", client->address, client->port, client->session_id);
 
   select_group_add_socket(group, client->s, SOCKET_TYPE_STREAM, client);
   select_set_recv(group, client->s, client_recv);
   select_set_closed(group, client->s, client_closed);
+  select_set_error(group, client->s, client_error);
+  select_set_drained(group, client->s, client_drained);
 
   return SELECT_OK;
 }
@@ -92,36 +155,41 @@ static void handle_start(driver_listener_t *driver)
   select_set_closed(driver->group, driver->s, listener_closed);
 }
 
-static void handle_session_closed(driver_listener_t *driver, uint16_t session_id)
+static void handle_session_closed(message_t *message, void *c)
 {
-  client_entry_t *client;
+  client_entry_t *client = (client_entry_t*) c;
+
+  message_unsubscribe_session(MESSAGE_DATA_IN,        client->session_id);
+  message_unsubscribe_session(MESSAGE_SESSION_CLOSED, client->session_id);
+  client->is_session_closed = TRUE;
 
-  for(client = first_client; client; client = client->next)
+  /* Let anything that's still queued up go out first. */
+  if(client->s != -1 && select_group_get_queued(client->driver->group, client->s) > 0)
   {
-    if(client->session_id == session_id)
-    {
-      tcp_close(client->s);
-      return;
-    }
+    client->is_closing = TRUE;
+    return;
   }
 
-  LOG_WARNING("Couldn't find listener to close: session %d", session_id);
+  if(client->s != -1)
+  {
+    select_group_remove_and_close_socket(client->driver->group, client->s);
+    client->s = -1;
+  }
+  client_release(client);
 }
 
-static void handle_data_in(driver_listener_t *driver, uint16_t session_id, uint8_t *data, size_t length)
+static void handle_data_in(message_t *message, void *c)
 {
-  client_entry_t *client;
+  client_entry_t *client = (client_entry_t*) c;
 
-  for(client = first_client; client; client = client->next)
+  select_group_send(client->driver->group, client->s, message->message.data_in.data, message->message.data_in.length);
+
+  /* Don't let a slow client pile up data without limit. */
+  if(!client->is_paused && select_group_get_queued(client->driver->group, client->s) > MAX_QUEUED)
   {
-    if(client->session_id == session_id)
-    {
-      tcp_send(client->s, data, length);
-      return;
-    }
+    client->is_paused = TRUE;
+    message_post_pause_session(client->session_id);
   }
-
-  LOG_WARNING("Couldn't find listener to send data to: %d bytes to session %d", length, session_id);
 }
 
 static void handle_shutdown()
@@ -139,14 +207,6 @@ static void handle_message(message_t *message, void *d)
       handle_start(driver);
       break;
 
-    case MESSAGE_SESSION_CLOSED:
-      handle_session_closed(driver, message->message.session_closed.session_id);
-      break;
-
-    case MESSAGE_DATA_IN:
-      handle_data_in(driver, message->message.data_in.session_id, message->message.data_in.data, message->message.data_in.length);
-      break;
-
     case MESSAGE_SHUTDOWN:
       handle_shutdown();
       break;
@@ -169,8 +229,6 @@ driver_listener_t *driver_listener_create(select_group_t *group, char *host, int
 
   /* Subscribe to the messages we care about. */
   message_subscribe(MESSAGE_START,           handle_message, driver);
-  message_subscribe(MESSAGE_SESSION_CLOSED,  handle_message, driver);
-  message_subscribe(MESSAGE_DATA_IN,         handle_message, driver);
   message_subscribe(MESSAGE_SHUTDOWN,        handle_message, driver);
 
   return driver;
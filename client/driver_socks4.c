@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_DRIVERS
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -27,10 +29,47 @@ typedef struct _socks4_client_t
   uint16_t         session_id;
   driver_socks4_t *driver;
 
-  struct _socks4_client_t *next;
+  NBBOOL           is_paused;  /* Set when we've asked the session to hold off. */
+  NBBOOL           is_closing; /* Set when the session's gone, but there's still data to send. */
+  NBBOOL           is_session_closed;
 } client_entry_t;
 
-static client_entry_t *first_client = NULL;
+/* Once this much data is waiting on a client that isn't reading it, ask the
+ * session to stop taking more from the server till it catches up. */
+#define MAX_QUEUED 65536
+
+static void handle_data_in(message_t *message, void *c);
+static void handle_session_closed(message_t *message, void *c);
+
+/* Have the session's data (and its closing) come straight to the client. */
+static void subscribe_client(client_entry_t *client)
+{
+  message_subscribe_session(MESSAGE_DATA_IN,        client->session_id, handle_data_in,        client);
+  message_subscribe_session(MESSAGE_SESSION_CLOSED, client->session_id, handle_session_closed, client);
+}
+
+/* The client belongs to its socket and (once the SOCKS request is granted)
+ * its session; it's freed once they're both gone. */
+static void client_release(client_entry_t *client)
+{
+  if(client->in_socket != -1 || (client->socks_initialized && !client->is_session_closed))
+    return;
+
+  safe_free(client->in_host);
+  safe_free(client);
+}
+
+/* Turn down a bad SOCKS request (there's no session yet, so the client's
+ * done with as soon as its socket is). */
+static SELECT_RESPONSE_t client_reject(client_entry_t *client, buffer_t *buffer)
+{
+  buffer_destroy(buffer);
+
+  client->in_socket = -1;
+  client_release(client);
+
+  return SELECT_CLOSE_REMOVE;
+}
 
 static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, size_t length, char *addr, uint16_t port, void *c)
 {
@@ -59,7 +98,7 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
     if(buffer_get_remaining_bytes(buffer) < 1)
     {
       LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'version'");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
 
     version = buffer_read_next_int8(buffer);
@@ -67,12 +106,12 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
     if(version != 4)
     {
       LOG_ERROR("Invalid SOCKS4 request: We only support SOCKS4, but version %d was requested", version);
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
     if(buffer_get_remaining_bytes(buffer) < 1)
     {
       LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'command_code'");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
 
     command_code = buffer_read_next_int8(buffer);
@@ -80,12 +119,12 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
     if(command_code != 1)
     {
       LOG_ERROR("Invalid SOCKS4 request: We only support streaming, but port binding was requested");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
     if(buffer_get_remaining_bytes(buffer) < 2)
     {
       LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'port'");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
 
     port = buffer_read_next_int16(buffer);
@@ -93,7 +132,7 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
     if(buffer_get_remaining_bytes(buffer) < 4)
     {
       LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'ip'");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
 
     ip = buffer_read_next_int32(buffer);
@@ -101,7 +140,7 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
     if(!buffer_can_read_ntstring(buffer))
     {
       LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'user id'");
-      return SELECT_CLOSE_REMOVE;
+      return client_reject(client, buffer);
     }
 
     buffer_read_next_ntstring(buffer, user_id, 1024);
@@ -112,7 +151,7 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
       if(!buffer_can_read_ntstring(buffer))
       {
         LOG_ERROR("Invalid SOCKS4 request: not enough bytes to read 'hostname'");
-        return SELECT_CLOSE_REMOVE;
+        return client_reject(client, buffer);
       }
 
       buffer_read_next_ntstring(buffer, hostname, 1024);
@@ -127,8 +166,11 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
 
     }
 
+    buffer_destroy(buffer);
+
     /* Create the session before responding. */
     client->session_id = message_post_create_session_with_tunnel(hostname, port);
+    subscribe_client(client);
 
     /* Mark it as initialized. */
     client->socks_initialized = TRUE;
@@ -142,7 +184,7 @@ static SELECT_RESPONSE_t client_recv(void *group, int socket, uint8_t *data, siz
 
     /* Convert the buffer to bytes. */
     data_out = buffer_create_string_and_destroy(buffer_out, &data_out_length);
-    tcp_send(socket, data_out, data_out_length);
+    select_group_send(group, socket, data_out, data_out_length);
     safe_free(data_out);
   }
 
@@ -153,13 +195,43 @@ static SELECT_RESPONSE_t client_closed(void *group, int socket, void *c)
 {
   client_entry_t *client = (client_entry_t*) c;
 
-  message_post_close_session(client->session_id);
+  if(client->socks_initialized)
+    message_post_close_session(client->session_id);
 
-  /* TODO: Unlink it from the entry list. */
+  client->in_socket = -1;
+  client_release(client);
 
   return SELECT_CLOSE_REMOVE;
 }
 
+static SELECT_RESPONSE_t client_error(void *group, int socket, int err, void *c)
+{
+  LOG_WARNING("Error on socks4 socket %d (%d), closing", socket, err);
+
+  return client_closed(group, socket, c);
+}
+
+static SELECT_RESPONSE_t client_drained(void *group, int socket, void *c)
+{
+  client_entry_t *client = (client_entry_t*) c;
+
+  /* If the session's already gone, we were just waiting to finish sending. */
+  if(client->is_closing)
+  {
+    client->in_socket = -1;
+    client_release(client);
+    return SELECT_CLOSE_REMOVE;
+  }
+
+  if(client->is_paused)
+  {
+    client->is_paused = FALSE;
+    message_post_resume_session(client->session_id);
+  }
+
+  return SELECT_OK;
+}
+
 static SELECT_RESPONSE_t listener_closed(void *group, int socket, void *c)
 {
   LOG_FATAL("socks4 socket went away!");
@@ -172,18 +244,24 @@ static SELECT_RESPONSE_t listener_accept(void *group, int s, void *d)
 {
   driver_socks4_t *driver = (driver_socks4_t*) d;
   client_entry_t *client = safe_malloc(sizeof(client_entry_t));
+  char           *in_host;
 
-  client->in_socket = tcp_accept(s, &client->in_host, &client->in_port);
+  /* (The address tcp_accept() returns is overwritten by the next one.) */
+  client->in_socket = tcp_accept(s, &in_host, &client->in_port);
+  client->in_host   = safe_strdup(in_host);
   client->socks_initialized = FALSE;
+  client->is_paused  = FALSE;
+  client->is_closing = FALSE;
+  client->is_session_closed = FALSE;
   client->driver     = driver;
-  client->next       = first_client;
-  first_client       = client;
 
   LOG_WARNING("Received a connection from %s:%d (created session %d)", client->in_host, client->in_port, client->session_id);
 
   select_group_add_socket(group, client->in_socket, SOCKET_TYPE_STREAM, client);
   select_set_recv(group, client->in_socket, client_recv);
   select_set_closed(group, client->in_socket, client_closed);
+  select_set_error(group, client->in_socket, client_error);
+  select_set_drained(group, client->in_socket, client_drained);
 
   return SELECT_OK;
 }
@@ -204,38 +282,43 @@ static void handle_start(driver_socks4_t *driver)
   select_set_closed(driver->group, driver->s, listener_closed);
 }
 
-static void handle_session_closed(driver_socks4_t *driver, uint16_t session_id)
+static void handle_session_closed(message_t *message, void *c)
 {
-  client_entry_t *client;
+  client_entry_t *client = (client_entry_t*) c;
+
+  message_unsubscribe_session(MESSAGE_DATA_IN,        client->session_id);
+  message_unsubscribe_session(MESSAGE_SESSION_CLOSED, client->session_id);
+  client->is_session_closed = TRUE;
 
-  for(client = first_client; client; client = client->next)
+  /* Let anything that's still queued up go out first. */
+  if(client->in_socket != -1 && select_group_get_queued(client->driver->group, client->in_socket) > 0)
   {
-    if(client->session_id == session_id)
-    {
-      tcp_close(client->in_socket);
-      return;
-    }
+    client->is_closing = TRUE;
+    return;
   }
 
-  LOG_WARNING("Couldn't find socks4 to close: session %d", session_id);
+  if(client->in_socket != -1)
+  {
+    select_group_remove_and_close_socket(client->driver->group, client->in_socket);
+    client->in_socket = -1;
+  }
+  client_release(client);
 }
 
 /* Note: This won't be used until after the SOCKS connection is established, because that's when the dnscat
  * connection actually starts. */
-static void handle_data_in(driver_socks4_t *driver, uint16_t session_id, uint8_t *data, size_t length)
+static void handle_data_in(message_t *message, void *c)
 {
-  client_entry_t *client;
+  client_entry_t *client = (client_entry_t*) c;
+
+  select_group_send(client->driver->group, client->in_socket, message->message.data_in.data, message->message.data_in.length);
 
-  for(client = first_client; client; client = client->next)
+  /* Don't let a slow client pile up data without limit. */
+  if(!client->is_paused && select_group_get_queued(client->driver->group, client->in_socket) > MAX_QUEUED)
   {
-    if(client->session_id == session_id)
-    {
-      tcp_send(client->in_socket, data, length);
-      return;
-    }
+    client->is_paused = TRUE;
+    message_post_pause_session(client->session_id);
   }
-
-  LOG_WARNING("Couldn't find socks4 to send data to: %d bytes to session %d", length, session_id);
 }
 
 static void handle_shutdown()
@@ -253,14 +336,6 @@ static void handle_message(message_t *message, void *d)
       handle_start(driver);
       break;
 
-    case MESSAGE_SESSION_CLOSED:
-      handle_session_closed(driver, message->message.session_closed.session_id);
-      break;
-
-    case MESSAGE_DATA_IN:
-      handle_data_in(driver, message->message.data_in.session_id, message->message.data_in.data, message->message.data_in.length);
-      break;
-
     case MESSAGE_SHUTDOWN:
       handle_shutdown();
       break;
@@ -281,8 +356,6 @@ driver_socks4_t *driver_socks4_create(select_group_t *group, char *host, uint16_
 
   /* Subscribe to the messages we care about. */
   message_subscribe(MESSAGE_START,           handle_message, driver);
-  message_subscribe(MESSAGE_SESSION_CLOSED,  handle_message, driver);
-  message_subscribe(MESSAGE_DATA_IN,         handle_message, driver);
   message_subscribe(MESSAGE_SHUTDOWN,        handle_message, driver);
 
   return driver;
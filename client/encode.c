@@ -14,22 +14,22 @@
 
 #include "encode.h"
 
-char *encode(encoding_type_t type, uint8_t *value, size_t  length)
+char *encode(encoding_type_t type, uint8_t *value, size_t  length, arena_t *arena)
 {
   if(type == HEX)
-    return hex_encode(value, length);
+    return hex_encode(value, length, arena);
   else if(type == BASE32)
-    return base32_encode(value, length);
+    return base32_encode(value, length, arena);
   else
     return NULL;
 }
 
-uint8_t *decode(encoding_type_t type, char *text,  size_t *length)
+uint8_t *decode(encoding_type_t type, char *text,  size_t *length, arena_t *arena)
 {
   if(type == HEX)
-    return hex_decode(text, length);
+    return hex_decode(text, length, arena);
   else if(type == BASE32)
-    return base32_decode(text, length);
+    return base32_decode(text, length, arena);
   else
     return NULL;
 }
@@ -49,12 +49,12 @@ size_t hex_get_decoded_size(size_t encoded_bytes)
 }
 
 static char *hex_chars = "0123456789abcdef";
-char *hex_encode(uint8_t *value, size_t length)
+char *hex_encode(uint8_t *value, size_t length, arena_t *arena)
 {
   char *encoded;
   size_t i;
 
-  encoded = safe_malloc((length * 2) + 1);
+  encoded = arena_alloc(arena, (length * 2) + 1);
 
   for(i = 0; i < length; i++)
   {
@@ -66,10 +66,10 @@ char *hex_encode(uint8_t *value, size_t length)
   return encoded;
 }
 
-uint8_t *hex_decode(char *text, size_t *length)
+uint8_t *hex_decode(char *text, size_t *length, arena_t *arena)
 {
   size_t in_length = (*length == -1) ? strlen(text) : (*length);
-  uint8_t *decoded = safe_malloc(in_length / 2);
+  uint8_t *decoded = arena_alloc(arena, in_length / 2);
   size_t i;
 
   *length = hex_get_decoded_size(in_length);
@@ -86,7 +86,7 @@ uint8_t *hex_decode(char *text, size_t *length)
       c1 = text[i] - 'A' + 10;
     else
     {
-      safe_free(decoded);
+      arena_free(arena, decoded);
       return NULL;
     }
 
@@ -98,7 +98,7 @@ uint8_t *hex_decode(char *text, size_t *length)
       c2 = text[i+1] - 'A' + 10;
     else
     {
-      safe_free(decoded);
+      arena_free(arena, decoded);
       return NULL;
     }
 
@@ -158,7 +158,7 @@ size_t base32_get_decoded_size(size_t encoded_bytes)
   return length;
 }
 
-char *base32_encode(uint8_t *data, size_t length)
+char *base32_encode(uint8_t *data, size_t length, arena_t *arena)
 {
   char *encoded;
   size_t i;
@@ -166,7 +166,7 @@ char *base32_encode(uint8_t *data, size_t length)
   /* 5 bytes become 8 */
   size_t out_size = ((((length) + 4) / 5) * 8) + 1;
 
-  encoded = safe_malloc(out_size);
+  encoded = arena_alloc(arena, out_size);
 
   size_t index_out = 0;
   for(i = 0; i < length; i += 5)
@@ -259,7 +259,7 @@ char *base32_encode(uint8_t *data, size_t length)
   return encoded;
 }
 
-uint8_t *base32_decode(const char *text, size_t *length)
+uint8_t *base32_decode(const char *text, size_t *length, arena_t *arena)
 {
   size_t   in_length = (*length == -1) ? strlen(text) : (*length);
   uint8_t *decoded;
@@ -267,7 +267,7 @@ uint8_t *base32_decode(const char *text, size_t *length)
 
   *length = base32_get_decoded_size(in_length);
 
-  decoded = safe_malloc(*length);
+  decoded = arena_alloc(arena, *length);
 
   size_t index_out = 0;
   for(i = 0; i < in_length; i += 8)
@@ -341,15 +341,15 @@ int main(int argc, const char *argv[])
 
     /* Try to send 'invalid' data into the decoder. */
     size_out = -1;
-    other_output = base32_decode(input, &size_out);
+    other_output = base32_decode(input, &size_out, NULL);
     if(other_output)
       safe_free(other_output);
 
 
     input[size_in] = 0;
-    output = base32_encode(input, size_in);
+    output = base32_encode(input, size_in, NULL);
     size_out = -1;
-    other_output = base32_decode(output, &size_out);
+    other_output = base32_decode(output, &size_out, NULL);
 
     predicted_size = base32_get_decoded_size(strlen(output));
     if(predicted_size != size_out)
@@ -371,13 +371,13 @@ int main(int argc, const char *argv[])
     safe_free(other_output);
     /* Try to send 'invalid' data into the decoder. */
     size_out = -1;
-    other_output = hex_decode(input, &size_out);
+    other_output = hex_decode(input, &size_out, NULL);
     if(other_output)
       safe_free(other_output);
 
-    output = hex_encode(input, size_in);
+    output = hex_encode(input, size_in, NULL);
     size_out = -1;
-    other_output = hex_decode(output, &size_out);
+    other_output = hex_decode(output, &size_out, NULL);
 
     if(size_out != size_in)
     {
@@ -1,6 +1,11 @@
 #ifndef __ENCODE_H__
 #define __ENCODE_H__
 
+#include "memory.h"
+
+/* The encoded and decoded strings are allocated from the arena, or from the
+ * heap if it's NULL (see memory.h). */
+
 typedef enum
 {
   HEX,
@@ -8,15 +13,15 @@ typedef enum
 } encoding_type_t;
 
 size_t   get_decoded_size(encoding_type_t type, size_t encoded_bytes);
-char    *encode(encoding_type_t type, uint8_t *value, size_t  length);
-uint8_t *decode(encoding_type_t type, char    *text,  size_t *length);
+char    *encode(encoding_type_t type, uint8_t *value, size_t  length, arena_t *arena);
+uint8_t *decode(encoding_type_t type, char    *text,  size_t *length, arena_t *arena);
 
 size_t   hex_get_decoded_size(size_t encoded_bytes);
-char    *hex_encode(uint8_t *value, size_t length);
-uint8_t *hex_decode(char *text,     size_t *length);
+char    *hex_encode(uint8_t *value, size_t length, arena_t *arena);
+uint8_t *hex_decode(char *text,     size_t *length, arena_t *arena);
 
 size_t   base32_get_decoded_size(size_t encoded_bytes);
-char    *base32_encode(uint8_t *data,    size_t length);
-uint8_t *base32_decode(const char *text, size_t *length);
+char    *base32_encode(uint8_t *data,    size_t length, arena_t *arena);
+uint8_t *base32_decode(const char *text, size_t *length, arena_t *arena);
 
 #endif
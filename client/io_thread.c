@@ -0,0 +1,194 @@
+/* io_thread.c
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ */
+
+#define LOG_MODULE LOG_MODULE_DNS
+
+#include <string.h>
+
+#include "log.h"
+#include "memory.h"
+#include "message.h"
+#include "packet.h"
+#include "types.h"
+
+#include "io_thread.h"
+
+/* How many packets can be waiting in each direction. */
+#define RING_SLOTS 256
+
+/* How long the I/O thread waits (in ms) before it gives the driver a
+ * heartbeat. */
+#define HEARTBEAT_TIMEOUT 1000
+
+/*** I/O thread ***/
+
+static SELECT_RESPONSE_t io_timeout(void *group, void *param)
+{
+  io_thread_t *io = (io_thread_t*) param;
+
+  driver_dns_heartbeat(io->driver_dns);
+
+  return SELECT_OK;
+}
+
+/* The main thread pushed some packets; send them. */
+static SELECT_RESPONSE_t to_dns_woken(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
+{
+  io_thread_t *io = (io_thread_t*) param;
+  ring_slot_t *slot;
+
+  while((slot = ring_get_used_slot(io->to_dns)))
+  {
+    driver_dns_send(io->driver_dns, slot->data, slot->length);
+    ring_pop(io->to_dns);
+  }
+
+  return SELECT_OK;
+}
+
+static void *io_thread_main(void *param)
+{
+  io_thread_t *io = (io_thread_t*) param;
+
+  driver_dns_start(io->driver_dns);
+
+  while(!__atomic_load_n(&io->is_stopping, __ATOMIC_ACQUIRE))
+    select_group_do_select(io->group, HEARTBEAT_TIMEOUT);
+
+  return NULL;
+}
+
+/*** Main thread ***/
+
+/* The I/O thread pushed some packets (or settings); pass them along. */
+static SELECT_RESPONSE_t to_sessions_woken(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
+{
+  io_thread_t *io = (io_thread_t*) param;
+  ring_slot_t *slot;
+  int          exit_status;
+
+  while((slot = ring_get_used_slot(io->to_sessions)))
+  {
+    if(slot->type == DNS_SLOT_PACKET_IN)
+    {
+      /* The driver already parsed it once, so it's good. */
+      packet_t *packet = packet_parse(slot->data, slot->length, io->in_arena);
+      if(packet)
+        message_post_packet_in(packet);
+      arena_reset(io->in_arena);
+    }
+    else if(slot->type == DNS_SLOT_CONFIG)
+    {
+      message_post_config_int((char*)slot->data, slot->value);
+    }
+
+    ring_pop(io->to_sessions);
+  }
+
+  /* The driver can't go on, and exiting is up to us (see driver_dns.h). */
+  exit_status = __atomic_load_n(&io->driver_dns->exit_status, __ATOMIC_ACQUIRE);
+  if(exit_status != -1)
+    exit(exit_status);
+
+  return SELECT_OK;
+}
+
+static void handle_start(io_thread_t *io)
+{
+  if(pthread_create(&io->thread, NULL, io_thread_main, io))
+  {
+    LOG_FATAL("Couldn't start the I/O thread!");
+    exit(1);
+  }
+
+  io->is_running = TRUE;
+}
+
+static void handle_packet_out(io_thread_t *io, packet_t *packet)
+{
+  ring_slot_t *slot = ring_get_free_slot(io->to_dns);
+
+  /* The packet's written straight into the slot. Like any other lost packet,
+   * one that doesn't make it will be retransmitted. */
+  if(!slot || !(slot->length = packet_write(packet, slot->data, RING_SLOT_SIZE)))
+  {
+    LOG_WARNING("The I/O thread isn't keeping up; dropping an outgoing packet");
+  }
+  else
+  {
+    slot->type = 0;
+    ring_push(io->to_dns);
+  }
+}
+
+static void handle_message(message_t *message, void *param)
+{
+  io_thread_t *io = (io_thread_t*) param;
+
+  switch(message->type)
+  {
+    case MESSAGE_START:
+      handle_start(io);
+      break;
+
+    case MESSAGE_PACKET_OUT:
+      handle_packet_out(io, message->message.packet_out.packet);
+      break;
+
+    default:
+      LOG_FATAL("io_thread received an invalid message!");
+      abort();
+  }
+}
+
+io_thread_t *io_thread_create(select_group_t *main_group, char *domain)
+{
+  io_thread_t *io = (io_thread_t*) safe_malloc(sizeof(io_thread_t));
+
+  io->main_group  = main_group;
+  io->group       = select_group_create();
+  io->to_dns      = ring_create(RING_SLOTS);
+  io->to_sessions = ring_create(RING_SLOTS);
+  io->in_arena    = arena_create();
+  io->driver_dns  = driver_dns_create_threaded(io->group, domain, io->to_sessions);
+
+  /* Each side sleeps in its own select_group, and is woken up by its ring. */
+  select_group_add_socket(io->group, ring_get_wake_fd(io->to_dns), SOCKET_TYPE_STREAM, io);
+  select_set_recv(io->group, ring_get_wake_fd(io->to_dns), to_dns_woken);
+  select_set_timeout(io->group, io_timeout, io);
+
+  select_group_add_socket(main_group, ring_get_wake_fd(io->to_sessions), SOCKET_TYPE_STREAM, io);
+  select_set_recv(main_group, ring_get_wake_fd(io->to_sessions), to_sessions_woken);
+
+  /* Take the messages the driver would otherwise handle itself. */
+  message_subscribe(MESSAGE_START,      handle_message, io);
+  message_subscribe(MESSAGE_PACKET_OUT, handle_message, io);
+
+  return io;
+}
+
+void io_thread_destroy(io_thread_t *io)
+{
+  if(io->is_running)
+  {
+    __atomic_store_n(&io->is_stopping, TRUE, __ATOMIC_RELEASE);
+    ring_wake(io->to_dns);
+
+    /* If the I/O thread itself is exiting, there's nothing to wait for. */
+    if(!pthread_equal(pthread_self(), io->thread))
+      pthread_join(io->thread, NULL);
+  }
+
+  select_group_remove_socket(io->main_group, ring_get_wake_fd(io->to_sessions));
+  select_group_destroy(io->group);
+
+  ring_destroy(io->to_dns);
+  ring_destroy(io->to_sessions);
+
+  arena_destroy(io->in_arena);
+
+  safe_free(io);
+}
@@ -0,0 +1,55 @@
+/* io_thread.h
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ *
+ * Runs the DNS driver on a thread of its own, so the sessions and input
+ * drivers (on the main thread) can't hold up DNS traffic, and vice versa.
+ *
+ * The I/O thread owns the DNS socket, the driver and a select_group of its
+ * own; the main thread owns everything else, including the message bus and
+ * the sessions (see message.h). The only things they share are two rings
+ * (see ring.h): packets on their way out go from the main thread to the I/O
+ * thread, and packets (and settings) that come in go back the other way.
+ */
+
+#ifndef __IO_THREAD_H__
+#define __IO_THREAD_H__
+
+#include <pthread.h>
+
+#include "driver_dns.h"
+#include "memory.h"
+#include "ring.h"
+#include "select_group.h"
+
+typedef struct
+{
+  pthread_t       thread;
+  NBBOOL          is_running;
+  int             is_stopping; /* Set by the main thread, read by the I/O thread. */
+
+  /* The main thread's select_group, which is woken up by 'to_sessions'. */
+  select_group_t *main_group;
+
+  /* The I/O thread's select_group and driver. */
+  select_group_t *group;
+  driver_dns_t   *driver_dns;
+
+  ring_t         *to_dns;
+  ring_t         *to_sessions;
+
+  /* Scratch memory for parsing an incoming packet on the main thread's side
+   * (see memory.h). Outgoing ones are written straight into the ring. */
+  arena_t        *in_arena;
+} io_thread_t;
+
+/* Creates the DNS driver (which the caller can configure, as usual, till
+ * MESSAGE_START is posted; that's when the thread starts). */
+io_thread_t *io_thread_create(select_group_t *main_group, char *domain);
+
+/* Stops the thread and cleans up (except for the driver, which still needs
+ * driver_dns_destroy()). */
+void         io_thread_destroy(io_thread_t *io);
+
+#endif
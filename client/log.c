@@ -1,6 +1,21 @@
+/* Logging is asynchronous: a call to log_info() and friends doesn't format
+ * anything. It just writes a binary record (the time, the level, the format
+ * string and the raw arguments) into a ring, and a thread of its own formats
+ * and writes them out. The ring can take records from any number of threads
+ * without locks; if it fills up, records are dropped (and counted) rather than
+ * holding anybody up.
+ */
+
+/* The messages on the bus are logged from here. */
+#define LOG_MODULE LOG_MODULE_MESSAGES
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "memory.h"
@@ -8,11 +23,104 @@
 
 #include "log.h"
 
+/* Headers for snprintf() and vsnprintf(), since cygwin doesn't expose them on
+ * c89 programs. */
+int snprintf(char *STR, size_t SIZE, const char *FORMAT, ...);
+int vsnprintf(char *STR, size_t SIZE, const char *FORMAT, va_list ARGS);
+
+/* The number of records the ring holds (a power of two). */
+#define LOG_RING_SLOTS   1024
+
+/* The most arguments a record can hold (any more are left out), and the room
+ * for copies of the strings among them (which are cut short to fit). */
+#define LOG_MAX_ARGS     8
+#define LOG_STRING_SPACE 384
+
+/* The longest line that's written out. */
+#define LOG_MAX_LINE     1024
+
+/* How long the logging thread sleeps (in microseconds) when it runs out of
+ * records. */
+#define LOG_DRAIN_INTERVAL 10000
+
+typedef enum
+{
+  ARG_NONE, /* "%%" */
+  ARG_INT,
+  ARG_LONG,
+  ARG_SIZE,
+  ARG_DOUBLE,
+  ARG_POINTER,
+  ARG_STRING,
+} arg_type_t;
+
+typedef union
+{
+  int64_t  i;
+  double   d;
+  void    *p;
+  size_t   s; /* For strings, where it starts in 'strings'. */
+} log_arg_t;
+
+typedef struct
+{
+  /* This is how the ring keeps track of the slot: it's the slot's position
+   * when it's free to be written, and one more than that when it's ready to be
+   * read. */
+  size_t          sequence;
+
+  struct timeval  time;
+  log_level_t     level;
+  log_module_t    module;
+  char           *format;
+  size_t          arg_count;
+  log_arg_t       args[LOG_MAX_ARGS];
+  char            strings[LOG_STRING_SPACE];
+} log_record_t;
+
 static log_level_t log_console_min = LOG_LEVEL_WARNING;
 static log_level_t log_file_min = LOG_LEVEL_INFO;
 static FILE *log_file = NULL;
 
-static char *log_levels[] = { "INFO", "WARNING", "ERROR", "FATAL" };
+/* The console levels that modules have of their own. */
+static log_level_t log_module_console[LOG_MODULE_COUNT];
+static NBBOOL      log_module_has_level[LOG_MODULE_COUNT];
+
+/* Everything's let through till log_init() works out the real levels (and the
+ * level's checked again, later, anyway). */
+log_level_t log_module_min[LOG_MODULE_COUNT];
+
+static char *log_levels[]  = { "INFO", "WARNING", "ERROR", "FATAL" };
+static char *log_modules[] = { "other", "messages", "session", "packet", "dns", "drivers" };
+
+/* The ring. 'head' is claimed by the writers (with a compare-and-swap), and
+ * 'tail' is only moved by the logging thread. */
+static log_record_t *log_ring = NULL;
+static size_t        log_head;
+static size_t        log_tail;
+static size_t        log_dropped;
+
+static pthread_t     log_thread;
+static NBBOOL        log_is_async = FALSE;
+static int           log_is_stopping = FALSE;
+
+static log_level_t log_get_console_min(log_module_t module)
+{
+  return log_module_has_level[module] ? log_module_console[module] : log_console_min;
+}
+
+/* Work out the level that each module's log macros check against. */
+static void log_update_levels()
+{
+  log_module_t module;
+
+  for(module = 0; module < LOG_MODULE_COUNT; module++)
+  {
+    log_module_min[module] = log_get_console_min(module);
+    if(log_file && log_file_min < log_module_min[module])
+      log_module_min[module] = log_file_min;
+  }
+}
 
 void log_to_file(char *filename, log_level_t min_level)
 {
@@ -23,6 +131,8 @@ void log_to_file(char *filename, log_level_t min_level)
     log_file_min = min_level;
   else
     LOG_WARNING("Couldn't open logfile: %s", filename);
+
+  log_update_levels();
 }
 
 void log_set_min_console_level(log_level_t min_level)
@@ -30,23 +140,359 @@ void log_set_min_console_level(log_level_t min_level)
   assert(min_level >= LOG_LEVEL_INFO || min_level <= LOG_LEVEL_FATAL);
 
   log_console_min = min_level;
+  log_update_levels();
 }
 
-/* Most of this code is from the manpage for vsprintf() */
-static void log_internal(log_level_t level, char *format, va_list args)
+void log_set_module_level(log_module_t module, log_level_t level)
 {
-  assert(level >= LOG_LEVEL_INFO || level <= LOG_LEVEL_FATAL);
+  assert(module < LOG_MODULE_COUNT);
+
+  log_module_console[module]   = level;
+  log_module_has_level[module] = TRUE;
+  log_update_levels();
+}
+
+log_module_t log_get_module(char *name)
+{
+  log_module_t module;
+
+  for(module = 0; module < LOG_MODULE_COUNT; module++)
+    if(!strcmp(log_modules[module], name))
+      break;
+
+  return module;
+}
+
+/* Find the next conversion in 'format' (a '%', then any flags, width,
+ * precision and length, then the conversion itself) and what kind of argument
+ * it takes. Returns a pointer just past it, or NULL if there are no more.
+ * Widths and precisions given as '*' aren't supported. */
+static char *next_conversion(char *format, char **start, arg_type_t *type)
+{
+  char *p = strchr(format, '%');
+  NBBOOL is_long = FALSE;
+  NBBOOL is_size = FALSE;
+
+  if(!p)
+    return NULL;
+  *start = p++;
 
-  if(level >= log_console_min)
+  while(*p && strchr("-+ #0123456789.", *p))
+    p++;
+
+  for(; *p && strchr("hlzjt", *p); p++)
+  {
+    if(*p == 'l')
+      is_long = TRUE;
+    else if(*p == 'z')
+      is_size = TRUE;
+  }
+
+  if(!*p)
+    return NULL;
+
+  switch(*p)
   {
-    fprintf(stderr, "[[ %s ]] :: ", log_levels[level]);
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+    case '%':
+      *type = ARG_NONE;
+      break;
+
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+      *type = ARG_DOUBLE;
+      break;
+
+    case 'p':
+      *type = ARG_POINTER;
+      break;
+
+    case 's':
+      *type = ARG_STRING;
+      break;
+
+    default:
+      *type = is_size ? ARG_SIZE : (is_long ? ARG_LONG : ARG_INT);
+      break;
+  }
+
+  return p + 1;
+}
+
+/* Write out a line that's been formatted. */
+static void log_write(log_module_t module, log_level_t level, struct timeval *time, char *line)
+{
+  if(level >= log_get_console_min(module))
+  {
+    /* Keep lines from different threads from getting mixed together. */
+#ifndef WIN32
+    flockfile(stderr);
+#endif
+    fprintf(stderr, "[[ %s ]] :: %s\n", log_levels[level], line);
+#ifndef WIN32
+    funlockfile(stderr);
+#endif
   }
 
   if(log_file && level >= log_file_min)
   {
-    vfprintf(log_file, format, args);
+    fprintf(log_file, "%ld.%06ld [[ %s ]] %s :: %s\n", (long)time->tv_sec, (long)time->tv_usec, log_levels[level], log_modules[module], line);
+    fflush(log_file);
+  }
+}
+
+/* Format a record the way vsnprintf() would have, from its saved arguments. */
+static void log_format_record(log_record_t *record, char *line, size_t size)
+{
+  char       *p = record->format;
+  char       *start;
+  char       *next;
+  arg_type_t  type;
+  char        spec[16];
+  size_t      used = 0;
+  size_t      length;
+  size_t      arg = 0;
+  int         written;
+
+  line[0] = '\0';
+
+  while((next = next_conversion(p, &start, &type)) && used < size - 1)
+  {
+    /* The text leading up to it. */
+    length = MIN((size_t)(start - p), size - 1 - used);
+    memcpy(line + used, p, length);
+    used += length;
+    line[used] = '\0';
+
+    /* Then the conversion, on its own. */
+    length = MIN((size_t)(next - start), sizeof(spec) - 1);
+    memcpy(spec, start, length);
+    spec[length] = '\0';
+
+    if(type == ARG_NONE)
+    {
+      written = snprintf(line + used, size - used, "%s", "%");
+    }
+    else if(arg >= record->arg_count)
+    {
+      /* It didn't fit in the record. */
+      written = snprintf(line + used, size - used, "%s", "?");
+    }
+    else
+    {
+      switch(type)
+      {
+        case ARG_LONG:    written = snprintf(line + used, size - used, spec, (long)record->args[arg].i);   break;
+        case ARG_SIZE:    written = snprintf(line + used, size - used, spec, (size_t)record->args[arg].i); break;
+        case ARG_DOUBLE:  written = snprintf(line + used, size - used, spec, record->args[arg].d);         break;
+        case ARG_POINTER: written = snprintf(line + used, size - used, spec, record->args[arg].p);         break;
+        case ARG_STRING:  written = snprintf(line + used, size - used, spec, record->strings + record->args[arg].s); break;
+        default:          written = snprintf(line + used, size - used, spec, (int)record->args[arg].i);    break;
+      }
+      arg++;
+    }
+
+    if(written > 0)
+      used = MIN(used + written, size - 1);
+    p = next;
+  }
+
+  /* And whatever's after the last one. */
+  if(used < size - 1)
+  {
+    length = MIN(strlen(p), size - 1 - used);
+    memcpy(line + used, p, length);
+    used += length;
+  }
+  line[used] = '\0';
+}
+
+/* Save the arguments a format takes into the record. */
+static void log_save_args(log_record_t *record, char *format, va_list args)
+{
+  char       *p = format;
+  char       *start;
+  char       *str;
+  arg_type_t  type;
+  size_t      strings_used = 0;
+  size_t      length;
+  log_arg_t  *arg;
+
+  record->arg_count = 0;
+  while((p = next_conversion(p, &start, &type)) && record->arg_count < LOG_MAX_ARGS)
+  {
+    arg = &record->args[record->arg_count];
+
+    switch(type)
+    {
+      case ARG_NONE:
+        continue;
+
+      case ARG_LONG:
+        arg->i = va_arg(args, long);
+        break;
+
+      case ARG_SIZE:
+        arg->i = (int64_t)va_arg(args, size_t);
+        break;
+
+      case ARG_DOUBLE:
+        arg->d = va_arg(args, double);
+        break;
+
+      case ARG_POINTER:
+        arg->p = va_arg(args, void*);
+        break;
+
+      case ARG_STRING:
+        str    = va_arg(args, char*);
+        str    = str ? str : "(null)";
+        length = strlen(str);
+        length = MIN(length, LOG_STRING_SPACE - 1 - strings_used);
+        memcpy(record->strings + strings_used, str, length);
+        record->strings[strings_used + length] = '\0';
+        arg->s = strings_used;
+        strings_used += length;
+        if(strings_used < LOG_STRING_SPACE - 1)
+          strings_used++;
+        break;
+
+      default:
+        arg->i = va_arg(args, int);
+        break;
+    }
+
+    record->arg_count++;
+  }
+}
+
+/* Put a record in the ring; returns FALSE if it's full. */
+static NBBOOL log_enqueue(log_module_t module, log_level_t level, char *format, va_list args)
+{
+  size_t        position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  log_record_t *record;
+  size_t        sequence;
+
+  for(;;)
+  {
+    record   = &log_ring[position & (LOG_RING_SLOTS - 1)];
+    sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+
+    if(sequence == position)
+    {
+      /* The slot's free; try to claim it (if somebody beats us to it, this
+       * loads the new head into 'position'). */
+      if(__atomic_compare_exchange_n(&log_head, &position, position + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if((ssize_t)(sequence - position) < 0)
+    {
+      /* The logging thread hasn't got to it yet, so the ring's full. */
+      __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+      return FALSE;
+    }
+    else
+    {
+      position = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    }
+  }
+
+  gettimeofday(&record->time, NULL);
+  record->level  = level;
+  record->module = module;
+  record->format = format;
+  log_save_args(record, format, args);
+
+  __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+
+  return TRUE;
+}
+
+/* Format and write out everything that's ready; returns how many there were. */
+static size_t log_drain()
+{
+  char          line[LOG_MAX_LINE];
+  log_record_t *record;
+  size_t        count = 0;
+  size_t        dropped;
+  struct timeval now;
+
+  for(;;)
+  {
+    record = &log_ring[log_tail & (LOG_RING_SLOTS - 1)];
+    if(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != log_tail + 1)
+      break;
+
+    log_format_record(record, line, sizeof(line));
+    log_write(record->module, record->level, &record->time, line);
+
+    __atomic_store_n(&record->sequence, log_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+    count++;
+  }
+
+  dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+  if(dropped)
+  {
+    gettimeofday(&now, NULL);
+    snprintf(line, sizeof(line), "The log couldn't keep up; %lu messages were dropped", (unsigned long)dropped);
+    log_write(LOG_MODULE_OTHER, LOG_LEVEL_WARNING, &now, line);
+  }
+
+  return count;
+}
+
+static void *log_thread_main(void *param)
+{
+  while(!__atomic_load_n(&log_is_stopping, __ATOMIC_ACQUIRE))
+  {
+    if(!log_drain())
+      usleep(LOG_DRAIN_INTERVAL);
+  }
+
+  log_drain();
+
+  return NULL;
+}
+
+/* Wait for the logging thread to write out everything that's been logged so
+ * far. */
+static void log_flush()
+{
+  size_t head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+
+  while(__atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) < head)
+    usleep(1000);
+}
+
+/* A forked child doesn't get the logging thread, so it logs the old way. */
+static void log_forked()
+{
+  log_is_async = FALSE;
+}
+
+static void log_internal(log_module_t module, log_level_t level, char *format, va_list args)
+{
+  char           line[LOG_MAX_LINE];
+  struct timeval now;
+
+  assert(level >= LOG_LEVEL_INFO || level <= LOG_LEVEL_FATAL);
+
+  /* Don't bother if nobody wants to see it. */
+  if(level < log_get_console_min(module) && (!log_file || level < log_file_min))
+    return;
+
+  if(log_is_async)
+  {
+    log_enqueue(module, level, format, args);
+
+    /* A fatal error is about to end the process, so make sure it's seen. */
+    if(level == LOG_LEVEL_FATAL)
+      log_flush();
+  }
+  else
+  {
+    gettimeofday(&now, NULL);
+    vsnprintf(line, sizeof(line), format, args);
+    log_write(module, level, &now, line);
   }
 }
 
@@ -55,7 +501,7 @@ void log_info(char *format, ...)
   va_list args;
 
   va_start(args, format);
-  log_internal(LOG_LEVEL_INFO, format, args);
+  log_internal(LOG_MODULE_OTHER, LOG_LEVEL_INFO, format, args);
   va_end(args);
 }
 
@@ -64,7 +510,7 @@ void log_warning(char *format, ...)
   va_list args;
 
   va_start(args, format);
-  log_internal(LOG_LEVEL_WARNING, format, args);
+  log_internal(LOG_MODULE_OTHER, LOG_LEVEL_WARNING, format, args);
   va_end(args);
 }
 
@@ -73,7 +519,7 @@ void log_error(char *format, ...)
   va_list args;
 
   va_start(args, format);
-  log_internal(LOG_LEVEL_ERROR, format, args);
+  log_internal(LOG_MODULE_OTHER, LOG_LEVEL_ERROR, format, args);
   va_end(args);
 }
 
@@ -82,10 +528,44 @@ void log_fatal(char *format, ...)
   va_list args;
 
   va_start(args, format);
-  log_internal(LOG_LEVEL_FATAL, format, args);
+  log_internal(LOG_MODULE_OTHER, LOG_LEVEL_FATAL, format, args);
   va_end(args);
 }
 
+/* The rest of the modules get a set of functions each, so the log macros can
+ * pass the module along without having to take any more arguments. */
+#define LOG_FUNCTION(name, module, level) \
+  static void name(char *format, ...) \
+  { \
+    va_list args; \
+    va_start(args, format); \
+    log_internal(module, level, format, args); \
+    va_end(args); \
+  }
+
+#define LOG_MODULE_FUNCTIONS(prefix, module) \
+  LOG_FUNCTION(prefix##_info,    module, LOG_LEVEL_INFO) \
+  LOG_FUNCTION(prefix##_warning, module, LOG_LEVEL_WARNING) \
+  LOG_FUNCTION(prefix##_error,   module, LOG_LEVEL_ERROR) \
+  LOG_FUNCTION(prefix##_fatal,   module, LOG_LEVEL_FATAL)
+
+LOG_MODULE_FUNCTIONS(log_messages, LOG_MODULE_MESSAGES)
+LOG_MODULE_FUNCTIONS(log_session,  LOG_MODULE_SESSION)
+LOG_MODULE_FUNCTIONS(log_packet,   LOG_MODULE_PACKET)
+LOG_MODULE_FUNCTIONS(log_dns,      LOG_MODULE_DNS)
+LOG_MODULE_FUNCTIONS(log_drivers,  LOG_MODULE_DRIVERS)
+
+/* In the same order as log_module_t. */
+log_function_t *log_functions[LOG_MODULE_COUNT][LOG_LEVEL_FATAL + 1] =
+{
+  { log_info,          log_warning,          log_error,          log_fatal },
+  { log_messages_info, log_messages_warning, log_messages_error, log_messages_fatal },
+  { log_session_info,  log_session_warning,  log_session_error,  log_session_fatal },
+  { log_packet_info,   log_packet_warning,   log_packet_error,   log_packet_fatal },
+  { log_dns_info,      log_dns_warning,      log_dns_error,      log_dns_fatal },
+  { log_drivers_info,  log_drivers_warning,  log_drivers_error,  log_drivers_fatal },
+};
+
 static void handle_message(message_t *message, void *d)
 {
   char *tmp;
@@ -125,24 +605,38 @@ static void handle_message(message_t *message, void *d)
       LOG_WARNING("Session closed: %d", message->message.session_closed.session_id);
       break;
 
+    case MESSAGE_PAUSE_SESSION:
+      LOG_INFO("Session paused (the driver is backed up): %d", message->message.pause_session.session_id);
+      break;
+
+    case MESSAGE_RESUME_SESSION:
+      LOG_INFO("Session resumed: %d", message->message.resume_session.session_id);
+      break;
+
     case MESSAGE_DATA_OUT:
-      LOG_INFO("Data queued: %d bytes to session %d", message->message.data_out.length, message->message.data_out.session_id);
+      LOG_INFO("Data queued: %u bytes to session %d", (unsigned int)message->message.data_out.length, message->message.data_out.session_id);
       break;
 
     case MESSAGE_PACKET_OUT:
-      tmp = packet_to_s(message->message.packet_out.packet);
-      LOG_INFO("[OUT]: %s", tmp);
-      safe_free(tmp);
+      if(LOG_ENABLED(LOG_LEVEL_INFO))
+      {
+        tmp = packet_to_s(message->message.packet_out.packet);
+        LOG_INFO("[OUT]: %s", tmp);
+        safe_free(tmp);
+      }
       break;
 
     case MESSAGE_PACKET_IN:
-      tmp = packet_to_s(message->message.packet_in.packet);
-      LOG_INFO("[IN]: %s", tmp);
-      safe_free(tmp);
+      if(LOG_ENABLED(LOG_LEVEL_INFO))
+      {
+        tmp = packet_to_s(message->message.packet_in.packet);
+        LOG_INFO("[IN]: %s", tmp);
+        safe_free(tmp);
+      }
       break;
 
     case MESSAGE_DATA_IN:
-      LOG_INFO("Data being returned to the client; %d bytes to session %d", message->message.data_in.length, message->message.data_in.session_id);
+      LOG_INFO("Data being returned to the client; %u bytes to session %d", (unsigned int)message->message.data_in.length, message->message.data_in.session_id);
       break;
 
     case MESSAGE_HEARTBEAT:
@@ -158,6 +652,22 @@ static void handle_message(message_t *message, void *d)
 
 void log_init()
 {
+  size_t i;
+
+  log_update_levels();
+
+  /* Start the logging thread. If it can't be started, everything's just
+   * logged the old way. */
+  log_ring = (log_record_t*) safe_malloc(LOG_RING_SLOTS * sizeof(log_record_t));
+  for(i = 0; i < LOG_RING_SLOTS; i++)
+    log_ring[i].sequence = i;
+
+  if(!pthread_create(&log_thread, NULL, log_thread_main, NULL))
+  {
+    pthread_atfork(NULL, NULL, log_forked);
+    log_is_async = TRUE;
+  }
+
   message_subscribe(MESSAGE_CONFIG,           handle_message, NULL);
   message_subscribe(MESSAGE_START,            handle_message, NULL);
   message_subscribe(MESSAGE_SHUTDOWN,         handle_message, NULL);
@@ -165,9 +675,25 @@ void log_init()
   message_subscribe(MESSAGE_SESSION_CREATED,  handle_message, NULL);
   message_subscribe(MESSAGE_CLOSE_SESSION,    handle_message, NULL);
   message_subscribe(MESSAGE_SESSION_CLOSED,   handle_message, NULL);
+  message_subscribe(MESSAGE_PAUSE_SESSION,    handle_message, NULL);
+  message_subscribe(MESSAGE_RESUME_SESSION,   handle_message, NULL);
   message_subscribe(MESSAGE_DATA_OUT,         handle_message, NULL);
   message_subscribe(MESSAGE_PACKET_OUT,       handle_message, NULL);
   message_subscribe(MESSAGE_PACKET_IN,        handle_message, NULL);
   message_subscribe(MESSAGE_DATA_IN,          handle_message, NULL);
   message_subscribe(MESSAGE_HEARTBEAT,        handle_message, NULL);
 }
+
+void log_cleanup()
+{
+  if(log_is_async)
+  {
+    log_is_async = FALSE;
+    __atomic_store_n(&log_is_stopping, TRUE, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+  }
+
+  if(log_ring)
+    safe_free(log_ring);
+  log_ring = NULL;
+}
@@ -9,16 +9,85 @@ typedef enum
   LOG_LEVEL_FATAL   = 3
 } log_level_t;
 
-#define LOG_INFO    log_info
-#define LOG_WARNING log_warning
-#define LOG_ERROR   log_error
-#define LOG_FATAL   log_fatal
+/* The parts of the program that can have a log level of their own (see
+ * log_set_module_level()). A file picks its module by defining LOG_MODULE
+ * before it includes this. */
+typedef enum
+{
+  LOG_MODULE_OTHER,
+  LOG_MODULE_MESSAGES,  /* The messages on the bus (logged by log.c). */
+  LOG_MODULE_SESSION,
+  LOG_MODULE_PACKET,
+  LOG_MODULE_DNS,       /* The DNS driver and the I/O thread. */
+  LOG_MODULE_DRIVERS,   /* The input drivers. */
+
+  LOG_MODULE_COUNT
+} log_module_t;
+
+#ifndef LOG_MODULE
+#define LOG_MODULE LOG_MODULE_OTHER
+#endif
+
+/* Levels below this (0 = INFO, 1 = WARNING, and so on) are compiled out
+ * altogether; build with -DLOG_MIN_LEVEL=1 to drop the INFO messages. */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+/* The lowest level each module wants to hear about, anywhere (kept up to date
+ * by the functions below). Don't change it directly. */
+extern log_level_t log_module_min[LOG_MODULE_COUNT];
+
+typedef void(log_function_t)(char *format, ...);
+extern log_function_t *log_functions[LOG_MODULE_COUNT][LOG_LEVEL_FATAL + 1];
+
+/* TRUE if a message at this level would go anywhere. For call sites that build
+ * something just to log it. */
+#define LOG_ENABLED(level) ((level) >= log_module_min[LOG_MODULE])
 
+/* The log macros check the level before the arguments are even evaluated, and
+ * a message that nobody wants costs a compare. They're used like functions
+ * (C89 doesn't have variadic macros, so they expand to the front half of a
+ * ?: expression that the arguments finish). */
+#if LOG_MIN_LEVEL > 0
+#define LOG_INFO    1 ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_INFO]
+#else
+#define LOG_INFO    !LOG_ENABLED(LOG_LEVEL_INFO) ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_INFO]
+#endif
+
+#if LOG_MIN_LEVEL > 1
+#define LOG_WARNING 1 ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_WARNING]
+#else
+#define LOG_WARNING !LOG_ENABLED(LOG_LEVEL_WARNING) ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_WARNING]
+#endif
+
+#if LOG_MIN_LEVEL > 2
+#define LOG_ERROR   1 ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_ERROR]
+#else
+#define LOG_ERROR   !LOG_ENABLED(LOG_LEVEL_ERROR) ? (void)0 : log_functions[LOG_MODULE][LOG_LEVEL_ERROR]
+#endif
+
+/* Fatal errors are always logged. */
+#define LOG_FATAL   log_functions[LOG_MODULE][LOG_LEVEL_FATAL]
+
+/* Starts the thread that writes the log out (see log.c); log_cleanup() writes
+ * out whatever's left and stops it. Till then (and after), messages are
+ * written as they're logged. */
 void log_init();
+void log_cleanup();
 
 void log_to_file(char *filename, log_level_t min_level);
 void log_set_min_console_level(log_level_t level);
 
+/* Give one module a console level of its own (to trace just that module,
+ * say), instead of the one set above. */
+void log_set_module_level(log_module_t module, log_level_t level);
+
+/* Look up a module by name ("session", "dns", etc.); returns LOG_MODULE_COUNT
+ * if there's no such module. */
+log_module_t log_get_module(char *name);
+
+/* These log as LOG_MODULE_OTHER, with no level check up front. */
 void log_info(char *format, ...);
 void log_warning(char *format, ...);
 void log_error(char *format, ...);
@@ -15,116 +15,277 @@
 #include <stdlib.h>
 #include <string.h>
 
+
 #include "memory.h"
 
-typedef struct entry
+#ifdef TESTMEMORY
+/* Every allocation is tracked in a hash table (keyed on its address), and
+ * tallied against the place it was allocated from, so it's cheap enough to
+ * leave on under load. print_memory() lists what's still allocated, and
+ * print_memory_stats() lists the totals for each place. */
+
+/* A place that memory's allocated from. */
+typedef struct site
 {
   char          *file;
   int            line;
+  size_t         count; /* The number of its allocations that are still live. */
+  size_t         bytes; /* The number of bytes they add up to. */
+  size_t         peak;  /* The most bytes it's had live at once. */
+  size_t         total; /* The number of allocations it's ever made. */
+  struct site   *next;
+} site_t;
+
+typedef struct entry
+{
   void          *memory;
   size_t         size;
+  site_t        *site;
   struct entry  *next;
 } entry_t;
 
-#ifdef TESTMEMORY
-static entry_t *first           = NULL;
+#define ENTRY_BUCKETS_START 1024
+#define SITE_BUCKETS        1024
+
+static entry_t **entries        = NULL;
+static size_t    entry_buckets  = 0;
+static size_t    entry_count    = 0;
+static entry_t  *free_entries   = NULL; /* Entries that have been freed, to be reused. */
+static site_t   *sites[SITE_BUCKETS];
+
+/* The tables are shared by every thread (see io_thread.h). */
+#ifndef WIN32
+static pthread_mutex_t lock     = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()   pthread_mutex_lock(&lock)
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#define LOCK()
+#define UNLOCK()
 #endif
 
-void add_entry(char *file, int line, void *memory, size_t size)
+static size_t hash_pointer(void *memory, size_t buckets)
 {
-#ifdef TESTMEMORY
-  entry_t *current = (entry_t*) malloc(sizeof(entry_t));
-  if(!current)
+  /* The bottom bits are always 0, thanks to alignment. */
+  return (size_t)((((uintptr_t)memory) >> 4) * 2654435761u) & (buckets - 1);
+}
+
+static site_t *get_site(char *file, int line)
+{
+  site_t **bucket = &sites[line % SITE_BUCKETS];
+  site_t  *site;
+
+  for(site = *bucket; site; site = site->next)
+    if(site->line == line && (site->file == file || !strcmp(site->file, file)))
+      return site;
+
+  site = (site_t*) malloc(sizeof(site_t));
+  if(!site)
     DIE_MEM();
+  memset(site, 0, sizeof(site_t));
+  site->file = file;
+  site->line = line;
+  site->next = *bucket;
+  *bucket    = site;
 
-  /* Put the new entry at the front of the list. */
-  current->next = first;
-  first         = current;
+  return site;
+}
 
-  current->file   = file;
-  current->line   = line;
-  current->memory = memory;
-  current->size   = size;
-#endif
+static void site_add(site_t *site, size_t size)
+{
+  site->count++;
+  site->total++;
+  site->bytes += size;
+  if(site->bytes > site->peak)
+    site->peak = site->bytes;
 }
 
-void update_entry(void *old_memory, void *new_memory, int new_size)
+static void site_remove(site_t *site, size_t size)
 {
-#ifdef TESTMEMORY
-  entry_t *current = first;
+  site->count--;
+  site->bytes -= size;
+}
+
+static void site_resize(site_t *site, size_t old_size, size_t new_size)
+{
+  site->bytes = site->bytes - old_size + new_size;
+  if(site->bytes > site->peak)
+    site->peak = site->bytes;
+}
+
+/* Double the number of buckets once there's more than one entry per bucket. */
+static void grow_entries()
+{
+  size_t    new_buckets = entry_buckets ? entry_buckets * 2 : ENTRY_BUCKETS_START;
+  entry_t **new_entries = (entry_t**) malloc(new_buckets * sizeof(entry_t*));
+  size_t    i;
+
+  if(!new_entries)
+    DIE_MEM();
+  memset(new_entries, 0, new_buckets * sizeof(entry_t*));
 
-  while(current)
+  for(i = 0; i < entry_buckets; i++)
   {
-    if(current->memory == old_memory)
+    entry_t *current;
+    entry_t *next;
+
+    for(current = entries[i]; current; current = next)
     {
-      current->memory = new_memory;
-      current->size   = new_size;
-      return;
+      size_t bucket = hash_pointer(current->memory, new_buckets);
+
+      next = current->next;
+      current->next = new_entries[bucket];
+      new_entries[bucket] = current;
     }
-    current = current->next;
   }
 
-  DIE("Tried to re-allocate memory that doesn't exist.");
-#endif
+  if(entries)
+    free(entries);
+  entries       = new_entries;
+  entry_buckets = new_buckets;
 }
 
-void remove_entry(void *memory)
+/* These have to be called with the lock held. */
+static void insert_entry(entry_t *current)
 {
-#ifdef TESTMEMORY
-  entry_t *last    = NULL;
-  entry_t *current = first;
+  size_t bucket;
+
+  if(entry_count >= entry_buckets)
+    grow_entries();
+
+  bucket = hash_pointer(current->memory, entry_buckets);
+  current->next   = entries[bucket];
+  entries[bucket] = current;
+  entry_count++;
+}
+
+static entry_t *unlink_entry(void *memory)
+{
+  entry_t **link;
 
-  while(current)
+  if(!entries)
+    return NULL;
+
+  for(link = &entries[hash_pointer(memory, entry_buckets)]; *link; link = &(*link)->next)
   {
-    if(current->memory == memory)
+    if((*link)->memory == memory)
     {
-      if(current == first)
-      {
-        /* Beginning of the list. */
-        first = first->next;
-        free(current);
-      }
-      else
-      {
-        /* Anywhere else in the list. */
-        last->next = current->next;
-        free(current);
-      }
-
-      return;
+      entry_t *current = *link;
+
+      *link = current->next;
+      entry_count--;
+      return current;
     }
-    last = current;
-    current = current->next;
   }
 
-  DIE("Tried to free memory that we didn't allocate (or that's already been freed)");
+  return NULL;
+}
+#endif
+
+void add_entry(char *file, int line, void *memory, size_t size)
+{
+#ifdef TESTMEMORY
+  entry_t *current;
+
+  LOCK();
+  if(free_entries)
+  {
+    current      = free_entries;
+    free_entries = current->next;
+  }
+  else
+  {
+    current = (entry_t*) malloc(sizeof(entry_t));
+    if(!current)
+      DIE_MEM();
+  }
+
+  current->memory = memory;
+  current->size   = size;
+  current->site   = get_site(file, line);
+  site_add(current->site, size);
+
+  insert_entry(current);
+  UNLOCK();
+#endif
+}
+
+void remove_entry(void *memory)
+{
+#ifdef TESTMEMORY
+  entry_t *current;
+
+  LOCK();
+  current = unlink_entry(memory);
+  if(!current)
+    DIE("Tried to free memory that we didn't allocate (or that's already been freed)");
+
+  site_remove(current->site, current->size);
+
+  current->next = free_entries;
+  free_entries  = current;
+  UNLOCK();
 #endif
 }
 
 void print_memory()
 {
 #ifdef TESTMEMORY
-  if(first == NULL)
+  if(entry_count == 0)
   {
     fprintf(stderr, "No allocated memory. Congratulations!\n");
   }
   else
   {
-    entry_t *current = first;
+    entry_t *current;
+    size_t   i;
 
+    LOCK();
     fprintf(stderr, "Allocated memory:\n");
-    while(current)
+    for(i = 0; i < entry_buckets; i++)
+      for(current = entries[i]; current; current = current->next)
+        fprintf(stderr, "%p: 0x%08x bytes allocated at %s:%d\n", current->memory, (unsigned int)current->size, current->site->file, current->site->line);
+    UNLOCK();
+  }
+#endif
+}
+
+void print_memory_stats()
+{
+#ifdef TESTMEMORY
+  site_t *site;
+  size_t  i;
+  size_t  bytes = 0;
+
+  LOCK();
+  fprintf(stderr, "Memory by allocation site (live allocations, live bytes, peak bytes, total allocations):\n");
+  for(i = 0; i < SITE_BUCKETS; i++)
+  {
+    for(site = sites[i]; site; site = site->next)
     {
-      fprintf(stderr, "%p: 0x%08x bytes allocated at %s:%d\n", current->memory, (unsigned int)current->size, current->file, current->line);
-      current = current->next;
+      fprintf(stderr, "%s:%d: %u, %u, %u, %u\n", site->file, site->line, (unsigned int)site->count, (unsigned int)site->bytes, (unsigned int)site->peak, (unsigned int)site->total);
+      bytes += site->bytes;
     }
   }
+  fprintf(stderr, "Total: %u live allocations, %u bytes\n", (unsigned int)entry_count, (unsigned int)bytes);
+  UNLOCK();
+#else
+  fprintf(stderr, "Memory stats aren't available (build with -DTESTMEMORY)\n");
 #endif
 }
 
+/* The number of trips to the heap, for memory_get_heap_allocations(). */
+static size_t heap_allocations = 0;
+#define COUNT_HEAP_ALLOCATION() __atomic_add_fetch(&heap_allocations, 1, __ATOMIC_RELAXED)
+
+size_t memory_get_heap_allocations()
+{
+  return __atomic_load_n(&heap_allocations, __ATOMIC_RELAXED);
+}
+
 void *safe_malloc_internal(size_t size, char *file, int line)
 {
   void *ret = malloc(size);
+  COUNT_HEAP_ALLOCATION();
   if(!ret)
     DIE_MEM();
   memset(ret, 0, size);
@@ -135,11 +296,31 @@ void *safe_malloc_internal(size_t size, char *file, int line)
 
 void *safe_realloc_internal(void *ptr, size_t size, char *file, int line)
 {
-  void *ret = realloc(ptr, size);
+  void *ret;
+#ifdef TESTMEMORY
+  entry_t *current;
+
+  /* Take the entry out before realloc() can hand the memory to another
+   * thread, and put it back under the new address. */
+  LOCK();
+  current = unlink_entry(ptr);
+  if(!current)
+    DIE("Tried to re-allocate memory that doesn't exist.");
+#endif
+
+  ret = realloc(ptr, size);
+  COUNT_HEAP_ALLOCATION();
   if(!ret)
     DIE_MEM();
 
-  update_entry(ptr, ret, size);
+#ifdef TESTMEMORY
+  site_resize(current->site, current->size, size);
+  current->memory = ret;
+  current->size   = size;
+
+  insert_entry(current);
+  UNLOCK();
+#endif
   return ret;
 }
 
@@ -172,6 +353,147 @@ void safe_free_internal(void *ptr, char *file, int line)
   free(ptr);
 }
 
+#ifndef WIN32
+#define POOL_LOCK(pool)   pthread_mutex_lock(&(pool)->lock)
+#define POOL_UNLOCK(pool) pthread_mutex_unlock(&(pool)->lock)
+#else
+#define POOL_LOCK(pool)
+#define POOL_UNLOCK(pool)
+#endif
+
+/* Carve a new slab into objects, and put them on the free list. This has to be
+ * called with the pool's lock held. */
+static void pool_grow(pool_t *pool)
+{
+  uint8_t *slab = (uint8_t*) malloc(pool->object_size * POOL_SLAB_OBJECTS);
+  size_t   i;
+
+  COUNT_HEAP_ALLOCATION();
+
+  if(!slab)
+    DIE_MEM();
+
+  for(i = 0; i < POOL_SLAB_OBJECTS; i++)
+  {
+    void **object = (void**) (slab + (i * pool->object_size));
+
+    *object = pool->free_list;
+    pool->free_list = object;
+  }
+  pool->slab_count++;
+}
+
+void *safe_pool_alloc_internal(pool_t *pool, char *file, int line)
+{
+  void **object;
+
+  POOL_LOCK(pool);
+  if(!pool->free_list)
+    pool_grow(pool);
+
+  object = (void**) pool->free_list;
+  pool->free_list = *object;
+  POOL_UNLOCK(pool);
+
+  memset(object, 0, pool->object_size);
+
+  add_entry(file, line, object, pool->object_size);
+  return object;
+}
+
+void safe_pool_free_internal(pool_t *pool, void *ptr, char *file, int line)
+{
+  remove_entry(ptr);
+
+  POOL_LOCK(pool);
+  *(void**)ptr = pool->free_list;
+  pool->free_list = ptr;
+  POOL_UNLOCK(pool);
+}
+
+/* Everything an arena hands out is rounded up to this, to keep it aligned. */
+#define ARENA_ALIGN(size) ((((size) + 15) / 16) * 16)
+
+arena_t *arena_create()
+{
+  arena_t *arena = (arena_t*) safe_malloc(sizeof(arena_t));
+
+  arena->block = (uint8_t*) safe_malloc(ARENA_BLOCK_SIZE);
+
+  return arena;
+}
+
+void arena_reset(arena_t *arena)
+{
+  while(arena->overflow)
+  {
+    arena_overflow_t *next = arena->overflow->next;
+    safe_free(arena->overflow);
+    arena->overflow = next;
+  }
+
+#ifdef TESTMEMORY
+  /* Make anything that's still using the old memory stand out. */
+  memset(arena->block, 0xCC, arena->used);
+#endif
+
+  arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+  arena_reset(arena);
+  safe_free(arena->block);
+  safe_free(arena);
+}
+
+void *arena_alloc_internal(arena_t *arena, size_t size, char *file, int line)
+{
+  arena_overflow_t *overflow;
+  void             *ret;
+
+  if(!arena)
+    return safe_malloc_internal(size, file, line);
+
+  if(ARENA_ALIGN(size) <= ARENA_BLOCK_SIZE - arena->used)
+  {
+    ret = arena->block + arena->used;
+    arena->used += ARENA_ALIGN(size);
+  }
+  else
+  {
+    overflow = (arena_overflow_t*) safe_malloc_internal(ARENA_ALIGN(sizeof(arena_overflow_t)) + size, file, line);
+    overflow->next  = arena->overflow;
+    arena->overflow = overflow;
+
+    ret = (uint8_t*)overflow + ARENA_ALIGN(sizeof(arena_overflow_t));
+  }
+
+  memset(ret, 0, size);
+
+  return ret;
+}
+
+char *arena_strdup_internal(arena_t *arena, const char *str, char *file, int line)
+{
+  return (char*) arena_memcpy_internal(arena, str, strlen(str) + 1, file, line);
+}
+
+void *arena_memcpy_internal(arena_t *arena, const void *data, size_t length, char *file, int line)
+{
+  void *ret = arena_alloc_internal(arena, length, file, line);
+
+  memcpy(ret, data, length);
+
+  return ret;
+}
+
+void arena_free_internal(arena_t *arena, void *ptr, char *file, int line)
+{
+  if(!arena)
+    safe_free_internal(ptr, file, line);
+}
+
 char *unicode_alloc(const char *string)
 {
   size_t i;
@@ -14,6 +14,10 @@
 
 #include <stdlib.h> /* For size_t */
 
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
 #include "types.h"
 
 /* Make calls to malloc/realloc that die cleanly if the calls fail. safe_malloc() initializes buffer to 0. */
@@ -33,6 +37,82 @@ void *safe_memcpy_internal(const void *data, size_t length, char *file, int line
 #define safe_free(ptr) safe_free_internal(ptr, __FILE__, __LINE__)
 void safe_free_internal(void *ptr, char *file, int line);
 
+/* A pool of fixed-size objects, for things that are allocated and freed all
+ * the time (packets, for instance). Objects are carved out of slabs of
+ * POOL_SLAB_OBJECTS at a time, and freed objects go onto a free list to be
+ * reused, so once a pool's warmed up it never goes to malloc(). They're
+ * tracked like any other allocation (see print_memory()). Pools are meant to
+ * be static, and set up with POOL_INITIALIZER(), which takes the type the pool
+ * holds. */
+#define POOL_SLAB_OBJECTS 64
+
+typedef struct
+{
+  size_t          object_size;
+  void           *free_list;
+  size_t          slab_count;
+#ifndef WIN32
+  pthread_mutex_t lock; /* Pools can be shared between threads (see io_thread.h). */
+#endif
+} pool_t;
+
+/* (Objects are rounded up to 16 bytes, which keeps them aligned and leaves room
+ * for the free list's pointer.) */
+#ifndef WIN32
+#define POOL_INITIALIZER(type) { ((sizeof(type) + 15) / 16) * 16, NULL, 0, PTHREAD_MUTEX_INITIALIZER }
+#else
+#define POOL_INITIALIZER(type) { ((sizeof(type) + 15) / 16) * 16, NULL, 0 }
+#endif
+
+/* Get an object from the pool, initialized to 0 (like safe_malloc()). */
+#define safe_pool_alloc(pool) safe_pool_alloc_internal(pool, __FILE__, __LINE__)
+void *safe_pool_alloc_internal(pool_t *pool, char *file, int line);
+
+/* Give an object back to the pool it came from. */
+#define safe_pool_free(pool,ptr) safe_pool_free_internal(pool, ptr, __FILE__, __LINE__)
+void safe_pool_free_internal(pool_t *pool, void *ptr, char *file, int line);
+
+/* A scratch arena, for the things that only live as long as one event (one
+ * datagram, say). Allocations just bump a pointer through one block, and
+ * everything's freed at once by arena_reset(). If the block fills up, the
+ * extra allocations go to the heap till the next reset.
+ *
+ * The arena_*() functions accept a NULL arena, in which case they act like
+ * their safe_*() counterparts (and the caller frees the memory as usual), so
+ * code can be written once for both. Like safe_malloc(), memory from an arena
+ * is initialized to 0. */
+#define ARENA_BLOCK_SIZE 8192
+
+typedef struct _arena_overflow_t
+{
+  struct _arena_overflow_t *next;
+} arena_overflow_t;
+
+typedef struct
+{
+  uint8_t          *block;
+  size_t            used;
+  arena_overflow_t *overflow;
+} arena_t;
+
+arena_t *arena_create();
+void     arena_reset(arena_t *arena);
+void     arena_destroy(arena_t *arena);
+
+#define arena_alloc(arena,size) arena_alloc_internal(arena, size, __FILE__, __LINE__)
+void *arena_alloc_internal(arena_t *arena, size_t size, char *file, int line);
+
+#define arena_strdup(arena,str) arena_strdup_internal(arena, str, __FILE__, __LINE__)
+char *arena_strdup_internal(arena_t *arena, const char *str, char *file, int line);
+
+#define arena_memcpy(arena,data,len) arena_memcpy_internal(arena, data, len, __FILE__, __LINE__)
+void *arena_memcpy_internal(arena_t *arena, const void *data, size_t length, char *file, int line);
+
+/* Frees the memory if it's from the heap (that is, if arena is NULL);
+ * otherwise, it waits for arena_reset(). */
+#define arena_free(arena,ptr) arena_free_internal(arena, ptr, __FILE__, __LINE__)
+void arena_free_internal(arena_t *arena, void *ptr, char *file, int line);
+
 /* Create a UNICODE string based on an ASCII one. Be sure to free the memory! */
 char *unicode_alloc(const char *string);
 /* Same as unicode_alloc(), except convert the string to uppercase first. */
@@ -41,4 +121,14 @@ char *unicode_alloc_upper(const char *string);
 /* Print the currently allocated memory. Useful for checking for memory leaks. */
 void print_memory();
 
+/* Print how much memory each place in the code has allocated: what's live now,
+ * the most it's had live at once, and how many allocations it's made. It's
+ * cheap enough to call whenever (dnscat calls it on SIGUSR1). */
+void print_memory_stats();
+
+/* The number of times memory has been taken from the heap so far (by
+ * safe_malloc(), safe_realloc(), a pool growing, and so on), whether or not
+ * TESTMEMORY is on. Good for counting the allocations something makes. */
+size_t memory_get_heap_allocations();
+
 #endif
@@ -1,3 +1,10 @@
+#include <assert.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
 #include "memory.h"
 #include "types.h"
 
@@ -11,21 +18,57 @@ typedef struct _message_handler_entry_t
 
 static message_handler_entry_t *handlers[MESSAGE_MAX_MESSAGE_TYPE];
 
+/* The handlers for single sessions (see message_subscribe_session()), hashed
+ * by session id. */
+#define SESSION_BUCKETS 256
+typedef struct _session_handler_entry_t
+{
+  message_type_t    type;
+  uint16_t          session_id;
+  message_handler_t handler;
+  struct _session_handler_entry_t *next;
+} session_handler_entry_t;
+
+static session_handler_entry_t *session_handlers[SESSION_BUCKETS];
+
 static NBBOOL is_initialized = FALSE;
 
-static message_handler_t *message_handler_create(message_callback_t *callback, void *param)
+/* The queue (see message_set_queued()), which is a ring that doubles as it
+ * fills up. The queued messages own copies of their data and packets. */
+#define QUEUE_STARTING_SIZE 64
+static NBBOOL     is_queued   = FALSE;
+static NBBOOL     is_flushing = FALSE;
+static message_t *queue       = NULL;
+static size_t     queue_size  = 0;
+static size_t     queue_head  = 0;
+static size_t     queue_count = 0;
+
+/* The batch that's being handled (it's static so message_cleanup() can free
+ * it if a handler exits). */
+static message_t  batch[MESSAGE_BATCH_MAX];
+static size_t     batch_count = 0;
+
+#ifndef WIN32
+/* The thread that owns the bus (whichever first subscribed to it). */
+static pthread_t owner;
+#define IS_OWNER() (pthread_equal(owner, pthread_self()))
+#else
+#define IS_OWNER() TRUE
+#endif
+
+static message_handler_t *message_handler_create(message_callback_t *callback, message_batch_callback_t *batch_callback, void *param)
 {
   message_handler_t *handler = (message_handler_t *)safe_malloc(sizeof(message_handler_t));
-  handler->callback = callback;
-  handler->param    = param;
+  handler->callback       = callback;
+  handler->batch_callback = batch_callback;
+  handler->param          = param;
 
   return handler;
 }
 
 /* Put the entry at the start of the linked list. */
-void message_subscribe(message_type_t message_type, message_callback_t *callback, void *param)
+static void add_handler(message_type_t message_type, message_handler_t *handler)
 {
-  message_handler_t *handler = message_handler_create(callback, param);
   message_handler_entry_t *entry;
 
   if(!is_initialized)
@@ -33,8 +76,12 @@ void message_subscribe(message_type_t message_type, message_callback_t *callback
     size_t i;
     for(i = 0; i < MESSAGE_MAX_MESSAGE_TYPE; i++)
       handlers[i] = NULL;
+#ifndef WIN32
+    owner = pthread_self();
+#endif
     is_initialized = TRUE;
   }
+  assert(IS_OWNER());
 
   entry = (message_handler_entry_t *)safe_malloc(sizeof(message_handler_entry_t));
   entry->handler = handler;
@@ -42,16 +89,104 @@ void message_subscribe(message_type_t message_type, message_callback_t *callback
   handlers[message_type] = entry;
 }
 
+void message_subscribe(message_type_t message_type, message_callback_t *callback, void *param)
+{
+  add_handler(message_type, message_handler_create(callback, NULL, param));
+}
+
+void message_subscribe_batch(message_type_t message_type, message_batch_callback_t *callback, void *param)
+{
+  add_handler(message_type, message_handler_create(NULL, callback, param));
+}
+
 void message_unsubscribe(message_type_t message_type, message_callback_t *callback)
 {
   /* TODO */
 }
 
+static session_handler_entry_t *find_session_handler(message_type_t message_type, uint16_t session_id)
+{
+  session_handler_entry_t *entry;
+
+  for(entry = session_handlers[session_id % SESSION_BUCKETS]; entry; entry = entry->next)
+    if(entry->type == message_type && entry->session_id == session_id)
+      return entry;
+
+  return NULL;
+}
+
+void message_subscribe_session(message_type_t message_type, uint16_t session_id, message_callback_t *callback, void *param)
+{
+  session_handler_entry_t *entry = find_session_handler(message_type, session_id);
+
+  assert(!is_initialized || IS_OWNER());
+
+  if(!entry)
+  {
+    entry = (session_handler_entry_t *)safe_malloc(sizeof(session_handler_entry_t));
+    entry->type       = message_type;
+    entry->session_id = session_id;
+    entry->next       = session_handlers[session_id % SESSION_BUCKETS];
+    session_handlers[session_id % SESSION_BUCKETS] = entry;
+  }
+
+  entry->handler.callback = callback;
+  entry->handler.param    = param;
+}
+
+void message_unsubscribe_session(message_type_t message_type, uint16_t session_id)
+{
+  session_handler_entry_t **link;
+
+  assert(!is_initialized || IS_OWNER());
+
+  for(link = &session_handlers[session_id % SESSION_BUCKETS]; *link; link = &(*link)->next)
+  {
+    if((*link)->type == message_type && (*link)->session_id == session_id)
+    {
+      session_handler_entry_t *entry = *link;
+
+      *link = entry->next;
+      safe_free(entry);
+      return;
+    }
+  }
+}
+
+static void free_copy(message_t *message);
+
 void message_cleanup()
 {
   message_handler_entry_t *this;
   message_handler_entry_t *next;
   size_t type;
+  size_t i;
+
+  for(i = 0; i < batch_count; i++)
+    free_copy(&batch[i]);
+  batch_count = 0;
+
+  for(i = 0; i < queue_count; i++)
+    free_copy(&queue[(queue_head + i) % queue_size]);
+  queue_count = 0;
+
+  if(queue)
+    safe_free(queue);
+  queue = NULL;
+  queue_size = 0;
+
+  for(i = 0; i < SESSION_BUCKETS; i++)
+  {
+    session_handler_entry_t *entry;
+    session_handler_entry_t *next_entry;
+
+    for(entry = session_handlers[i]; entry; entry = next_entry)
+    {
+      next_entry = entry->next;
+      safe_free(entry);
+    }
+    session_handlers[i] = NULL;
+  }
 
   for(type = 0; type < MESSAGE_MAX_MESSAGE_TYPE; type++)
   {
@@ -69,58 +204,266 @@ void message_handler_destroy(message_handler_t *handler)
   safe_free(handler);
 }
 
-static message_t *message_create(message_type_t message_type)
+/* Messages are built on the caller's stack. One that's handled right away
+ * only lives as long as message_post() takes, so posting it doesn't allocate
+ * anything; one that's queued is copied, along with its data or packet (see
+ * make_copy()). */
+static void message_init(message_t *message, message_type_t message_type)
 {
-  message_t *message = (message_t *) safe_malloc(sizeof(message_t));
+  memset(message, 0, sizeof(message_t));
   message->type = message_type;
-  return message;
 }
 
-void message_destroy(message_t *message)
+/* Whether the message can wait in the queue (the rest have to be handled
+ * right away). */
+static NBBOOL can_queue(message_type_t type)
 {
-  safe_free(message);
+  return type != MESSAGE_CONFIG && type != MESSAGE_START && type != MESSAGE_SHUTDOWN && type != MESSAGE_CREATE_SESSION;
 }
 
-void message_post(message_t *message)
+/* Give the queued message its own copy of anything it points to, since the
+ * poster's will be gone by the time it's handled. */
+static void make_copy(message_t *message)
+{
+  uint8_t *data;
+
+  switch(message->type)
+  {
+    case MESSAGE_DATA_OUT:
+      data = safe_malloc(message->message.data_out.length);
+      memcpy(data, message->message.data_out.data, message->message.data_out.length);
+      message->message.data_out.data = data;
+      break;
+
+    case MESSAGE_DATA_IN:
+      data = safe_malloc(message->message.data_in.length);
+      memcpy(data, message->message.data_in.data, message->message.data_in.length);
+      message->message.data_in.data = data;
+      break;
+
+    case MESSAGE_PACKET_OUT:
+      message->message.packet_out.packet = packet_copy(message->message.packet_out.packet);
+      break;
+
+    case MESSAGE_PACKET_IN:
+      message->message.packet_in.packet = packet_copy(message->message.packet_in.packet);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void free_copy(message_t *message)
+{
+  switch(message->type)
+  {
+    case MESSAGE_DATA_OUT:
+      safe_free(message->message.data_out.data);
+      break;
+
+    case MESSAGE_DATA_IN:
+      safe_free(message->message.data_in.data);
+      break;
+
+    case MESSAGE_PACKET_OUT:
+      packet_destroy(message->message.packet_out.packet);
+      break;
+
+    case MESSAGE_PACKET_IN:
+      packet_destroy(message->message.packet_in.packet);
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void enqueue(message_t *message)
+{
+  message_t *slot;
+
+  if(queue_count == queue_size)
+  {
+    size_t     new_size = queue_size ? queue_size * 2 : QUEUE_STARTING_SIZE;
+    message_t *new_queue = (message_t*) safe_malloc(new_size * sizeof(message_t));
+    size_t     i;
+
+    for(i = 0; i < queue_count; i++)
+      new_queue[i] = queue[(queue_head + i) % queue_size];
+
+    if(queue)
+      safe_free(queue);
+    queue      = new_queue;
+    queue_size = new_size;
+    queue_head = 0;
+  }
+
+  slot = &queue[(queue_head + queue_count) % queue_size];
+  *slot = *message;
+  make_copy(slot);
+  queue_count++;
+}
+
+/* Get the session the message is for, if it's for one. */
+static NBBOOL get_session_id(message_t *message, uint16_t *session_id)
+{
+  switch(message->type)
+  {
+    case MESSAGE_SESSION_CREATED:
+      *session_id = message->message.session_created.session_id;
+      return TRUE;
+    case MESSAGE_CLOSE_SESSION:
+      *session_id = message->message.close_session.session_id;
+      return TRUE;
+    case MESSAGE_SESSION_CLOSED:
+      *session_id = message->message.session_closed.session_id;
+      return TRUE;
+    case MESSAGE_PAUSE_SESSION:
+      *session_id = message->message.pause_session.session_id;
+      return TRUE;
+    case MESSAGE_RESUME_SESSION:
+      *session_id = message->message.resume_session.session_id;
+      return TRUE;
+    case MESSAGE_DATA_OUT:
+      *session_id = message->message.data_out.session_id;
+      return TRUE;
+    case MESSAGE_DATA_IN:
+      *session_id = message->message.data_in.session_id;
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/* Hand the messages (which are all the same type) to everybody that's
+ * subscribed to it, then to whoever subscribed to each one's session. */
+static void dispatch(message_t *messages, size_t count)
 {
   message_handler_entry_t *handler;
+  session_handler_entry_t *session_handler;
+  uint16_t session_id;
+  size_t i;
+
+  for(handler = handlers[messages[0].type]; handler; handler = handler->next)
+  {
+    if(handler->handler->batch_callback)
+    {
+      handler->handler->batch_callback(messages, count, handler->handler->param);
+    }
+    else
+    {
+      for(i = 0; i < count; i++)
+        handler->handler->callback(&messages[i], handler->handler->param);
+    }
+  }
+
+  for(i = 0; i < count; i++)
+  {
+    if(get_session_id(&messages[i], &session_id) && (session_handler = find_session_handler(messages[i].type, session_id)))
+      session_handler->handler.callback(&messages[i], session_handler->handler.param);
+  }
+}
 
-  for(handler = handlers[message->type]; handler; handler = handler->next)
-    handler->handler->callback(message, handler->handler->param);
+void message_post(message_t *message)
+{
+  assert(!is_initialized || IS_OWNER());
+
+  if(is_queued)
+  {
+    if(can_queue(message->type))
+    {
+      enqueue(message);
+      return;
+    }
+
+    /* Keep it in order with everything that was posted before it (unless
+     * this is a handler posting from inside a flush; see message.h). */
+    message_flush();
+  }
+
+  dispatch(message, 1);
+}
+
+void message_set_queued(NBBOOL queued)
+{
+  if(!queued)
+    message_flush();
+
+  is_queued = queued;
+}
+
+void message_flush()
+{
+  size_t i;
+
+  /* Whatever a handler posts is queued, and handled by the flush that's
+   * already going. */
+  if(is_flushing)
+    return;
+  is_flushing = TRUE;
+
+  while(queue_count > 0)
+  {
+    /* Take the run of messages at the front that are all the same type. The
+     * batch is copied out, since handlers can queue (and grow the queue)
+     * while it's being handled. */
+    message_type_t type = queue[queue_head].type;
+
+    batch_count = 0;
+    while(queue_count > 0 && batch_count < MESSAGE_BATCH_MAX && queue[queue_head].type == type)
+    {
+      batch[batch_count++] = queue[queue_head];
+      queue_head = (queue_head + 1) % queue_size;
+      queue_count--;
+    }
+
+    dispatch(batch, batch_count);
+
+    for(i = 0; i < batch_count; i++)
+      free_copy(&batch[i]);
+    batch_count = 0;
+  }
+
+  is_flushing = FALSE;
 }
 
 void message_post_config_int(char *name, int value)
 {
-  message_t *message = message_create(MESSAGE_CONFIG);
-  message->message.config.name = name;
-  message->message.config.type = CONFIG_INT;
-  message->message.config.value.int_value = value;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_CONFIG);
+  message.message.config.name = name;
+  message.message.config.type = CONFIG_INT;
+  message.message.config.value.int_value = value;
+  message_post(&message);
 }
 
 void message_post_config_string(char *name, char *value)
 {
-  message_t *message = message_create(MESSAGE_CONFIG);
-  message->message.config.name = name;
-  message->message.config.type = CONFIG_STRING;
-  message->message.config.value.string_value = value;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_CONFIG);
+  message.message.config.name = name;
+  message.message.config.type = CONFIG_STRING;
+  message.message.config.value.string_value = value;
+  message_post(&message);
 }
 
 void message_post_start()
 {
-  message_t *message = message_create(MESSAGE_START);
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_START);
+  message_post(&message);
 }
 
 void message_post_shutdown()
 {
-  message_t *message = message_create(MESSAGE_SHUTDOWN);
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_SHUTDOWN);
+  message_post(&message);
 }
 
 uint16_t message_post_create_session()
@@ -130,83 +473,105 @@ uint16_t message_post_create_session()
 
 uint16_t message_post_create_session_with_tunnel(char *host, uint16_t port)
 {
-  uint16_t session_id;
-
-  message_t *message = message_create(MESSAGE_CREATE_SESSION);
-  message->message.create_session.tunnel_host = host;
-  message->message.create_session.tunnel_port = port;
-  message_post(message);
-
-  session_id = message->message.create_session.out.session_id;
+  message_t message;
 
-  message_destroy(message);
+  message_init(&message, MESSAGE_CREATE_SESSION);
+  message.message.create_session.tunnel_host = host;
+  message.message.create_session.tunnel_port = port;
+  message_post(&message);
 
-  return session_id;
+  return message.message.create_session.out.session_id;
 }
 
 void message_post_session_created(uint16_t session_id)
 {
-  message_t *message = message_create(MESSAGE_SESSION_CREATED);
-  message->message.session_created.session_id = session_id;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_SESSION_CREATED);
+  message.message.session_created.session_id = session_id;
+  message_post(&message);
 }
 
 void message_post_close_session(uint16_t session_id)
 {
-  message_t *message = message_create(MESSAGE_CLOSE_SESSION);
-  message->message.session_created.session_id = session_id;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_CLOSE_SESSION);
+  message.message.session_created.session_id = session_id;
+  message_post(&message);
 }
 
 void message_post_session_closed(uint16_t session_id)
 {
-  message_t *message = message_create(MESSAGE_CLOSE_SESSION);
-  message->message.session_created.session_id = session_id;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_SESSION_CLOSED);
+  message.message.session_closed.session_id = session_id;
+  message_post(&message);
+}
+
+void message_post_pause_session(uint16_t session_id)
+{
+  message_t message;
+
+  message_init(&message, MESSAGE_PAUSE_SESSION);
+  message.message.pause_session.session_id = session_id;
+  message_post(&message);
+}
+
+void message_post_resume_session(uint16_t session_id)
+{
+  message_t message;
+
+  message_init(&message, MESSAGE_RESUME_SESSION);
+  message.message.resume_session.session_id = session_id;
+  message_post(&message);
 }
 
 void message_post_data_out(uint16_t session_id, uint8_t *data, size_t length)
 {
-  message_t *message = message_create(MESSAGE_DATA_OUT);
-  message->message.data_out.session_id = session_id;
-  message->message.data_out.data = data;
-  message->message.data_out.length = length;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_DATA_OUT);
+  message.message.data_out.session_id = session_id;
+  message.message.data_out.data = data;
+  message.message.data_out.length = length;
+  message_post(&message);
 }
 
 void message_post_packet_out(packet_t *packet)
 {
-  message_t *message = message_create(MESSAGE_PACKET_OUT);
-  message->message.packet_out.packet = packet;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_PACKET_OUT);
+  message.message.packet_out.packet = packet;
+  message_post(&message);
 }
 
 void message_post_packet_in(packet_t *packet)
 {
-  message_t *message = message_create(MESSAGE_PACKET_IN);
-  message->message.packet_in.packet = packet;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_PACKET_IN);
+  message.message.packet_in.packet = packet;
+  message_post(&message);
 }
 
 void message_post_data_in(uint16_t session_id, uint8_t *data, size_t length)
 {
-  message_t *message = message_create(MESSAGE_DATA_IN);
-  message->message.data_in.session_id = session_id;
-  message->message.data_in.data = data;
-  message->message.data_in.length = length;
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_DATA_IN);
+  message.message.data_in.session_id = session_id;
+  message.message.data_in.data = data;
+  message.message.data_in.length = length;
+  message_post(&message);
 }
 
 void message_post_heartbeat()
 {
-  message_t *message = message_create(MESSAGE_HEARTBEAT);
-  message_post(message);
-  message_destroy(message);
+  message_t message;
+
+  message_init(&message, MESSAGE_HEARTBEAT);
+  message_post(&message);
 }
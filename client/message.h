@@ -4,6 +4,9 @@
 #include "packet.h"
 #include "types.h"
 
+/* The most messages that are handed to a batch handler at once. */
+#define MESSAGE_BATCH_MAX 64
+
 typedef enum
 {
   /* This is used to set a configuration value in another listener. */
@@ -35,6 +38,14 @@ typedef enum
    * been closed. */
   MESSAGE_SESSION_CLOSED,
 
+  /* Posted by an input driver that can't keep up with the data coming in for
+   * a session; the session stops taking data from the server (which holds
+   * onto it) till a RESUME_SESSION message is posted. */
+  MESSAGE_PAUSE_SESSION,
+
+  /* Posted by the input driver once it's caught up again. */
+  MESSAGE_RESUME_SESSION,
+
   /* This is posted by the input driver, and injects data into the session to
    * be sent out when the session sees fit. */
   MESSAGE_DATA_OUT,
@@ -114,6 +125,16 @@ typedef struct
       uint16_t session_id;
     } session_closed;
 
+    struct
+    {
+      uint16_t session_id;
+    } pause_session;
+
+    struct
+    {
+      uint16_t session_id;
+    } resume_session;
+
     struct
     {
       uint16_t   session_id;
@@ -144,21 +165,61 @@ typedef struct
   } message;
 } message_t;
 
+/* The message bus isn't thread-safe: it belongs to the main thread, and so
+ * does everything that's driven by it (the sessions and the input drivers).
+ * Other threads have to hand their work to the main thread some other way
+ * (see io_thread.h). */
+
+/* Messages are normally handled as soon as they're posted. If the bus is
+ * queued (see message_set_queued()), most of them are copied into a queue
+ * instead, and handled in order when message_flush() is called (once per loop),
+ * so handlers don't post to each other recursively and runs of the same type
+ * can be handled together. CONFIG, START, SHUTDOWN and CREATE_SESSION (which
+ * returns a value) are always handled right away, after everything that was
+ * queued ahead of them. The exception is a handler posting one during
+ * message_flush(): it's still handled right away, but whatever's left in the
+ * queue waits till after it (the flush that's already going gets to that). */
+
 /* Define the callback function for messages. */
 typedef void(message_callback_t)(message_t *message, void *param);
 
+/* Define the callback function for a batch of messages, which are all the
+ * same type. */
+typedef void(message_batch_callback_t)(message_t *messages, size_t count, void *param);
+
 /* Define the message handler type, which is basically a callback function
  * and the corresponding parameter to send with it. */
 typedef struct
 {
-  message_callback_t *callback;
+  message_callback_t       *callback;
+  message_batch_callback_t *batch_callback;
   void *param;
 } message_handler_t;
 
 void message_subscribe(message_type_t message_type, message_callback_t *callback, void *param);
+
+/* Subscribe to the messages for one session (the types that have a
+ * session_id), so drivers don't have to search their connections for it.
+ * These handlers are found with a table lookup, and called after the ones
+ * that subscribed to every session. A session has at most one handler for
+ * each type; subscribing again replaces it. */
+void message_subscribe_session(message_type_t message_type, uint16_t session_id, message_callback_t *callback, void *param);
+void message_unsubscribe_session(message_type_t message_type, uint16_t session_id);
+
+/* Subscribe to batches of messages: when the bus is queued, each run of this
+ * type in the queue (up to MESSAGE_BATCH_MAX) is handed over at once.
+ * Otherwise, the batches are one message long. */
+void message_subscribe_batch(message_type_t message_type, message_batch_callback_t *callback, void *param);
 void message_unsubscribe(message_type_t message_type, message_callback_t *callback); /* TODO */
 void message_cleanup();
 
+/* Turn the queue on or off (it's off by default). Turning it off flushes it. */
+void message_set_queued(NBBOOL queued);
+
+/* Handle everything that's been queued, including whatever the handlers
+ * queue in the meantime. */
+void message_flush();
+
 void message_post_config_int(char *name, int value);
 void message_post_config_string(char *name, char *value);
 
@@ -169,6 +230,8 @@ uint16_t message_post_create_session_with_tunnel(char *host, uint16_t port);
 void message_post_session_created(uint16_t session_id);
 void message_post_close_session(uint16_t session_id);
 void message_post_session_closed(uint16_t session_id);
+void message_post_pause_session(uint16_t session_id);
+void message_post_resume_session(uint16_t session_id);
 
 void message_post_data_out(uint16_t session_id, uint8_t *data, size_t length);
 void message_post_packet_out(packet_t *packet);
@@ -1,6 +1,10 @@
+#define LOG_MODULE LOG_MODULE_PACKET
+
+#include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "buffer.h"
 #include "log.h"
@@ -11,52 +15,127 @@
  * programs. */
 int snprintf(char *STR, size_t SIZE, const char *FORMAT, ...);
 
-packet_t *packet_parse(uint8_t *data, size_t length)
+/* The filler in a PING is a simple counting pattern, so either side can tell
+ * whether it was truncated or mangled along the way. */
+#define PING_FILLER(i) ((uint8_t)((i) & 0xFF))
+
+/* The fixed-size records that packets are made of (see the BE_ macros in
+ * buffer.h), besides the header: the start of a SYN or MSG (two 16-bit
+ * fields), and one SACK range. */
+#define BODY_RECORD_LENGTH   4
+#define SACK_RECORD_LENGTH   4
+
+/* Every packet that goes in or out is created and destroyed right away, so
+ * they're recycled through a pool. */
+static pool_t packet_pool = POOL_INITIALIZER(packet_t);
+
+packet_t *packet_parse(uint8_t *data, size_t length, arena_t *arena)
 {
-  packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
-  buffer_t *buffer = buffer_create_with_data(BO_BIG_ENDIAN, data, length);
+  packet_t      *packet;
+  buffer_view_t  view;
+  const uint8_t *record;
+  const uint8_t *payload;
+  size_t         body_length;
+  size_t         i;
 
   /* Validate the size */
-  if(buffer_get_length(buffer) > MAX_PACKET_SIZE)
+  if(length > MAX_PACKET_SIZE)
   {
-    LOG_FATAL("Packet is too long: %zu bytes\n", buffer_get_length(buffer));
-    exit(1);
+    LOG_ERROR("Packet is too long: %u bytes", (unsigned int)length);
+    return NULL;
+  }
+
+  buffer_view_init(&view, BO_BIG_ENDIAN, data, length);
+
+  if(!buffer_view_can_read(&view, PACKET_HEADER_SIZE))
+  {
+    LOG_ERROR("Packet is too short: %u bytes", (unsigned int)length);
+    return NULL;
   }
 
-  packet->packet_type = buffer_read_next_int8(buffer);
-  packet->packet_id    = buffer_read_next_int16(buffer);
-  packet->session_id   = buffer_read_next_int16(buffer);
+  /* The fixed part of the body, by type. */
+  switch(data[0])
+  {
+    case PACKET_TYPE_SYN:
+    case PACKET_TYPE_MSG:
+      body_length = BODY_RECORD_LENGTH;
+      break;
+
+    case PACKET_TYPE_FIN:
+      body_length = 0;
+      break;
+
+    case PACKET_TYPE_PING:
+      body_length = 2;
+      break;
+
+    default:
+      LOG_ERROR("Unknown packet type (0x%02x)", data[0]);
+      return NULL;
+  }
+
+  if(!buffer_view_can_read_at(&view, PACKET_HEADER_SIZE, body_length))
+  {
+    LOG_ERROR("Packet is too short for its type: %u bytes", (unsigned int)length);
+    return NULL;
+  }
+
+  /* It's all there, so nothing below can run off the end. */
+  packet = arena ? (packet_t*) arena_alloc(arena, sizeof(packet_t)) : (packet_t*) safe_pool_alloc(&packet_pool);
+  packet->arena = arena;
+
+  record = buffer_view_read_next_bytes(&view, PACKET_HEADER_SIZE);
+  packet->packet_type = record[0];
+  packet->packet_id   = BE_GET16(record + 1);
+  packet->session_id  = BE_GET16(record + 3);
 
   switch(packet->packet_type)
   {
     case PACKET_TYPE_SYN:
-      packet->body.syn.seq     = buffer_read_next_int16(buffer);
-      packet->body.syn.options = buffer_read_next_int16(buffer);
+      record = buffer_view_read_next_bytes(&view, BODY_RECORD_LENGTH);
+      packet->body.syn.seq     = BE_GET16(record);
+      packet->body.syn.options = BE_GET16(record + 2);
       break;
 
     case PACKET_TYPE_MSG:
-      packet->body.msg.seq     = buffer_read_next_int16(buffer);
-      packet->body.msg.ack     = buffer_read_next_int16(buffer);
-      packet->body.msg.data    = buffer_read_remaining_bytes(buffer, &packet->body.msg.data_length, -1, FALSE);
+      record = buffer_view_read_next_bytes(&view, BODY_RECORD_LENGTH);
+      packet->body.msg.seq     = BE_GET16(record);
+      packet->body.msg.ack     = BE_GET16(record + 2);
+      payload                  = buffer_view_read_remaining_bytes(&view, &packet->body.msg.data_length);
+
+      /* An arena packet borrows its payload from 'data'; otherwise, the packet
+       * owns a copy. */
+      if(arena)
+        packet->body.msg.data = (uint8_t*) payload;
+      else
+        packet->body.msg.data = safe_memcpy(payload, packet->body.msg.data_length);
       break;
 
     case PACKET_TYPE_FIN:
       /* Do nothing */
       break;
 
+    case PACKET_TYPE_PING:
+      record                            = buffer_view_read_next_bytes(&view, 2);
+      packet->body.ping.response_length = BE_GET16(record);
+      payload                           = buffer_view_read_remaining_bytes(&view, &packet->body.ping.padding_length);
+      packet->body.ping.is_intact       = TRUE;
+      for(i = 0; i < packet->body.ping.padding_length; i++)
+        if(payload[i] != PING_FILLER(i))
+          packet->body.ping.is_intact = FALSE;
+      break;
+
     default:
-      LOG_FATAL("Error: unknown message type (0x%02x)\n", packet->packet_type);
-      exit(0);
+      /* Turned away above. */
+      break;
   }
 
-  buffer_destroy(buffer);
-
   return packet;
 }
 
 packet_t *packet_create_syn(uint16_t session_id, uint16_t seq, uint16_t options)
 {
-  packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
+  packet_t *packet = (packet_t*) safe_pool_alloc(&packet_pool);
   packet->packet_type     = PACKET_TYPE_SYN;
   packet->packet_id        = rand() % 0xFFFF;
   packet->session_id       = session_id;
@@ -68,13 +147,16 @@ packet_t *packet_create_syn(uint16_t session_id, uint16_t seq, uint16_t options)
 
 packet_t *packet_create_msg(uint16_t session_id, uint16_t seq, uint16_t ack, uint8_t *data, size_t data_length)
 {
-  packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
+  packet_t *packet = (packet_t*) safe_pool_alloc(&packet_pool);
 
   packet->packet_type         = PACKET_TYPE_MSG;
   packet->packet_id            = rand() % 0xFFFF;
   packet->session_id           = session_id;
   packet->body.msg.seq         = seq;
   packet->body.msg.ack         = ack;
+  packet->body.msg.options     = 0;
+  packet->body.msg.flags       = 0;
+  packet->body.msg.sack_count  = 0;
   packet->body.msg.data        = safe_memcpy(data, data_length);
   packet->body.msg.data_length = data_length;
 
@@ -83,7 +165,7 @@ packet_t *packet_create_msg(uint16_t session_id, uint16_t seq, uint16_t ack, uin
 
 packet_t *packet_create_fin(uint16_t session_id)
 {
-  packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
+  packet_t *packet = (packet_t*) safe_pool_alloc(&packet_pool);
 
   packet->packet_type     = PACKET_TYPE_FIN;
   packet->packet_id        = rand() % 0xFFFF;
@@ -92,6 +174,39 @@ packet_t *packet_create_fin(uint16_t session_id)
   return packet;
 }
 
+packet_t *packet_create_ping(uint16_t response_length, size_t padding_length)
+{
+  packet_t *packet = (packet_t*) safe_pool_alloc(&packet_pool);
+
+  packet->packet_type               = PACKET_TYPE_PING;
+  packet->packet_id                 = rand() % 0xFFFF;
+  packet->session_id                = 0;
+  packet->body.ping.response_length = response_length;
+  packet->body.ping.padding_length  = padding_length;
+  packet->body.ping.is_intact       = TRUE;
+
+  return packet;
+}
+
+packet_t *packet_copy(packet_t *packet)
+{
+  packet_t *copy = (packet_t*) safe_pool_alloc(&packet_pool);
+
+  memcpy(copy, packet, sizeof(packet_t));
+  copy->arena = NULL;
+
+  if(packet->packet_type == PACKET_TYPE_SYN && packet->body.syn.name)
+    copy->body.syn.name = safe_strdup(packet->body.syn.name);
+
+  if(packet->packet_type == PACKET_TYPE_MSG)
+  {
+    copy->body.msg.data = safe_malloc(packet->body.msg.data_length);
+    memcpy(copy->body.msg.data, packet->body.msg.data, packet->body.msg.data_length);
+  }
+
+  return copy;
+}
+
 void packet_syn_set_name(packet_t *packet, char *name)
 {
   if(packet->packet_type != PACKET_TYPE_SYN)
@@ -122,97 +237,254 @@ void packet_syn_set_tunnel(packet_t *packet, char *host, uint16_t port)
   packet->body.syn.tunnel_port = port;
 }
 
-size_t packet_get_syn_size()
+void packet_msg_set_flags(packet_t *packet, uint8_t flags)
 {
-  static size_t size = 0;
+  if(packet->packet_type != PACKET_TYPE_MSG)
+  {
+    LOG_FATAL("Attempted to set the 'flags' field of a non-MSG message\n");
+    exit(1);
+  }
+
+  packet->body.msg.options |= OPT_MSG_FLAGS;
+  packet->body.msg.flags = flags;
+}
 
-  /* If the size isn't known yet, calculate it. */
-  if(size == 0)
+void packet_msg_set_sack(packet_t *packet, sack_range_t *ranges, uint8_t count)
+{
+  if(packet->packet_type != PACKET_TYPE_MSG)
   {
-    packet_t *p = packet_create_syn(0, 0, 0);
-    uint8_t *data = packet_to_bytes(p, &size);
-    safe_free(data);
-    packet_destroy(p);
+    LOG_FATAL("Attempted to set the 'sack' field of a non-MSG message\n");
+    exit(1);
   }
 
-  return size;
+  if(count > SACK_MAX_RANGES)
+  {
+    LOG_FATAL("Attempted to add %d SACK ranges (the most is %d)\n", count, SACK_MAX_RANGES);
+    exit(1);
+  }
+
+  packet->body.msg.options |= OPT_SACK;
+  packet->body.msg.sack_count = count;
+  if(count > 0)
+    memcpy(packet->body.msg.sack, ranges, count * sizeof(sack_range_t));
 }
 
-size_t packet_get_msg_size()
+NBBOOL packet_msg_parse_options(packet_t *packet, uint16_t options)
 {
-  static size_t size = 0;
+  buffer_view_t  view;
+  const uint8_t *record;
+  const uint8_t *remaining;
+  size_t         remaining_length;
+  uint8_t        i;
+
+  if(packet->packet_type != PACKET_TYPE_MSG)
+  {
+    LOG_FATAL("Attempted to parse the options of a non-MSG message\n");
+    exit(1);
+  }
+
+  if(packet->body.msg.data_length < packet_get_msg_options_size(options))
+    return FALSE;
+
+  buffer_view_init(&view, BO_BIG_ENDIAN, packet->body.msg.data, packet->body.msg.data_length);
+
+  if(options & OPT_MSG_FLAGS)
+    packet->body.msg.flags = buffer_view_read_next_int8(&view);
+
+  if(options & OPT_SACK)
+  {
+    packet->body.msg.sack_count = buffer_view_read_next_int8(&view);
+    if(packet->body.msg.sack_count > SACK_MAX_RANGES || !buffer_view_can_read(&view, packet->body.msg.sack_count * SACK_RECORD_LENGTH))
+      return FALSE;
+
+    record = buffer_view_read_next_bytes(&view, packet->body.msg.sack_count * SACK_RECORD_LENGTH);
+    for(i = 0; i < packet->body.msg.sack_count; i++, record += SACK_RECORD_LENGTH)
+    {
+      packet->body.msg.sack[i].start = BE_GET16(record);
+      packet->body.msg.sack[i].end   = BE_GET16(record + 2);
+    }
+  }
+
+  /* Whatever's left is the actual data. A borrowed payload can just be
+   * pointed past the options; one the packet owns is shifted down. */
+  remaining = buffer_view_read_remaining_bytes(&view, &remaining_length);
+  if(packet->arena)
+    packet->body.msg.data = (uint8_t*) remaining;
+  else
+    memmove(packet->body.msg.data, remaining, remaining_length);
+  packet->body.msg.data_length = remaining_length;
+  packet->body.msg.options     = options;
+
+  return TRUE;
+}
 
-  /* If the size isn't known yet, calculate it. */
-  if(size == 0)
+void packet_syn_set_max_downstream(packet_t *packet, uint16_t max_downstream)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
   {
-    packet_t *p = packet_create_msg(0, 0, 0, (uint8_t *)"", 0);
-    uint8_t *data = packet_to_bytes(p, &size);
-    safe_free(data);
-    packet_destroy(p);
+    LOG_FATAL("Attempted to set the 'max_downstream' field of a non-SYN message\n");
+    exit(1);
   }
 
+  packet->body.syn.options |= OPT_DOWNSTREAM;
+  packet->body.syn.max_downstream = max_downstream;
+}
+
+size_t packet_get_msg_options_size(uint16_t options)
+{
+  size_t size = 0;
+
+  if(options & OPT_MSG_FLAGS)
+    size += 1;
+  if(options & OPT_SACK)
+    size += 1;
+
   return size;
 }
 
-size_t packet_get_fin_size()
+size_t packet_get_length(packet_t *packet)
 {
-  static size_t size = 0;
+  size_t length;
 
-  /* If the size isn't known yet, calculate it. */
-  if(size == 0)
+  switch(packet->packet_type)
   {
-    packet_t *p = packet_create_fin(0);
-    uint8_t *data = packet_to_bytes(p, &size);
-    safe_free(data);
-    packet_destroy(p);
+    case PACKET_TYPE_SYN:
+      length = PACKET_SYN_SIZE;
+      if(packet->body.syn.options & OPT_NAME)
+        length += strlen(packet->body.syn.name) + 1;
+      if(packet->body.syn.options & OPT_TUNNEL)
+        length += strlen(packet->body.syn.tunnel_host) + 1 + 2;
+      if(packet->body.syn.options & OPT_DOWNSTREAM)
+        length += 2;
+      break;
+
+    case PACKET_TYPE_MSG:
+      length = PACKET_MSG_SIZE;
+      if(packet->body.msg.options & OPT_MSG_FLAGS)
+        length += 1;
+      if(packet->body.msg.options & OPT_SACK)
+        length += 1 + (packet->body.msg.sack_count * SACK_RECORD_LENGTH);
+      length += packet->body.msg.data_length;
+      break;
+
+    case PACKET_TYPE_FIN:
+      length = PACKET_FIN_SIZE;
+      break;
+
+    case PACKET_TYPE_PING:
+      length = PACKET_PING_SIZE + packet->body.ping.padding_length;
+      break;
+
+    default:
+      LOG_FATAL("Error: Unknown message type: %u\n", packet->packet_type);
+      exit(1);
   }
 
-  return size;
+  return length;
 }
 
-uint8_t *packet_to_bytes(packet_t *packet, size_t *length)
+/* Write a string, with its terminator. */
+static uint8_t *write_ntstring(uint8_t *out, char *str)
 {
-  buffer_t *buffer = buffer_create(BO_BIG_ENDIAN);
+  size_t length = strlen(str) + 1;
 
-  buffer_add_int8(buffer, packet->packet_type);
-  buffer_add_int16(buffer, packet->packet_id);
-  buffer_add_int16(buffer, packet->session_id);
+  memcpy(out, str, length);
+
+  return out + length;
+}
+
+size_t packet_write(packet_t *packet, uint8_t *out, size_t cap)
+{
+  size_t   length = packet_get_length(packet);
+  uint8_t *p = out;
+  size_t   i;
+
+  if(length > cap)
+    return 0;
+
+  p[0] = packet->packet_type;
+  BE_PUT16(p + 1, packet->packet_id);
+  BE_PUT16(p + 3, packet->session_id);
+  p += PACKET_HEADER_SIZE;
 
   switch(packet->packet_type)
   {
     case PACKET_TYPE_SYN:
-      buffer_add_int16(buffer, packet->body.syn.seq);
-      buffer_add_int16(buffer, packet->body.syn.options);
+      BE_PUT16(p,     packet->body.syn.seq);
+      BE_PUT16(p + 2, packet->body.syn.options);
+      p += BODY_RECORD_LENGTH;
 
       if(packet->body.syn.options & OPT_NAME)
       {
-        buffer_add_ntstring(buffer, packet->body.syn.name);
+        p = write_ntstring(p, packet->body.syn.name);
       }
 
       if(packet->body.syn.options & OPT_TUNNEL)
       {
-        buffer_add_ntstring(buffer, packet->body.syn.tunnel_host);
-        buffer_add_int16(buffer, packet->body.syn.tunnel_port);
+        p = write_ntstring(p, packet->body.syn.tunnel_host);
+        BE_PUT16(p, packet->body.syn.tunnel_port);
+        p += 2;
+      }
+
+      if(packet->body.syn.options & OPT_DOWNSTREAM)
+      {
+        BE_PUT16(p, packet->body.syn.max_downstream);
+        p += 2;
       }
 
       break;
 
     case PACKET_TYPE_MSG:
-      buffer_add_int16(buffer, packet->body.msg.seq);
-      buffer_add_int16(buffer, packet->body.msg.ack);
-      buffer_add_bytes(buffer, packet->body.msg.data, packet->body.msg.data_length);
+      BE_PUT16(p,     packet->body.msg.seq);
+      BE_PUT16(p + 2, packet->body.msg.ack);
+      p += BODY_RECORD_LENGTH;
+
+      if(packet->body.msg.options & OPT_MSG_FLAGS)
+        *p++ = packet->body.msg.flags;
+      if(packet->body.msg.options & OPT_SACK)
+      {
+        *p++ = packet->body.msg.sack_count;
+        for(i = 0; i < packet->body.msg.sack_count; i++, p += SACK_RECORD_LENGTH)
+        {
+          BE_PUT16(p,     packet->body.msg.sack[i].start);
+          BE_PUT16(p + 2, packet->body.msg.sack[i].end);
+        }
+      }
+      if(packet->body.msg.data_length)
+        memcpy(p, packet->body.msg.data, packet->body.msg.data_length);
+      p += packet->body.msg.data_length;
       break;
 
     case PACKET_TYPE_FIN:
       /* Do nothing */
       break;
 
+    case PACKET_TYPE_PING:
+      BE_PUT16(p, packet->body.ping.response_length);
+      p += 2;
+      for(i = 0; i < packet->body.ping.padding_length; i++)
+        *p++ = PING_FILLER(i);
+      break;
+
     default:
       LOG_FATAL("Error: Unknown message type: %u\n", packet->packet_type);
       exit(1);
   }
 
-  return buffer_create_string_and_destroy(buffer, length);
+  assert((size_t)(p - out) == length);
+
+  return length;
+}
+
+uint8_t *packet_to_bytes(packet_t *packet, size_t *length, arena_t *arena)
+{
+  uint8_t *data;
+
+  *length = packet_get_length(packet);
+  data    = (uint8_t*) arena_alloc(arena, *length);
+  packet_write(packet, data, *length);
+
+  return data;
 }
 
 char *packet_to_s(packet_t *packet)
@@ -229,12 +501,19 @@ char *packet_to_s(packet_t *packet)
   }
   else if(packet->packet_type == PACKET_TYPE_MSG)
   {
-    snprintf(ret, 1024, "Type = MSG :: packet_id = 0x%04x, session = 0x%04x, seq = 0x%04x, ack = 0x%04x", packet->packet_id, packet->session_id, packet->body.msg.seq, packet->body.msg.ack);
+    if(packet->body.msg.options & OPT_MSG_FLAGS)
+      snprintf(ret, 1024, "Type = MSG :: packet_id = 0x%04x, session = 0x%04x, seq = 0x%04x, ack = 0x%04x, flags = 0x%02x", packet->packet_id, packet->session_id, packet->body.msg.seq, packet->body.msg.ack, packet->body.msg.flags);
+    else
+      snprintf(ret, 1024, "Type = MSG :: packet_id = 0x%04x, session = 0x%04x, seq = 0x%04x, ack = 0x%04x", packet->packet_id, packet->session_id, packet->body.msg.seq, packet->body.msg.ack);
   }
   else if(packet->packet_type == PACKET_TYPE_FIN)
   {
     snprintf(ret, 1024, "Type = FIN :: packet_id = 0x%04x, session = 0x%04x", packet->packet_id, packet->session_id);
   }
+  else if(packet->packet_type == PACKET_TYPE_PING)
+  {
+    snprintf(ret, 1024, "Type = PING :: packet_id = 0x%04x, response_length = %d, padding = %d bytes%s", packet->packet_id, packet->body.ping.response_length, (int)packet->body.ping.padding_length, packet->body.ping.is_intact ? "" : " (damaged)");
+  }
   else
   {
     snprintf(ret, 1024, "Unknown packet type!");
@@ -252,6 +531,10 @@ void packet_print(packet_t *packet)
 
 void packet_destroy(packet_t *packet)
 {
+  /* Arena packets go away when the arena is reset. */
+  if(packet->arena)
+    return;
+
   if(packet->packet_type == PACKET_TYPE_SYN)
   {
     if(packet->body.syn.name)
@@ -263,6 +546,6 @@ void packet_destroy(packet_t *packet)
     safe_free(packet->body.msg.data);
   }
 
-  safe_free(packet);
+  safe_pool_free(&packet_pool, packet);
 }
 
@@ -10,13 +10,26 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "memory.h"
+#include "types.h"
+
 #define MAX_PACKET_SIZE 1024
 
+/* The sizes of the packets with nothing optional in them (no SYN options, no
+ * MSG options or data, and no PING filler). Every packet starts with a header
+ * (the type, packet_id and session_id). */
+#define PACKET_HEADER_SIZE 5
+#define PACKET_SYN_SIZE    (PACKET_HEADER_SIZE + 4)
+#define PACKET_MSG_SIZE    (PACKET_HEADER_SIZE + 4)
+#define PACKET_FIN_SIZE    (PACKET_HEADER_SIZE)
+#define PACKET_PING_SIZE   (PACKET_HEADER_SIZE + 2)
+
 typedef enum
 {
   PACKET_TYPE_SYN = 0x00,
   PACKET_TYPE_MSG = 0x01,
   PACKET_TYPE_FIN = 0x02,
+  PACKET_TYPE_PING = 0x03,
 } packet_type_t;
 
 typedef struct
@@ -26,18 +39,44 @@ typedef struct
   char    *name;
   char    *tunnel_host;
   uint16_t tunnel_port;
+  uint16_t max_downstream;
 } syn_packet_t;
 
 typedef enum
 {
   OPT_NAME = 1,
   OPT_TUNNEL = 2,
+  OPT_DOWNSTREAM = 8,
+  OPT_MSG_FLAGS = 0x10,
+  OPT_SACK = 0x20,
 } syn_option_t;
 
+/* Flags carried in MSG packets when OPT_MSG_FLAGS is negotiated. */
+typedef enum
+{
+  MSG_FLAG_MORE     = 0x01, /* (server) More data is queued than fit in this packet. */
+  MSG_FLAG_LONGPOLL = 0x02, /* (client) Nothing to send; hold this till there's data. */
+} msg_flag_t;
+
+/* The most selective-ACK ranges a MSG can carry when OPT_SACK is negotiated. */
+#define SACK_MAX_RANGES 4
+
+/* A block of data received beyond the cumulative ACK, from 'start' up to (but
+ * not including) 'end'. */
+typedef struct
+{
+  uint16_t start;
+  uint16_t end;
+} sack_range_t;
+
 typedef struct
 {
   uint16_t seq;
   uint16_t ack;
+  uint16_t options; /* Which optional fields are present (negotiated in the SYN). */
+  uint8_t  flags;
+  uint8_t      sack_count;
+  sack_range_t sack[SACK_MAX_RANGES];
   uint8_t *data;
   size_t   data_length;
 } msg_packet_t;
@@ -47,6 +86,13 @@ typedef struct
   /* No fields in a FIN packet */
 } fin_packet_t;
 
+typedef struct
+{
+  uint16_t response_length; /* The total length the reply should be padded to. */
+  size_t   padding_length;  /* The number of filler bytes following the header. */
+  NBBOOL   is_intact;       /* Set by packet_parse() if the filler arrived unmodified. */
+} ping_packet_t;
+
 typedef struct
 {
   packet_type_t packet_type;
@@ -58,27 +104,60 @@ typedef struct
     syn_packet_t syn;
     msg_packet_t msg;
     fin_packet_t fin;
+    ping_packet_t ping;
   } body;
+
+  /* The arena the packet was parsed into, if any. */
+  arena_t *arena;
 } packet_t;
 
-/* Parse a packet from a byte stream. */
-packet_t *packet_parse(uint8_t *data, size_t length);
+/* Parse a packet from a byte stream. If an arena is given (see memory.h), the
+ * packet is allocated from it, and packet_destroy() does nothing; its payload
+ * isn't copied either, but points into 'data', which has to stick around till
+ * the arena's reset. Returns NULL if the packet is too short or too long for
+ * its type, or the type isn't one we know. */
+packet_t *packet_parse(uint8_t *data, size_t length, arena_t *arena);
 
 /* Create a packet with the given characteristics. */
 packet_t *packet_create_syn(uint16_t session_id, uint16_t seq, uint16_t options);
 packet_t *packet_create_msg(uint16_t session_id, uint16_t seq, uint16_t ack, uint8_t *data, size_t data_length);
 packet_t *packet_create_fin(uint16_t session_id);
 
+/* Create a PING carrying 'padding_length' bytes of filler, asking for a reply
+ * that's 'response_length' bytes long on the wire. */
+packet_t *packet_create_ping(uint16_t response_length, size_t padding_length);
+
 /* Set the OPT_NAME field and add a name value. */
 void packet_syn_set_name(packet_t *packet, char *name);
 
 /* Set the OPT_TUNNEL field and add a tunnel value. */
 void packet_syn_set_tunnel(packet_t *packet, char *host, uint16_t port);
 
-/* Get minimum packet sizes so we can avoid magic numbers. */
-size_t packet_get_syn_size();
-size_t packet_get_msg_size();
-size_t packet_get_fin_size();
+/* Set the flags on a MSG packet (and mark them as present, so only do this if
+ * OPT_MSG_FLAGS was negotiated). */
+void packet_msg_set_flags(packet_t *packet, uint8_t flags);
+
+/* Set the selective-ACK ranges on a MSG packet (and mark them as present, so
+ * only do this if OPT_SACK was negotiated). */
+void packet_msg_set_sack(packet_t *packet, sack_range_t *ranges, uint8_t count);
+
+/* packet_parse() has no idea which optional MSG fields a session negotiated,
+ * so it leaves them at the start of the data; this pulls them out. Returns
+ * FALSE if the data is too short to hold them. */
+NBBOOL packet_msg_parse_options(packet_t *packet, uint16_t options);
+
+/* Set the OPT_DOWNSTREAM field and add the longest packet the server should
+ * send back to us. */
+void packet_syn_set_max_downstream(packet_t *packet, uint16_t max_downstream);
+
+/* Get the number of bytes taken by the optional MSG fields for 'options' (with
+ * no SACK ranges, which is all we ever send). */
+size_t packet_get_msg_options_size(uint16_t options);
+
+/* Make a copy of the packet that has to be packet_destroy()ed separately (the
+ * tunnel host isn't copied -- it's never owned by the packet). The copy is
+ * always on the heap, even if the packet's in an arena. */
+packet_t *packet_copy(packet_t *packet);
 
 /* Free the packet data structures. */
 void packet_destroy(packet_t *packet);
@@ -89,8 +168,16 @@ char *packet_to_s(packet_t *packet);
 /* Print the packet (debugging, mostly) */
 void packet_print(packet_t *packet);
 
-/* Needs to be freed with safe_free() */
-uint8_t *packet_to_bytes(packet_t *packet, size_t *length);
+/* Get the number of bytes the packet takes on the wire. */
+size_t packet_get_length(packet_t *packet);
+
+/* Serialize the packet into 'out', which has room for 'cap' bytes. Returns the
+ * number of bytes written, or 0 (and writes nothing) if it doesn't fit. */
+size_t packet_write(packet_t *packet, uint8_t *out, size_t cap);
+
+/* The same, into memory that's allocated for it. Needs to be freed with
+ * safe_free(), unless it's from an arena. */
+uint8_t *packet_to_bytes(packet_t *packet, size_t *length, arena_t *arena);
 
 
 #endif
@@ -0,0 +1,91 @@
+/* ring.c
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "types.h"
+
+#include "ring.h"
+
+/* The producer publishes a slot by storing 'head' after it's filled in, and
+ * the consumer frees one by storing 'tail' after it's done with it; each side
+ * reads the other's counter with acquire semantics, so it sees the slot's
+ * contents (or that it's free) by the time it sees the count change. */
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+ring_t *ring_create(size_t slot_count)
+{
+  ring_t *ring = (ring_t*) safe_malloc(sizeof(ring_t));
+
+  ring->slots      = (ring_slot_t*) safe_malloc(slot_count * sizeof(ring_slot_t));
+  ring->slot_count = slot_count;
+  ring->head       = 0;
+  ring->tail       = 0;
+
+  if(pipe(ring->wake) == -1)
+    nbdie("ring: couldn't create a pipe");
+
+  /* A full pipe just means the consumer already has a wakeup coming, so
+   * neither end should ever block. */
+  fcntl(ring->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(ring->wake[1], F_SETFL, O_NONBLOCK);
+
+  return ring;
+}
+
+void ring_destroy(ring_t *ring)
+{
+  close(ring->wake[0]);
+  close(ring->wake[1]);
+
+  safe_free(ring->slots);
+  safe_free(ring);
+}
+
+ring_slot_t *ring_get_free_slot(ring_t *ring)
+{
+  if(ring->head - LOAD_ACQUIRE(&ring->tail) >= ring->slot_count)
+    return NULL;
+
+  return &ring->slots[ring->head % ring->slot_count];
+}
+
+void ring_push(ring_t *ring)
+{
+  STORE_RELEASE(&ring->head, ring->head + 1);
+  ring_wake(ring);
+}
+
+ring_slot_t *ring_get_used_slot(ring_t *ring)
+{
+  if(LOAD_ACQUIRE(&ring->head) == ring->tail)
+    return NULL;
+
+  return &ring->slots[ring->tail % ring->slot_count];
+}
+
+void ring_pop(ring_t *ring)
+{
+  STORE_RELEASE(&ring->tail, ring->tail + 1);
+}
+
+void ring_wake(ring_t *ring)
+{
+  char c = 0;
+
+  /* If this fails, the pipe's full (so the consumer will wake up anyways). */
+  if(write(ring->wake[1], &c, 1) < 0)
+    return;
+}
+
+int ring_get_wake_fd(ring_t *ring)
+{
+  return ring->wake[0];
+}
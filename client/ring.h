@@ -0,0 +1,76 @@
+/* ring.h
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ *
+ * A bounded queue for handing packets from one thread to another, without
+ * locks. Exactly one thread may put things in (the producer), and exactly one
+ * may take them out (the consumer).
+ *
+ * The slots are allocated up front, and filled and emptied in place:
+ *
+ *   slot = ring_get_free_slot(ring);   (producer; NULL if the ring is full)
+ *   ...fill in slot->type, slot->data, etc...
+ *   ring_push(ring);
+ *
+ *   slot = ring_get_used_slot(ring);   (consumer; NULL if the ring is empty)
+ *   ...use the slot...
+ *   ring_pop(ring);
+ *
+ * Each push also writes a byte to a pipe, so the consumer can add
+ * ring_get_wake_fd() to its select_group and find out when there's something
+ * to read (it should empty the ring every time it's woken up, since a wakeup
+ * can stand for any number of pushes).
+ */
+
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdlib.h>
+
+#include "types.h"
+
+/* Big enough for any dnscat packet (which have to fit in a DNS name). */
+#define RING_SLOT_SIZE 512
+
+typedef struct
+{
+  int      type;   /* What's in the slot (up to whoever's using the ring). */
+  int      value;
+  size_t   length; /* The number of bytes in 'data'. */
+  uint8_t  data[RING_SLOT_SIZE];
+} ring_slot_t;
+
+/* This struct shouldn't be accessed directly */
+typedef struct
+{
+  ring_slot_t *slots;
+  size_t       slot_count;
+
+  /* 'head' is only written by the producer and 'tail' only by the consumer;
+   * they count up forever, and 'head - tail' is how many slots are in use.
+   * They're kept on separate cache lines so the two threads don't fight over
+   * one. */
+  size_t       head;
+  char         padding[64];
+  size_t       tail;
+
+  int          wake[2];
+} ring_t;
+
+ring_t      *ring_create(size_t slot_count);
+void         ring_destroy(ring_t *ring);
+
+/* Producer side. */
+ring_slot_t *ring_get_free_slot(ring_t *ring);
+void         ring_push(ring_t *ring);
+
+/* Consumer side. */
+ring_slot_t *ring_get_used_slot(ring_t *ring);
+void         ring_pop(ring_t *ring);
+
+/* Wake the consumer up without pushing anything (for shutting down). */
+void         ring_wake(ring_t *ring);
+int          ring_get_wake_fd(ring_t *ring);
+
+#endif
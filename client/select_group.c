@@ -5,18 +5,21 @@
  * (See LICENSE.txt)
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
 #ifdef WIN32
 #include <winsock2.h>
 #else
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #endif
 
@@ -24,11 +27,50 @@
 #include "select_group.h"
 #include "tcp.h"
 
+/* (select_group.h decides whether we're using epoll and io_uring) */
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef USE_URING
+#include <endian.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
 /* People probably won't be using more than 32 sockets, so 32 should be a good number
  * to avoid unnecessary realloc() calls. */
 #define LIST_STARTING_SIZE 32
 #define MAX_RECV 8192
 
+/* The most a socket's receive buffer can grow to, and the number of reads in a row that don't need the extra space
+ * before it's shrunk back to MAX_RECV (see get_recv_buffer()). */
+#define MAX_RECV_BUFFER 65536
+#define RECV_SHRINK_READS 16
+
+/* The most we'll read from one socket on each loop, before giving the others a turn. */
+#define READ_BUDGET (256 * 1024)
+
+/* Flags for send(): don't block, and don't raise SIGPIPE if the other side's gone (we'll get EPIPE instead). */
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL)
+#elif defined(MSG_DONTWAIT)
+#define SEND_FLAGS MSG_DONTWAIT
+#else
+#define SEND_FLAGS 0
+#endif
+
+/* Whether an error just means the socket can't take any more right now. */
+#ifdef WIN32
+#define WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
+#else
+#define WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK || (err) == EINTR)
+#endif
+
+/* The most events we'll take from epoll() in one go (any others are picked up on the next loop). */
+#define MAX_EVENTS 64
+
 /* Some macros to access elements within the numbered structure. */
 #define SG_SOCKET(sg,i) sg->select_list[i]->s
 #ifdef WIN32
@@ -51,6 +93,11 @@ static select_t *find_select_by_socket(select_group_t *group, int s)
   size_t i;
   select_t *ret = NULL;
 
+  /* Sockets are looked up by number; only the made-up identifiers for Windows pipes (which can be negative) have to
+   * be searched for. */
+  if(s >= 0)
+    return ((size_t)s < group->table_size) ? group->socket_table[s] : NULL;
+
   for(i = 0; i < group->current_size && !ret; i++)
     if(SG_IS_ACTIVE(group, i) && SG_SOCKET(group, i) == s)
       ret = group->select_list[i];
@@ -58,6 +105,103 @@ static select_t *find_select_by_socket(select_group_t *group, int s)
   return ret;
 }
 
+static void free_select(select_t *select)
+{
+  if(select->buffer)
+  {
+    memset(select->buffer, 0, select->waiting_for);
+    safe_free(select->buffer);
+  }
+  if(select->out_buffer)
+  {
+    memset(select->out_buffer, 0, select->out_size);
+    safe_free(select->out_buffer);
+  }
+  if(select->recv_buffer)
+    safe_free(select->recv_buffer);
+#ifdef USE_URING
+  if(select->send_buffer)
+  {
+    memset(select->send_buffer, 0, select->send_size);
+    safe_free(select->send_buffer);
+  }
+#endif
+  memset(select, 0, sizeof(select_t));
+  safe_free(select);
+}
+
+/* Add a new select_t to the list and the socket table. */
+static void add_select(select_group_t *group, select_t *new_select)
+{
+  int s = new_select->s;
+
+  group->select_list[group->current_size] = new_select;
+  group->current_size++;
+  if(group->current_size >= group->maximum_size)
+  {
+    group->maximum_size = group->maximum_size * 2;
+    if(group->maximum_size > SOCKET_LIST_MAX_SOCKETS)
+    {
+      fprintf(stderr, "Too many sockets!\n");
+      exit(1);
+    }
+    group->select_list = safe_realloc(group->select_list, group->maximum_size * sizeof(select_t*));
+  }
+
+  if(s >= 0)
+  {
+    if((size_t)s >= group->table_size)
+    {
+      size_t old_size = group->table_size;
+
+      while((size_t)s >= group->table_size)
+        group->table_size = group->table_size * 2;
+
+      group->socket_table = safe_realloc(group->socket_table, group->table_size * sizeof(select_t*));
+      memset(group->socket_table + old_size, 0, (group->table_size - old_size) * sizeof(select_t*));
+    }
+    group->socket_table[s] = new_select;
+  }
+
+  group->active_count++;
+}
+
+/* Free the sockets that have been removed, and close up the gaps they left in the list. This is only done in between
+ * loops, since a callback can remove a socket that's still waiting to be handled, and only once at least half of the
+ * list is dead, so the cost works out to a constant per removal. */
+static void compact(select_group_t *group)
+{
+  size_t i;
+  size_t j = 0;
+  size_t still_dead = 0;
+
+  if(group->dead_count == 0 || group->dead_count < group->active_count)
+    return;
+
+  for(i = 0; i < group->current_size; i++)
+  {
+    if(SG_IS_ACTIVE(group, i))
+    {
+      group->select_list[j++] = group->select_list[i];
+    }
+#ifdef USE_URING
+    else if(group->select_list[i]->uring_ops > 0)
+    {
+      /* io_uring isn't done with it yet (its operations have been cancelled, but haven't finished). */
+      group->select_list[j++] = group->select_list[i];
+      still_dead++;
+    }
+#endif
+    else
+    {
+      free_select(group->select_list[i]);
+    }
+  }
+
+  group->current_size = j;
+  group->dead_count = still_dead;
+}
+
 select_group_t *select_group_create()
 {
   select_group_t *new_group = (select_group_t*) safe_malloc(sizeof(select_group_t));
@@ -66,30 +210,52 @@ select_group_t *select_group_create()
   new_group->select_list = safe_malloc(LIST_STARTING_SIZE * sizeof(select_t));
   new_group->current_size = 0;
   new_group->maximum_size = LIST_STARTING_SIZE;
+  new_group->socket_table = safe_malloc(LIST_STARTING_SIZE * sizeof(select_t*));
+  memset(new_group->socket_table, 0, LIST_STARTING_SIZE * sizeof(select_t*));
+  new_group->table_size = LIST_STARTING_SIZE;
   new_group->timeout_callback = NULL;
   new_group->timeout_param = NULL;
 
+#ifdef USE_EPOLL
+  /* If this fails (an old kernel, say), we just use select() instead. */
+  new_group->epoll_fd = epoll_create(LIST_STARTING_SIZE);
+  new_group->always_ready_count = 0;
+#endif
+
   return new_group;
 }
 
+#ifdef USE_URING
+static void uring_destroy(select_group_t *group);
+static NBBOOL uring_can_recv(select_t *select);
+static void uring_arm_read(select_group_t *group, select_t *select);
+static void uring_cancel(select_group_t *group, select_t *select);
+#endif
+
 void select_group_destroy(select_group_t *group)
 {
   size_t i;
 
+#ifdef USE_URING
+  /* Shut the ring down first, so nothing's still using the sockets' buffers when they're freed. */
+  if(group->uring)
+    uring_destroy(group);
+#endif
+
   for(i = 0; i < group->current_size; i++)
-  {
-    if(SG_BUFFER(group, i))
-    {
-      memset(SG_BUFFER(group, i), 0, SG_WAITING(group, i));
-      safe_free(SG_BUFFER(group, i));
-    }
-    memset(group->select_list[i], 0, sizeof(select_t));
-    safe_free(group->select_list[i]);
-  }
+    free_select(group->select_list[i]);
 
   memset(group->select_list, 0, group->maximum_size * sizeof(select_t*));
   safe_free(group->select_list);
 
+  memset(group->socket_table, 0, group->table_size * sizeof(select_t*));
+  safe_free(group->socket_table);
+
+#ifdef USE_EPOLL
+  if(group->epoll_fd >= 0)
+    close(group->epoll_fd);
+#endif
+
   memset(group, 0, sizeof(select_group_t));
   safe_free(group);
 }
@@ -108,21 +274,59 @@ void select_group_add_socket(select_group_t *group, int s, SOCKET_TYPE_t type, v
   new_select->active = TRUE;
   new_select->param = param;
 
-  group->select_list[group->current_size] = new_select;
-  group->current_size++;
-  if(group->current_size >= group->maximum_size)
+#ifndef WIN32
+  /* Sockets are ours, so make them non-blocking, which lets us drain them on each read. Anything else (stdin, say)
+   * is left as it is, since it might be shared with another process; it's only drained if it's already
+   * non-blocking. */
+  if(type != SOCKET_TYPE_LISTEN)
   {
-    group->maximum_size = group->maximum_size * 2;
-    if(group->maximum_size > SOCKET_LIST_MAX_SOCKETS)
+    struct stat st;
+
+    if(fstat(s, &st) == 0 && S_ISSOCK(st.st_mode))
     {
-      fprintf(stderr, "Too many sockets!\n");
-      exit(1);
+      tcp_set_nonblocking(s);
+      new_select->is_socket = TRUE;
     }
-    group->select_list = safe_realloc(group->select_list, group->maximum_size * sizeof(select_t*));
+
+    new_select->is_nonblocking = (fcntl(s, F_GETFL) & O_NONBLOCK) ? TRUE : FALSE;
   }
+#endif
+
+  add_select(group, new_select);
 
   if(s > group->biggest_socket)
     group->biggest_socket = s;
+
+#ifdef USE_URING
+  /* Sockets are read with io_uring receives; everything else is polled, and read the usual way. */
+  if(group->uring)
+  {
+    new_select->uring_recv = uring_can_recv(new_select);
+    uring_arm_read(group, new_select);
+  }
+#endif
+
+#ifdef USE_EPOLL
+  if(group->epoll_fd >= 0)
+  {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = new_select;
+
+    if(epoll_ctl(group->epoll_fd, EPOLL_CTL_ADD, s, &event) == -1)
+    {
+      /* epoll() won't take regular files (stdin redirected from a file, for example), but they're always
+       * readable anyways. */
+      if(errno != EPERM)
+        nbdie("select_group: couldn't add socket to epoll()");
+
+      new_select->always_ready = TRUE;
+      group->always_ready_count++;
+    }
+  }
+#endif
 }
 
 #ifdef WIN32
@@ -141,25 +345,14 @@ void select_group_add_pipe(select_group_t *group, int identifier, HANDLE pipe, v
   new_select->active = TRUE;
   new_select->param  = param;
 
-  group->select_list[group->current_size] = new_select;
-  group->current_size++;
-  if(group->current_size >= group->maximum_size)
-  {
-    group->maximum_size = group->maximum_size * 2;
-    if(group->maximum_size > SOCKET_LIST_MAX_SOCKETS)
-    {
-      fprintf(stderr, "Too many sockets!\n");
-      exit(1);
-    }
-    group->select_list = safe_realloc(group->select_list, group->maximum_size * sizeof(select_t*));
-  }
+  add_select(group, new_select);
 }
 #endif
 
 select_recv *select_set_recv(select_group_t *group, int s, select_recv *callback)
 {
   select_t *select = find_select_by_socket(group, s);
-  select_recv *old;
+  select_recv *old = NULL;
 
   if(select)
   {
@@ -172,7 +365,7 @@ select_recv *select_set_recv(select_group_t *group, int s, select_recv *callback
 select_listen *select_set_listen(select_group_t *group, int s, select_listen *callback)
 {
   select_t *select = find_select_by_socket(group, s);
-  select_listen *old;
+  select_listen *old = NULL;
 
   if(select)
   {
@@ -185,7 +378,7 @@ select_listen *select_set_listen(select_group_t *group, int s, select_listen *ca
 select_error *select_set_error(select_group_t *group, int s, select_error *callback)
 {
   select_t *select = find_select_by_socket(group, s);
-  select_error *old;
+  select_error *old = NULL;
 
   if(select)
   {
@@ -198,7 +391,7 @@ select_error *select_set_error(select_group_t *group, int s, select_error *callb
 select_closed *select_set_closed(select_group_t *group, int s, select_closed *callback)
 {
   select_t *select = find_select_by_socket(group, s);
-  select_closed *old;
+  select_closed *old = NULL;
 
   if(select)
   {
@@ -208,6 +401,19 @@ select_closed *select_set_closed(select_group_t *group, int s, select_closed *ca
   return old;
 }
 
+select_drained *select_set_drained(select_group_t *group, int s, select_drained *callback)
+{
+  select_t *select = find_select_by_socket(group, s);
+  select_drained *old = NULL;
+
+  if(select)
+  {
+    old = select->drained_callback;
+    select->drained_callback = callback;
+  }
+  return old;
+}
+
 select_timeout *select_set_timeout(select_group_t *group, select_timeout *callback, void *param)
 {
   select_timeout *old;
@@ -223,15 +429,41 @@ NBBOOL select_group_remove_socket(select_group_t *group, int s)
   select_t *socket = find_select_by_socket(group, s);
 
   if(socket)
+  {
     socket->active = FALSE;
+    group->active_count--;
+    group->dead_count++;
+
+    if(s >= 0)
+      group->socket_table[s] = NULL;
+
+#ifdef USE_URING
+    if(group->uring)
+      uring_cancel(group, socket);
+#endif
+
+#ifdef USE_EPOLL
+    if(group->epoll_fd >= 0)
+    {
+      if(socket->always_ready)
+        group->always_ready_count--;
+      else
+        epoll_ctl(group->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    }
+#endif
+  }
 
   return (socket ? TRUE : FALSE);
 }
 
 NBBOOL select_group_remove_and_close_socket(select_group_t *group, int s)
 {
+  /* Remove it before closing it -- if the handle was shared with a child process, closing our copy wouldn't take it
+   * out of epoll(). */
+  NBBOOL ret = select_group_remove_socket(group, s);
   tcp_close(s);
-  return select_group_remove_socket(group, s);
+
+  return ret;
 }
 
 static SELECT_RESPONSE_t select_handle_response(select_group_t *group, int s, SELECT_RESPONSE_t response)
@@ -256,198 +488,1073 @@ static SELECT_RESPONSE_t select_handle_response(select_group_t *group, int s, SE
   return response;
 }
 
-static void handle_incoming_data(select_group_t *group, size_t i)
+/* Start or stop watching for the socket to become writable (select() checks out_length every time instead). */
+static void set_write_interest(select_group_t *group, select_t *select, NBBOOL interested)
 {
-  int s = SG_SOCKET(group, i);
-  uint8_t buffer[MAX_RECV];
-
-  /* SG_WAITING is set when we're buffering data. Doesn't work with Windows pipes. */
-  if(SG_WAITING(group, i))
+#ifdef USE_EPOLL
+  if(group->epoll_fd >= 0 && !select->always_ready)
   {
-    /* Figure out how many bytes we're waiting on. */
-    size_t require = SG_WAITING(group, i) - SG_BUFFERED(group, i);
-    /* Read no more than what we need. */
-    int size = recv(s, buffer, require, 0);
+    struct epoll_event event;
 
-    if(SG_TYPE(group, i) == SOCKET_TYPE_DATAGRAM)
-      DIE("Tried to treat a DATAGRAM socket like a stream.");
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = interested ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.ptr = select;
 
-    /* Check for error */
-    if(size < 0)
-    {
-      if(SG_ERROR(group, i))
-        select_handle_response(group, s, SG_ERROR(group, i)(group, s, getlasterror(), SG_PARAM(group, i)));
-      else
-        select_group_remove_and_close_socket(group, s);
-    }
-    else if(size == 0)
-    {
-      if(SG_CLOSED(group, i))
-        select_handle_response(group, s, SG_CLOSED(group, i)(group, s, SG_PARAM(group, i)));
-      else
-        select_group_remove_and_close_socket(group, s);
-    }
-    else
-    {
-      /* Copy the bytes just read into the buffer */
-      memcpy(SG_BUFFER(group, i) + SG_BUFFERED(group, i), buffer, size);
+    if(epoll_ctl(group->epoll_fd, EPOLL_CTL_MOD, select->s, &event) == -1)
+      nbdie("select_group: couldn't update socket in epoll()");
+  }
+#endif
+}
 
-      /* Increment the counter. */
-      SG_BUFFERED(group, i) = SG_BUFFERED(group, i) + size;
+/* Send as much as the socket will take without blocking. Returns the number of bytes sent, or -1 on an error. */
+static ssize_t send_some(select_t *select, void *data, size_t length)
+{
+#ifdef WIN32
+  return send(select->s, data, length, 0);
+#else
+  ssize_t size = send(select->s, data, length, SEND_FLAGS);
 
-      /* If we're finished buffering data, call the callback function and clear the buffer. */
-      if(SG_BUFFERED(group, i) > SG_WAITING(group, i))
-        DIE("Something caused data corruption (overflow?)");
+  /* Not everything's a socket (pipes, stdin/stdout, etc). */
+  if(size == -1 && errno == ENOTSOCK)
+    size = write(select->s, data, length);
 
-      if(SG_BUFFERED(group, i) == SG_WAITING(group, i))
-      {
-        select_handle_response(group, s, SG_RECV(group, i)(group, s, SG_BUFFER(group, i), SG_BUFFERED(group, i), NULL, -1, SG_PARAM(group, i)));
-        memset(SG_BUFFER(group, i), 0, SG_BUFFERED(group, i));
-        SG_BUFFERED(group, i) = 0;
-      }
+  return size;
+#endif
+}
+
+/* Get the socket's receive buffer, making room for another read. The buffer starts at MAX_RECV bytes, doubles (up to
+ * MAX_RECV_BUFFER) each time a read fills it, and drops back to MAX_RECV once the socket has gone RECV_SHRINK_READS
+ * reads in a row without needing the space -- so busy sockets read more per call, and quiet ones don't hang onto
+ * memory. */
+static uint8_t *get_recv_buffer(select_t *select)
+{
+  if(!select->recv_buffer)
+  {
+    select->recv_size = MAX_RECV;
+    select->recv_buffer = safe_malloc(select->recv_size);
+  }
+  return select->recv_buffer;
+}
+
+static void size_recv_buffer(select_t *select, size_t last_read)
+{
+  if(last_read == select->recv_size && select->recv_size < MAX_RECV_BUFFER)
+  {
+    select->recv_size = select->recv_size * 2;
+    select->recv_buffer = safe_realloc(select->recv_buffer, select->recv_size);
+    select->small_reads = 0;
+  }
+  else if(select->recv_size > MAX_RECV && last_read < select->recv_size / 4)
+  {
+    select->small_reads++;
+    if(select->small_reads >= RECV_SHRINK_READS)
+    {
+      select->recv_size = MAX_RECV;
+      select->recv_buffer = safe_realloc(select->recv_buffer, select->recv_size);
+      select->small_reads = 0;
     }
   }
   else
   {
-#ifdef WIN32
-    if(SG_TYPE(group, i) == SOCKET_TYPE_STREAM || SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
-#else
-    if(SG_TYPE(group, i) == SOCKET_TYPE_STREAM)
-#endif
-    {
-      size_t size;
-      NBBOOL success = TRUE;
+    select->small_reads = 0;
+  }
+}
 
-#ifdef WIN32
-      /* If it's a stream, use tcp_recv; if it's a pipe, use ReadFile. */
-      if(SG_TYPE(group, i) == SOCKET_TYPE_STREAM)
-      {
-        size = tcp_recv(s, buffer, MAX_RECV);
-      }
-      else if(SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
-      {
-        success = ReadFile(SG_PIPE(group, i), buffer, MAX_RECV, &size, NULL);
-      }
-#else
-      size = read(s, buffer, MAX_RECV); /* read is better than recv, because it can handle stdin */
-#endif
+/* Add bytes to a socket that's waiting for a certain number of them, and call the callback once they're all there. */
+static void add_buffered_data(select_group_t *group, select_t *select, uint8_t *data, size_t size)
+{
+  int s = select->s;
 
-/*fprintf(stderr, "Read %d bytes from socket %d\n", size, s); */
+  /* Copy the bytes just read into the buffer */
+  memcpy(select->buffer + select->buffered, data, size);
 
-      /* Handle error conditions. */
-      if(size < 0 || !success)
-      {
-        if(SG_ERROR(group, i))
-          select_handle_response(group, s, SG_ERROR(group, i)(group, s, getlasterror(), SG_PARAM(group, i)));
-        else
-          select_group_remove_and_close_socket(group, s);
-      }
-      else if(size == 0)
-      {
-/* fprintf(stderr, "Closed!\n"); */
-        if(SG_CLOSED(group, i))
-          select_handle_response(group, s, SG_CLOSED(group, i)(group, s, SG_PARAM(group, i)));
-        else
-          select_group_remove_and_close_socket(group, s);
-      }
-      else
-      {
-        /* Send the recv()'d data to the callback, handling the response appropriately. */
-        if(SG_RECV(group, i))
-          select_handle_response(group, s, SG_RECV(group, i)(group, s, buffer, size, NULL, -1, SG_PARAM(group, i)));
-      }
-    }
-    else
-    {
-      /* It's a datagram socket, so use recvfrom. */
-      struct sockaddr_in addr;
-      socklen_t addr_size = sizeof(struct sockaddr_in);
-      size_t size;
+  /* Increment the counter. */
+  select->buffered = select->buffered + size;
 
-      memset(&addr, 0, sizeof(struct sockaddr_in));
-      size = recvfrom(s, buffer, MAX_RECV, 0, (struct sockaddr *)&addr, &addr_size);
+  /* If we're finished buffering data, call the callback function and clear the buffer. */
+  if(select->buffered > select->waiting_for)
+    DIE("Something caused data corruption (overflow?)");
 
-      /* Handle error conditions. */
-      if(size < 0 || size == (size_t)-1)
-      {
-        if(SG_ERROR(group, i))
-          select_handle_response(group, s, SG_ERROR(group, i)(group, s, getlasterror(), SG_PARAM(group, i)));
-        else
-          select_group_remove_and_close_socket(group, s);
-      }
-      else if(size == 0)
-      {
-        if(SG_CLOSED(group, i))
-          select_handle_response(group, s, SG_CLOSED(group, i)(group, s, SG_PARAM(group, i)));
-        else
-          select_group_remove_and_close_socket(group, s);
-      }
-      else
-      {
-        /* Send the recv()'d data to the callback, handling the response appropriately. */
-        if(SG_RECV(group, i))
-          select_handle_response(group, s, SG_RECV(group, i)(group, s, buffer, size, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), SG_PARAM(group, i)));
-      }
-    }
+  if(select->buffered == select->waiting_for)
+  {
+    select_handle_response(group, s, select->recv_callback(group, s, select->buffer, select->buffered, NULL, -1, select->param));
+    memset(select->buffer, 0, select->buffered);
+    select->buffered = 0;
   }
 }
 
-static void handle_incoming_connection(select_group_t *group, size_t i)
+/* Handle a socket that's waiting for a certain number of bytes (see select_group_wait_for_bytes()). */
+static void handle_buffered_data(select_group_t *group, select_t *select)
 {
-  int s = SG_SOCKET(group, i);
+  int s = select->s;
+  uint8_t buffer[MAX_RECV];
+
+  /* Figure out how many bytes we're waiting on. */
+  size_t require = select->waiting_for - select->buffered;
+  /* Read no more than what we need. */
+  int size = recv(s, buffer, require, 0);
 
-  if(SG_LISTEN(group, i))
-    select_handle_response(group, s, SG_LISTEN(group, i)(group, s, SG_PARAM(group, i)));
+  if(select->type == SOCKET_TYPE_DATAGRAM)
+    DIE("Tried to treat a DATAGRAM socket like a stream.");
+
+  /* Check for error */
+  if(size < 0)
+  {
+    if(WOULD_BLOCK(getlasterror()))
+      return;
+
+    if(select->error_callback)
+      select_handle_response(group, s, select->error_callback(group, s, getlasterror(), select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else if(size == 0)
+  {
+    if(select->closed_callback)
+      select_handle_response(group, s, select->closed_callback(group, s, select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else
+  {
+    add_buffered_data(group, select, buffer, size);
+  }
 }
 
-void select_group_do_select(select_group_t *group, int timeout_ms)
+/* Do a single read on the socket and pass it along to the callbacks. Returns the number of bytes read, or 0 if
+ * nothing was (the socket would have blocked, was closed, or had an error). */
+static size_t read_once(select_group_t *group, select_t *select)
 {
-  fd_set select_set;
-  int select_return;
-  size_t i;
-  struct timeval select_timeout;
+  int s = select->s;
+  uint8_t *buffer = get_recv_buffer(select);
+  ssize_t size;
 
-  /* Always time out after an interval (like Ncat does) -- this lets us poll for non-Internet sockets on Windows. */
 #ifdef WIN32
-  select_timeout.tv_sec = 0;
-  select_timeout.tv_usec = TIMEOUT_INTERVAL * 1000;
+  if(select->type == SOCKET_TYPE_STREAM || select->type == SOCKET_TYPE_PIPE)
 #else
-  select_timeout.tv_sec = timeout_ms / 1000;
-  select_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  if(select->type == SOCKET_TYPE_STREAM)
 #endif
-
-  /* Clear the current socket set */
-  FD_ZERO(&select_set);
-
-  /* Crawl over the list, adding the sockets. */
-  for(i = 0; i < group->current_size; i++)
   {
+    NBBOOL success = TRUE;
+
 #ifdef WIN32
-    /* On Windows, don't add pipes. */
-    if(SG_IS_ACTIVE(group, i) && SG_TYPE(group, i) != SOCKET_TYPE_PIPE)
+    /* If it's a stream, use tcp_recv; if it's a pipe, use ReadFile. */
+    if(select->type == SOCKET_TYPE_STREAM)
     {
-      FD_SET(SG_SOCKET(group, i), &select_set);
-      count++;
+      size = tcp_recv(s, buffer, select->recv_size);
+    }
+    else if(select->type == SOCKET_TYPE_PIPE)
+    {
+      DWORD pipe_size;
+      success = ReadFile(select->pipe, buffer, select->recv_size, &pipe_size, NULL);
+      size = pipe_size;
     }
 #else
-    if(SG_IS_ACTIVE(group, i))
-      FD_SET(SG_SOCKET(group, i), &select_set);
+    size = read(s, buffer, select->recv_size); /* read is better than recv, because it can handle stdin */
 #endif
-  }
 
-#ifdef WIN32
-  /* If no sockets are added, then use the Sleep() function here. */
-  if(count == 0)
+    /* Handle error conditions. */
+    if(size < 0 || !success)
+    {
+      if(WOULD_BLOCK(getlasterror()))
+        return 0;
+
+      if(select->error_callback)
+        select_handle_response(group, s, select->error_callback(group, s, getlasterror(), select->param));
+      else
+        select_group_remove_and_close_socket(group, s);
+      return 0;
+    }
+    else if(size == 0)
+    {
+      if(select->closed_callback)
+        select_handle_response(group, s, select->closed_callback(group, s, select->param));
+      else
+        select_group_remove_and_close_socket(group, s);
+      return 0;
+    }
+
+    /* Send the recv()'d data to the callback, handling the response appropriately. */
+    if(select->recv_callback)
+      select_handle_response(group, s, select->recv_callback(group, s, buffer, size, NULL, -1, select->param));
+  }
+  else
+  {
+    /* It's a datagram socket, so use recvfrom. */
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(struct sockaddr_in);
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    size = recvfrom(s, buffer, select->recv_size, 0, (struct sockaddr *)&addr, &addr_size);
+
+    /* Handle error conditions. */
+    if(size < 0)
+    {
+      if(WOULD_BLOCK(getlasterror()))
+        return 0;
+
+      if(select->error_callback)
+        select_handle_response(group, s, select->error_callback(group, s, getlasterror(), select->param));
+      else
+        select_group_remove_and_close_socket(group, s);
+      return 0;
+    }
+    else if(size == 0)
+    {
+      /* An empty datagram is just that; a datagram socket doesn't have an end to reach. */
+      return 0;
+    }
+
+    /* Send the recv()'d data to the callback, handling the response appropriately. */
+    if(select->recv_callback)
+      select_handle_response(group, s, select->recv_callback(group, s, buffer, size, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), select->param));
+  }
+
+  /* The callback might have removed the socket, in which case the buffer goes when it does. */
+  if(select->active)
+    size_recv_buffer(select, size);
+
+  return size;
+}
+
+static void handle_incoming_data(select_group_t *group, select_t *select)
+{
+  size_t total = 0;
+  size_t size;
+
+  /* waiting_for is set when we're buffering data. Doesn't work with Windows pipes. */
+  if(select->waiting_for)
+  {
+    handle_buffered_data(group, select);
+    return;
+  }
+
+  /* If the socket won't block, keep reading till it's empty (so we aren't back here on the next loop for every
+   * chunk), or till it's had its share of this loop (so one busy socket can't starve the rest). */
+  do
+  {
+    size = read_once(group, select);
+    total += size;
+  }
+  while(size > 0 && select->is_nonblocking && select->active && !select->waiting_for && total < READ_BUDGET);
+}
+
+static void handle_outgoing_data(select_group_t *group, select_t *select)
+{
+  int s = select->s;
+  ssize_t size = send_some(select, select->out_buffer, select->out_length);
+
+  if(size == -1)
+  {
+    if(WOULD_BLOCK(getlasterror()))
+      return;
+
+    if(select->error_callback)
+      select_handle_response(group, s, select->error_callback(group, s, getlasterror(), select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+    return;
+  }
+
+  /* Shift what's left to the front of the buffer. */
+  select->out_length -= size;
+  memmove(select->out_buffer, select->out_buffer + size, select->out_length);
+
+  if(select->out_length == 0)
+  {
+    set_write_interest(group, select, FALSE);
+
+    if(select->drained_callback)
+      select_handle_response(group, s, select->drained_callback(group, s, select->param));
+  }
+}
+
+static void handle_incoming_connection(select_group_t *group, select_t *select)
+{
+  int s = select->s;
+
+  if(select->listen_callback)
+    select_handle_response(group, s, select->listen_callback(group, s, select->param));
+}
+
+static void handle_ready(select_group_t *group, select_t *select)
+{
+  if(select->type == SOCKET_TYPE_LISTEN)
+    handle_incoming_connection(group, select);
+  else
+    handle_incoming_data(group, select);
+}
+
+#ifdef USE_URING
+/* The io_uring engine (see select_group_use_uring()). It talks to the kernel directly, rather than through liburing,
+ * since it only needs a handful of operations.
+ *
+ * Sockets are read with multishot receives into a ring of buffers that's shared with the kernel, so one receive
+ * keeps delivering data till the socket closes: recv() for stream sockets, and recvmsg() for datagram sockets, so
+ * each datagram arrives on its own, with its sender's address in front of it (see uring_handle_datagram()).
+ * Everything else (listeners, pipes, stdin) gets a one-shot poll, and is read the usual way once it's ready. Sends go out in the background from send_buffer;
+ * whatever's queued in the meantime collects in out_buffer, and goes as the next batch.
+ *
+ * Each operation's user_data is the select_t it's for, with the operation in the bottom bits (select_t is always
+ * aligned to at least 4 bytes). A select_t isn't freed till its operations are finished (see compact()). */
+#define URING_ENTRIES      256
+#define URING_BUFFERS      64 /* Has to be a power of two. */
+#define URING_BUFFER_SIZE  16384
+#define URING_BUFFER_GROUP 0
+
+#define URING_OP_RECV 1
+#define URING_OP_POLL 2
+#define URING_OP_SEND 3
+#define URING_OP_MASK 3
+#define URING_DATA(select, op) ((uint64_t)(uintptr_t)(select) | (op))
+
+#define URING_ACQUIRE(p)    __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+typedef struct
+{
+  int                      fd;
+
+  uint8_t                 *ring; /* The submission and completion rings, which share one mapping. */
+  size_t                   ring_size;
+  struct io_uring_sqe     *sqes;
+  size_t                   sqes_size;
+
+  unsigned                *sq_head;
+  unsigned                *sq_tail;
+  unsigned                 sq_mask;
+  unsigned                 sq_entries;
+  unsigned                 sq_local_tail; /* Entries past *sq_tail are being filled in, and haven't been pushed. */
+
+  unsigned                *cq_head;
+  unsigned                *cq_tail;
+  unsigned                 cq_mask;
+  struct io_uring_cqe     *cqes;
+
+  struct io_uring_buf_ring *buf_ring; /* The buffers that are free for the kernel to receive into. */
+  size_t                   buf_ring_size;
+  uint8_t                 *buffers;
+  unsigned short           buf_tail;
+
+  struct msghdr            datagram_msg; /* What datagram receives fill in: the address, and no control data. */
+} uring_t;
+
+static int uring_enter(uring_t *uring, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+  return syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+/* Unmap and close whatever's been set up. */
+static void uring_free(uring_t *uring)
+{
+  if(uring->buffers)
+    safe_free(uring->buffers);
+  if(uring->buf_ring)
+    munmap(uring->buf_ring, uring->buf_ring_size);
+  if(uring->sqes)
+    munmap(uring->sqes, uring->sqes_size);
+  if(uring->ring)
+    munmap(uring->ring, uring->ring_size);
+  close(uring->fd);
+
+  memset(uring, 0, sizeof(uring_t));
+  safe_free(uring);
+}
+
+/* Hand a buffer (back) to the kernel to receive into. */
+static void uring_recycle_buffer(uring_t *uring, unsigned short bid)
+{
+  struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUFFERS - 1)];
+
+  buf->addr = (uint64_t)(uintptr_t)(uring->buffers + (bid * URING_BUFFER_SIZE));
+  buf->len  = URING_BUFFER_SIZE;
+  buf->bid  = bid;
+
+  uring->buf_tail++;
+  URING_RELEASE(&uring->buf_ring->tail, uring->buf_tail);
+}
+
+/* Set up a ring, or return NULL if this kernel can't do everything we need. */
+static uring_t *uring_create()
+{
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  uring_t *uring;
+  unsigned *array;
+  void *mapping;
+  unsigned i;
+  int fd;
+
+  memset(&params, 0, sizeof(struct io_uring_params));
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+  fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if(fd < 0)
+    return NULL;
+
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  uring = (uring_t*) safe_malloc(sizeof(uring_t));
+  uring->fd = fd;
+
+  uring->ring_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  if(params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe)) > uring->ring_size)
+    uring->ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+
+  mapping = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if(mapping == MAP_FAILED)
+  {
+    uring_free(uring);
+    return NULL;
+  }
+  uring->ring = (uint8_t*) mapping;
+
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  mapping = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if(mapping == MAP_FAILED)
+  {
+    uring_free(uring);
+    return NULL;
+  }
+  uring->sqes = (struct io_uring_sqe*) mapping;
+
+  uring->sq_head       = (unsigned*) (uring->ring + params.sq_off.head);
+  uring->sq_tail       = (unsigned*) (uring->ring + params.sq_off.tail);
+  uring->sq_mask       = *(unsigned*) (uring->ring + params.sq_off.ring_mask);
+  uring->sq_entries    = params.sq_entries;
+  uring->sq_local_tail = *uring->sq_tail;
+  uring->cq_head       = (unsigned*) (uring->ring + params.cq_off.head);
+  uring->cq_tail       = (unsigned*) (uring->ring + params.cq_off.tail);
+  uring->cq_mask       = *(unsigned*) (uring->ring + params.cq_off.ring_mask);
+  uring->cqes          = (struct io_uring_cqe*) (uring->ring + params.cq_off.cqes);
+
+  /* Each slot in the submission ring always points at the entry with the same index. */
+  array = (unsigned*) (uring->ring + params.sq_off.array);
+  for(i = 0; i < params.sq_entries; i++)
+    array[i] = i;
+
+  /* The buffer ring has to be page-aligned, so it gets a mapping of its own. */
+  uring->buf_ring_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+  mapping = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mapping == MAP_FAILED)
+  {
+    uring_free(uring);
+    return NULL;
+  }
+  uring->buf_ring = (struct io_uring_buf_ring*) mapping;
+
+  memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+  reg.ring_addr    = (uint64_t)(uintptr_t)uring->buf_ring;
+  reg.ring_entries = URING_BUFFERS;
+  reg.bgid         = URING_BUFFER_GROUP;
+
+  /* This is the part that needs Linux 5.19. */
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    uring_free(uring);
+    return NULL;
+  }
+
+  uring->buffers = safe_malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+  for(i = 0; i < URING_BUFFERS; i++)
+    uring_recycle_buffer(uring, i);
+
+  memset(&uring->datagram_msg, 0, sizeof(struct msghdr));
+  uring->datagram_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+  return uring;
+}
+
+/* Submit everything that's been pushed (without waiting for anything to finish). */
+static void uring_submit(uring_t *uring)
+{
+  unsigned pending = *uring->sq_tail - URING_ACQUIRE(uring->sq_head);
+
+  if(pending > 0 && uring_enter(uring, pending, 0, 0, NULL, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    nbdie("select_group: couldn't io_uring_enter()");
+}
+
+/* Get a blank submission entry, making room for it if the ring's full. It isn't seen by the kernel till
+ * uring_push_sqe() is called. */
+static struct io_uring_sqe *uring_get_sqe(uring_t *uring)
+{
+  struct io_uring_sqe *sqe;
+
+  while(uring->sq_local_tail - URING_ACQUIRE(uring->sq_head) >= uring->sq_entries)
+    uring_submit(uring);
+
+  sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  return sqe;
+}
+
+static void uring_push_sqe(uring_t *uring)
+{
+  uring->sq_local_tail++;
+  URING_RELEASE(uring->sq_tail, uring->sq_local_tail);
+}
+
+/* Check whether the socket can be read with multishot receives (as opposed to being polled). */
+static NBBOOL uring_can_recv(select_t *select)
+{
+  return select->is_socket && (select->type == SOCKET_TYPE_STREAM || select->type == SOCKET_TYPE_DATAGRAM);
+}
+
+/* Start waiting for the socket to be readable: a multishot receive for sockets, and a poll for everything else. */
+static void uring_arm_read(select_group_t *group, select_t *select)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+  sqe->fd = select->s;
+  if(select->uring_recv)
+  {
+    if(select->type == SOCKET_TYPE_DATAGRAM)
+    {
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->addr   = (uint64_t)(uintptr_t)&uring->datagram_msg;
+      sqe->len    = 1;
+    }
+    else
+    {
+      sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_DATA(select, URING_OP_RECV);
+  }
+  else
+  {
+    sqe->opcode        = IORING_OP_POLL_ADD;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = (POLLIN << 16);
+#else
+    sqe->poll32_events = POLLIN;
+#endif
+    sqe->user_data     = URING_DATA(select, URING_OP_POLL);
+  }
+  uring_push_sqe(uring);
+
+  select->uring_ops++;
+  select->uring_reading = TRUE;
+}
+
+/* Send (whatever's left of) send_buffer. */
+static void uring_start_send(select_group_t *group, select_t *select)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+  sqe->fd   = select->s;
+  sqe->addr = (uint64_t)(uintptr_t)(select->send_buffer + select->send_offset);
+  sqe->len  = select->send_length - select->send_offset;
+  if(select->is_socket)
+  {
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->off    = (uint64_t) -1; /* (Pipes don't have a position.) */
+  }
+  sqe->user_data = URING_DATA(select, URING_OP_SEND);
+  uring_push_sqe(uring);
+
+  select->uring_ops++;
+}
+
+/* Wait for room to send; that's only needed when the kernel won't wait for us (a non-blocking pipe, for example). */
+static void uring_poll_writable(select_group_t *group, select_t *select)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = select->s;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  sqe->poll32_events = (POLLOUT << 16);
+#else
+  sqe->poll32_events = POLLOUT;
+#endif
+  sqe->user_data     = URING_DATA(select, URING_OP_SEND);
+  uring_push_sqe(uring);
+
+  select->uring_ops++;
+  select->send_polling = TRUE;
+}
+
+/* Start sending everything that's been queued up; new data is queued behind it in the meantime. */
+static void uring_next_send(select_group_t *group, select_t *select)
+{
+  uint8_t *buffer = select->send_buffer;
+  size_t   size   = select->send_size;
+
+  select->send_buffer = select->out_buffer;
+  select->send_size   = select->out_size;
+  select->send_length = select->out_length;
+  select->send_offset = 0;
+
+  select->out_buffer = buffer;
+  select->out_size   = size;
+  select->out_length = 0;
+
+  select->is_sending = TRUE;
+  uring_start_send(group, select);
+}
+
+/* Cancel whatever the socket has going on (the operations still finish, with -ECANCELED). */
+static void uring_cancel_op(uring_t *uring, uint64_t user_data)
+{
+  struct io_uring_sqe *sqe = uring_get_sqe(uring);
+
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->addr      = user_data;
+  sqe->user_data = 0;
+  uring_push_sqe(uring);
+}
+
+static void uring_cancel(select_group_t *group, select_t *select)
+{
+  uring_t *uring = (uring_t*) group->uring;
+
+  if(select->uring_reading)
+    uring_cancel_op(uring, URING_DATA(select, select->uring_recv ? URING_OP_RECV : URING_OP_POLL));
+  if(select->is_sending)
+    uring_cancel_op(uring, URING_DATA(select, URING_OP_SEND));
+}
+
+/* Pass received data along, honouring select_group_wait_for_bytes() (which can be called by the callbacks, partway
+ * through the data). */
+static void uring_deliver(select_group_t *group, select_t *select, uint8_t *data, size_t size)
+{
+  int s = select->s;
+
+  while(size > 0 && select->active)
+  {
+    if(select->waiting_for)
+    {
+      size_t chunk = select->waiting_for - select->buffered;
+
+      if(chunk > size)
+        chunk = size;
+
+      add_buffered_data(group, select, data, chunk);
+      data += chunk;
+      size -= chunk;
+    }
+    else
+    {
+      if(select->recv_callback)
+        select_handle_response(group, s, select->recv_callback(group, s, data, size, NULL, -1, select->param));
+      size = 0;
+    }
+  }
+}
+
+/* Pass a datagram along, with its sender's address. recvmsg() puts an io_uring_recvmsg_out in front of it, then
+ * the address (and any control data, but we don't ask for that). */
+static void uring_handle_datagram(select_group_t *group, select_t *select, uint8_t *data, size_t size)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) data;
+  size_t header_size = sizeof(struct io_uring_recvmsg_out) + uring->datagram_msg.msg_namelen + uring->datagram_msg.msg_controllen;
+  struct sockaddr_in addr;
+  int s = select->s;
+
+  /* As in read_once(), an empty datagram is just ignored. */
+  if(size <= header_size || !select->recv_callback)
+    return;
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  memcpy(&addr, data + sizeof(struct io_uring_recvmsg_out), MIN(out->namelen, sizeof(struct sockaddr_in)));
+
+  select_handle_response(group, s, select->recv_callback(group, s, data + header_size, size - header_size, inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), select->param));
+}
+
+static void uring_handle_recv(select_group_t *group, select_t *select, int res, unsigned flags)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  int s = select->s;
+
+  /* Without F_MORE, the receive is finished, and has to be started again. */
+  if(!(flags & IORING_CQE_F_MORE))
+  {
+    select->uring_ops--;
+    select->uring_reading = FALSE;
+  }
+
+  if(flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if(res > 0 && select->active)
+    {
+      if(select->type == SOCKET_TYPE_DATAGRAM)
+        uring_handle_datagram(group, select, uring->buffers + (bid * URING_BUFFER_SIZE), res);
+      else
+        uring_deliver(group, select, uring->buffers + (bid * URING_BUFFER_SIZE), res);
+    }
+    uring_recycle_buffer(uring, bid);
+  }
+
+  if(!select->active || res > 0 || res == -ECANCELED || res == -ENOBUFS || (res == 0 && select->type == SOCKET_TYPE_DATAGRAM))
+  {
+    /* Nothing to do (ENOBUFS means every buffer was in use; they've been recycled now, so it's started again). A
+     * datagram socket doesn't end, so an empty read from one isn't a close. */
+  }
+  else if(res == -EINVAL)
+  {
+    /* The kernel doesn't do multishot receives (it's older than 6.0), so poll it instead. */
+    select->uring_recv = FALSE;
+  }
+  else if(res == 0)
+  {
+    if(select->closed_callback)
+      select_handle_response(group, s, select->closed_callback(group, s, select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else
+  {
+    if(select->error_callback)
+      select_handle_response(group, s, select->error_callback(group, s, -res, select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+
+  if(select->active && !select->uring_reading)
+    uring_arm_read(group, select);
+}
+
+static void uring_handle_poll(select_group_t *group, select_t *select, int res)
+{
+  int s = select->s;
+
+  select->uring_ops--;
+  select->uring_reading = FALSE;
+
+  if(!select->active || res == -ECANCELED)
+    return;
+
+  if(res < 0)
+  {
+    if(select->error_callback)
+      select_handle_response(group, s, select->error_callback(group, s, -res, select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else
+  {
+    handle_ready(group, select);
+  }
+
+  /* Polls are one-shot, so that anything handle_ready() leaves behind is picked up next time. */
+  if(select->active && !select->uring_reading)
+    uring_arm_read(group, select);
+}
+
+static void uring_handle_send(select_group_t *group, select_t *select, int res)
+{
+  int s = select->s;
+
+  select->uring_ops--;
+
+  if(!select->active)
+  {
+    select->is_sending   = FALSE;
+    select->send_polling = FALSE;
+    return;
+  }
+
+  if(select->send_polling)
+  {
+    /* It's writable (or broken, in which case the send will say so). */
+    select->send_polling = FALSE;
+    uring_start_send(group, select);
+    return;
+  }
+
+  if(res == -EAGAIN || res == -EINTR)
+  {
+    uring_poll_writable(group, select);
+    return;
+  }
+
+  if(res < 0)
+  {
+    select->is_sending = FALSE;
+
+    if(select->error_callback)
+      select_handle_response(group, s, select->error_callback(group, s, -res, select->param));
+    else
+      select_group_remove_and_close_socket(group, s);
+    return;
+  }
+
+  select->send_offset += res;
+  if(select->send_offset < select->send_length)
+  {
+    uring_start_send(group, select);
+    return;
+  }
+
+  select->is_sending  = FALSE;
+  select->send_length = 0;
+  select->send_offset = 0;
+
+  if(select->out_length > 0)
+    uring_next_send(group, select);
+  else if(select->drained_callback)
+    select_handle_response(group, s, select->drained_callback(group, s, select->param));
+}
+
+static void do_uring(select_group_t *group, int timeout_ms)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned head;
+  unsigned tail;
+  size_t count = 0;
+
+  memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+  if(timeout_ms >= 0)
+  {
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    arg.ts     = (uint64_t)(uintptr_t)&ts;
+  }
+
+  /* Submit everything the last loop queued up, and wait for something to finish, all in one call. */
+  if(uring_enter(uring, *uring->sq_tail - URING_ACQUIRE(uring->sq_head), timeout_ms == 0 ? 0 : 1,
+        IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(struct io_uring_getevents_arg)) == -1)
+  {
+    /* A signal isn't a problem, we'll just go around again. */
+    if(errno == EINTR)
+      return;
+    if(errno != ETIME && errno != EBUSY && errno != EAGAIN)
+      nbdie("select_group: couldn't io_uring_enter()");
+  }
+
+  /* Handling a completion can queue up more submissions, but they aren't submitted till the next loop. */
+  head = *uring->cq_head;
+  tail = URING_ACQUIRE(uring->cq_tail);
+  for(; head != tail; head++)
+  {
+    struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+    uint64_t data = cqe->user_data;
+    select_t *select = (select_t*)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+
+    /* (Cancellations don't have a socket.) */
+    if(data == 0)
+      continue;
+    count++;
+
+    switch(data & URING_OP_MASK)
+    {
+      case URING_OP_RECV:
+        uring_handle_recv(group, select, cqe->res, cqe->flags);
+        break;
+      case URING_OP_POLL:
+        uring_handle_poll(group, select, cqe->res);
+        break;
+      case URING_OP_SEND:
+        uring_handle_send(group, select, cqe->res);
+        break;
+    }
+  }
+  URING_RELEASE(uring->cq_head, head);
+
+  if(count == 0 && timeout_ms >= 0)
+  {
+    /* Timeout elapsed with no events, inform the callbacks. */
+    if(group->timeout_callback)
+      group->timeout_callback(group, group->timeout_param);
+  }
+}
+
+/* Check whether any socket still has operations that haven't finished. */
+static NBBOOL uring_is_busy(select_group_t *group)
+{
+  size_t i;
+
+  for(i = 0; i < group->current_size; i++)
+    if(group->select_list[i]->uring_ops > 0)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Cancel everything and give it a moment to finish (without calling any callbacks), so the kernel's done with the
+ * sockets' buffers before they're freed. */
+static void uring_destroy(select_group_t *group)
+{
+  uring_t *uring = (uring_t*) group->uring;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe;
+  int tries;
+
+  sqe = uring_get_sqe(uring);
+  sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  uring_push_sqe(uring);
+
+  memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+  ts.tv_sec  = 0;
+  ts.tv_nsec = 100000000;
+  arg.ts     = (uint64_t)(uintptr_t)&ts;
+
+  for(tries = 0; tries < 10 && uring_is_busy(group); tries++)
+  {
+    unsigned head;
+    unsigned tail;
+
+    uring_enter(uring, *uring->sq_tail - URING_ACQUIRE(uring->sq_head), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(struct io_uring_getevents_arg));
+
+    head = *uring->cq_head;
+    tail = URING_ACQUIRE(uring->cq_tail);
+    for(; head != tail; head++)
+    {
+      struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+      select_t *select = (select_t*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+      if(select && !(cqe->flags & IORING_CQE_F_MORE))
+        select->uring_ops--;
+    }
+    URING_RELEASE(uring->cq_head, head);
+  }
+
+  uring_free(uring);
+  group->uring = NULL;
+}
+#endif
+
+#ifdef USE_EPOLL
+static void do_epoll(select_group_t *group, int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+  int i;
+  size_t j;
+
+  /* Don't block if there's a file we can always read from. */
+  if(group->always_ready_count > 0)
+    timeout_ms = 0;
+
+  count = epoll_wait(group->epoll_fd, events, MAX_EVENTS, timeout_ms);
+
+  if(count == -1)
+  {
+    /* A signal isn't a problem, we'll just go around again. */
+    if(errno == EINTR)
+      return;
+    nbdie("select_group: couldn't epoll_wait()");
+  }
+
+  /* Removed sockets aren't freed till the loop is over (see compact()), so a socket removed by an earlier callback
+   * is still safe to look at (it just isn't active anymore). */
+  for(i = 0; i < count; i++)
+  {
+    select_t *select = (select_t*) events[i].data.ptr;
+
+    /* Send first, so a callback that queues more data has room to. */
+    if(select->active && (events[i].events & EPOLLOUT))
+      handle_outgoing_data(group, select);
+
+    if(select->active && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      handle_ready(group, select);
+  }
+
+  if(group->always_ready_count > 0)
+  {
+    for(j = 0; j < group->current_size; j++)
+    {
+      select_t *select = group->select_list[j];
+
+      if(select->active && select->always_ready && select->out_length > 0)
+        handle_outgoing_data(group, select);
+      if(select->active && select->always_ready)
+        handle_ready(group, select);
+    }
+  }
+  else if(count == 0 && timeout_ms >= 0)
+  {
+    /* Timeout elapsed with no events, inform the callbacks. */
+    if(group->timeout_callback)
+      group->timeout_callback(group, group->timeout_param);
+  }
+}
+#endif
+
+static void do_select(select_group_t *group, int timeout_ms)
+{
+  fd_set select_set;
+  fd_set write_set;
+  int select_return;
+  size_t i;
+  struct timeval select_timeout;
+
+  /* Always time out after an interval (like Ncat does) -- this lets us poll for non-Internet sockets on Windows. */
+#ifdef WIN32
+  select_timeout.tv_sec = 0;
+  select_timeout.tv_usec = TIMEOUT_INTERVAL * 1000;
+#else
+  select_timeout.tv_sec = timeout_ms / 1000;
+  select_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+#endif
+
+  /* Clear the current socket set */
+  FD_ZERO(&select_set);
+  FD_ZERO(&write_set);
+
+  /* Crawl over the list, adding the sockets. */
+  for(i = 0; i < group->current_size; i++)
+  {
+#ifdef WIN32
+    /* On Windows, don't add pipes. */
+    if(SG_IS_ACTIVE(group, i) && SG_TYPE(group, i) != SOCKET_TYPE_PIPE)
+    {
+      FD_SET(SG_SOCKET(group, i), &select_set);
+      count++;
+    }
+#else
+    if(SG_IS_ACTIVE(group, i))
+      FD_SET(SG_SOCKET(group, i), &select_set);
+#endif
+
+    /* Watch for room to send, if there's anything waiting to go out. */
+    if(SG_IS_ACTIVE(group, i) && group->select_list[i]->out_length > 0)
+      FD_SET(SG_SOCKET(group, i), &write_set);
+  }
+
+#ifdef WIN32
+  /* If no sockets are added, then use the Sleep() function here. */
+  if(count == 0)
     Sleep(TIMEOUT_INTERVAL);
   else
-    select_return = select(group->biggest_socket + 1, &select_set, NULL, NULL, &select_timeout);
+    select_return = select(group->biggest_socket + 1, &select_set, &write_set, NULL, &select_timeout);
 #else
-  select_return = select(group->biggest_socket + 1, &select_set, NULL, NULL, timeout_ms < 0 ? NULL : &select_timeout);
+  select_return = select(group->biggest_socket + 1, &select_set, &write_set, NULL, timeout_ms < 0 ? NULL : &select_timeout);
 #endif
 /*  fprintf(stderr, "Select returned %d\n", select_return); */
 
   if(select_return == -1)
+  {
+#ifndef WIN32
+    /* A signal isn't a problem, we'll just go around again. */
+    if(errno == EINTR)
+      return;
+#endif
     nbdie("select_group: couldn't select()");
+  }
 
 #ifdef WIN32
   /* Handle pipes on every run, whether it's a timeout or data arrived. */
@@ -465,7 +1572,7 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
       if(result)
       {
         if(n > 0)
-          handle_incoming_data(group, i);
+          handle_incoming_data(group, group->select_list[i]);
       }
       else
       {
@@ -522,25 +1629,34 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
     /* Loop through the sockets to find the one that had activity. */
     for(i = 0; i < group->current_size; i++)
     {
+      /* If the socket is writable and has data queued up, send it. */
+      if(SG_IS_ACTIVE(group, i) && FD_ISSET(SG_SOCKET(group, i), &write_set))
+        handle_outgoing_data(group, group->select_list[i]);
+
       /* If the socket is active and it has data waiting, process it. */
       if(SG_IS_ACTIVE(group, i) && FD_ISSET(SG_SOCKET(group, i), &select_set))
-      {
-        if(SG_TYPE(group, i) == SOCKET_TYPE_LISTEN)
-        {
-          handle_incoming_connection(group, i);
-        }
-        else
-        {
-          handle_incoming_data(group, i);
-        }
-      }
-      else
-      {
-      }
+        handle_ready(group, group->select_list[i]);
     }
   }
 }
 
+void select_group_do_select(select_group_t *group, int timeout_ms)
+{
+#ifdef USE_URING
+  if(group->uring)
+    do_uring(group, timeout_ms);
+  else
+#endif
+#ifdef USE_EPOLL
+  if(group->epoll_fd >= 0)
+    do_epoll(group, timeout_ms);
+  else
+#endif
+    do_select(group, timeout_ms);
+
+  compact(group);
+}
+
 
 NBBOOL select_group_wait_for_bytes(select_group_t *group, int s, size_t bytes)
 {
@@ -567,18 +1683,133 @@ NBBOOL select_group_wait_for_bytes(select_group_t *group, int s, size_t bytes)
 }
 
 
+/* Add data to the socket's out_buffer, growing it if it has to. */
+static void queue_data(select_t *select, uint8_t *data, size_t length)
+{
+  if(select->out_length + length > select->out_size)
+  {
+    if(select->out_size == 0)
+      select->out_size = MAX_RECV;
+    while(select->out_length + length > select->out_size)
+      select->out_size = select->out_size * 2;
+
+    if(select->out_buffer)
+      select->out_buffer = safe_realloc(select->out_buffer, select->out_size);
+    else
+      select->out_buffer = safe_malloc(select->out_size);
+  }
+
+  memcpy(select->out_buffer + select->out_length, data, length);
+  select->out_length += length;
+}
+
+NBBOOL select_group_send(select_group_t *group, int s, void *data, size_t length)
+{
+  select_t *select = find_select_by_socket(group, s);
+  ssize_t   size = 0;
+
+  if(!select)
+    return FALSE;
+
+#ifdef USE_URING
+  /* With io_uring, everything goes out in the background (see uring_next_send()). */
+  if(group->uring)
+  {
+    queue_data(select, data, length);
+    if(!select->is_sending)
+      uring_next_send(group, select);
+    return TRUE;
+  }
+#endif
+
+  /* If nothing else is waiting to go, try sending it right away. */
+  if(select->out_length == 0)
+  {
+    size = send_some(select, data, length);
+
+    if(size == -1)
+    {
+      if(!WOULD_BLOCK(getlasterror()))
+      {
+        if(select->error_callback)
+          select_handle_response(group, s, select->error_callback(group, s, getlasterror(), select->param));
+        else
+          select_group_remove_and_close_socket(group, s);
+        return FALSE;
+      }
+      size = 0;
+    }
+
+    if((size_t)size == length)
+      return TRUE;
+  }
+
+  /* Queue up the rest till the socket can take it. */
+  if(select->out_length == 0)
+    set_write_interest(group, select, TRUE);
+
+  queue_data(select, (uint8_t*)data + size, length - size);
+
+  return TRUE;
+}
+
+size_t select_group_get_queued(select_group_t *group, int s)
+{
+  select_t *select = find_select_by_socket(group, s);
+
+  if(!select)
+    return 0;
+
+#ifdef USE_URING
+  if(select->is_sending)
+    return select->out_length + (select->send_length - select->send_offset);
+#endif
+
+  return select->out_length;
+}
+
 size_t select_group_get_active_count(select_group_t *group)
 {
+  return group->active_count;
+}
+
+NBBOOL select_group_use_uring(select_group_t *group)
+{
+#ifdef USE_URING
   size_t i;
-  size_t count = 0;
+
+  if(group->uring)
+    return TRUE;
+
+  group->uring = uring_create();
+  if(!group->uring)
+    return FALSE;
+
+  /* io_uring takes over from epoll() (and can handle the files that epoll() won't). */
+  if(group->epoll_fd >= 0)
+    close(group->epoll_fd);
+  group->epoll_fd = -1;
+  group->always_ready_count = 0;
 
   for(i = 0; i < group->current_size; i++)
   {
-    if(SG_IS_ACTIVE(group, i))
-      count++;
+    select_t *select = group->select_list[i];
+
+    select->always_ready = FALSE;
+    if(!select->active)
+      continue;
+
+    select->uring_recv = uring_can_recv(select);
+    uring_arm_read(group, select);
+
+    if(select->out_length > 0)
+      uring_next_send(group, select);
   }
 
-  return count;
+  return TRUE;
+#else
+  return FALSE;
+#endif
 }
 
 #ifdef WIN32
@@ -32,6 +32,19 @@
  * It's an ugly hack, I know, but when writing Ncat (http://nmap.org/ncat)
  * David Fifield came up with the same solution. Apparently, it's the best
  * we've got.
+ *
+ * On Linux, epoll() is used instead of select(). Sockets are registered once,
+ * when they're added, and each loop only touches the ones that are ready, so
+ * it doesn't slow down as the number of sockets grows (and isn't limited to
+ * FD_SETSIZE). select() is still used everywhere else, if epoll() can't be
+ * set up, or if NO_EPOLL is defined.
+ *
+ * A group can also be switched over to io_uring on Linux, if the kernel's new
+ * enough (see select_group_use_uring()). Then sockets are read with multishot
+ * receives (recvmsg() for datagram sockets, so each one still comes with its
+ * sender's address), sends happen in the background, and each loop is a single
+ * system call no matter how much is going on. Building against kernel headers older
+ * than Linux 6.0 needs NO_URING.
  */
 
 
@@ -50,6 +63,13 @@
 
 #include "types.h"
 
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#ifndef NO_URING
+#define USE_URING
+#endif
+#endif
+
 /* The maximum number of possible sockets (huge number, but I want to prevent overflows). Note that this is
  * sort of a range, because the number of sockets are doubled each time. So it's between 32768 and 65536. */
 #define SOCKET_LIST_MAX_SOCKETS (65536/2)
@@ -86,6 +106,7 @@ typedef SELECT_RESPONSE_t(select_listen)(void *group, int s, void *param);
 typedef SELECT_RESPONSE_t(select_error)(void *group, int s, int err, void *param);
 typedef SELECT_RESPONSE_t(select_closed)(void *group, int s, void *param);
 typedef SELECT_RESPONSE_t(select_timeout)(void *group, void *param);
+typedef SELECT_RESPONSE_t(select_drained)(void *group, int s, void *param);
 
 /* This struct is for internal use. */
 typedef struct
@@ -99,13 +120,39 @@ typedef struct
   select_listen  *listen_callback;  /* The function to call when a connection arrives. */
   select_error   *error_callback;   /* The function to call when there's an error. */
   select_closed  *closed_callback;  /* The function to call when the connection is closed. */
+  select_drained *drained_callback; /* The function to call when everything queued to be sent has gone out. */
 
   size_t          waiting_for; /* The number of bytes being waited on. If set to 0, will trigger on all incoming data. */
   uint8_t        *buffer; /* The buffer that holds the current bytes. */
   size_t          buffered; /* The number of bytes currently stored in the buffer. */
 
-  NBBOOL         active; /* Set to 'false' when the socket is 'deleted'. It's easier than physically removing it from
-                           * the list, so until I implement something heavy weight this will work. */
+  uint8_t        *recv_buffer; /* The buffer reads go into, which is sized to how busy the socket is. */
+  size_t          recv_size; /* The size of recv_buffer. */
+  size_t          small_reads; /* The number of reads in a row that have used under a quarter of recv_buffer. */
+  NBBOOL          is_nonblocking; /* Set if reads won't block, so the socket can be read till it's empty. */
+  NBBOOL          is_socket; /* Set if it's actually a socket (and not stdin, a pipe, etc). */
+
+  uint8_t        *out_buffer; /* Data that's waiting for the socket to be writable (see select_group_send()). */
+  size_t          out_length; /* The number of bytes waiting in out_buffer. */
+  size_t          out_size; /* The allocated size of out_buffer. */
+
+  NBBOOL         active; /* Set to 'false' when the socket is 'deleted'. It's freed and taken out of the list later,
+                           * once the callbacks are done with it. */
+#ifdef USE_EPOLL
+  NBBOOL         always_ready; /* Set if epoll() won't take it (a regular file, say); it's treated as always
+                                 * readable, which is what select() would say. */
+#endif
+#ifdef USE_URING
+  int            uring_ops; /* The number of io_uring operations in flight for it; it isn't freed till they're done. */
+  NBBOOL         uring_reading; /* Set while a receive (or a poll) is waiting on it. */
+  NBBOOL         uring_recv; /* Set if it's read with io_uring receives; otherwise it's polled, and read as usual. */
+  NBBOOL         is_sending; /* Set while io_uring is sending from send_buffer. */
+  NBBOOL         send_polling; /* Set while it's waiting for room to send (see uring_poll_writable()). */
+  uint8_t       *send_buffer; /* The data being sent (out_buffer collects whatever's queued in the meantime). */
+  size_t         send_length; /* The number of bytes in send_buffer. */
+  size_t         send_offset; /* The number of those that have been sent. */
+  size_t         send_size; /* The allocated size of send_buffer. */
+#endif
 
   void           *param; /* Used to store a piece of arbitrary data that's sent to the callbacks. */
 } select_t;
@@ -116,10 +163,21 @@ typedef struct
   select_t **select_list; /* A list of the select_t objects. */
   size_t current_size; /* The current number of "select_t"s in the list. */
   size_t maximum_size; /* The maximum number of "select_t"s in the list before realloc() has to expand it. */
+  size_t active_count; /* The number of "select_t"s in the list that are still active. */
+  size_t dead_count; /* The number that have been removed, but not yet freed (see compact()). */
+  select_t **socket_table; /* The active "select_t"s, indexed by socket, so they can be found without a search. */
+  size_t table_size; /* The number of entries in socket_table (grown as bigger sockets are added). */
 #ifdef WIN32
   uint32_t elapsed_time; /* The number of milliseconds that have elapsed; used for timeouts. */
 #endif
   int biggest_socket; /* The handle to the highest-numbered socket in the list (required for select() call). */
+#ifdef USE_EPOLL
+  int epoll_fd; /* The epoll() handle, or -1 to fall back to select(). */
+  size_t always_ready_count; /* The number of active sockets that epoll() won't watch. */
+#endif
+#ifdef USE_URING
+  void *uring; /* The io_uring, if the group's been switched over to it (see select_group_use_uring()). */
+#endif
 
   select_timeout *timeout_callback; /* The function to call when the timeout time expires. */
   void *timeout_param; /* A parameter that is passed to the callback function. */
@@ -158,6 +216,10 @@ select_error   *select_set_error(select_group_t *group, int s, select_error *cal
  * the list. */
 select_closed  *select_set_closed(select_group_t *group, int s, select_closed *callback);
 
+/* Set the drained callback. This is called when the last of the data queued by select_group_send() has been
+ * sent. */
+select_drained *select_set_drained(select_group_t *group, int s, select_drained *callback);
+
 /* Set the timeout callback, for when the time specified in select_group_do_select() elapses. */
 select_timeout *select_set_timeout(select_group_t *group, select_timeout *callback, void *param);
 
@@ -178,9 +240,23 @@ void select_group_do_select(select_group_t *group, int timeout_ms);
  * Note: any data already queued up will be whacked. */
 NBBOOL select_group_wait_for_bytes(select_group_t *group, int s, size_t bytes);
 
+/* Send data on a socket without blocking. Whatever can't be sent right away is queued and sent when the socket is
+ * writable, so a slow reader on one socket doesn't hold up the rest. Returns FALSE if the socket isn't in the group,
+ * or if sending failed (in which case the error callback is handled just like it is for a failed read). Pipes are
+ * sent to with write(), which will block if the pipe does. */
+NBBOOL select_group_send(select_group_t *group, int s, void *data, size_t length);
+
+/* Get the number of bytes queued by select_group_send() that haven't been sent yet. */
+size_t select_group_get_queued(select_group_t *group, int s);
+
 /* Check how many active sockets are left. */
 size_t select_group_get_active_count(select_group_t *group);
 
+/* Switch the group over to io_uring. Returns FALSE (and leaves the group as it was) if io_uring isn't supported
+ * here -- it needs Linux 5.19 (and 6.0 for multishot receives; sockets are polled instead on 5.19). It's fine to call
+ * this after sockets have been added, but it has to be called from outside select_group_do_select(). */
+NBBOOL select_group_use_uring(select_group_t *group);
+
 #ifdef WIN32
 /* Get a handle to stdin. This handle can be added to a select_group as a pipe. Behind the scenes,
  * it uses a thread. Don't ask. */
@@ -1,3 +1,5 @@
+#define LOG_MODULE LOG_MODULE_SESSION
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,11 +13,46 @@
 #include "packet.h"
 #include "session.h"
 
+/* Everything in here is only ever touched through the message bus, so it
+ * belongs to the main thread, same as the bus (see message.h). */
+
 /* Set to TRUE after getting the 'shutdown' message. */
-NBBOOL is_shutdown = FALSE;
+static NBBOOL is_shutdown = FALSE;
+
+/* The maximum length of packets we send. This stays at 0 until the output
+ * driver has worked out what the path can carry, and nothing goes out till
+ * then. */
+static size_t max_packet_length = 0;
+
+/* The maximum length of packets the server should send us, passed along in
+ * each SYN (0 means we don't know, and the server uses its own limit). */
+static size_t max_downstream_length = 0;
+
+/* Set to TRUE to have idle polls held by the server until it has data for us
+ * (only if the server agrees to MSG flags). */
+static NBBOOL longpoll = FALSE;
+
+/* Forward error correction: the number of redundant copies of each MSG to
+ * send, so a dropped query or response doesn't cost a whole retransmit delay.
+ * With 'fec_auto' set, each session picks its own count from the loss rate
+ * it sees instead. */
+static int    fec_copies = 0;
+static NBBOOL fec_auto   = FALSE;
+
+#define FEC_MAX_COPIES 3
+#define FEC_WINDOW      64   /* Packets per loss-rate sample, in auto mode */
+#define FEC_TARGET_LOSS 0.02 /* The fraction of packets we can live with losing */
 
-/* The maximum length of packets. */
-size_t max_packet_length = 10000;
+/* The SYN options we ask the server for; the ones it agrees to (by echoing
+ * them back) decide which optional fields the session's MSGs carry. */
+#define SESSION_OPTIONS (OPT_MSG_FLAGS | OPT_SACK)
+
+/* With OPT_SACK, the most MSGs carrying data we'll have in flight at once. */
+#define SEND_WINDOW 8
+
+/* How many later segments have to be SACKed before we decide one that was
+ * skipped over is lost (rather than just reordered), and resend it. */
+#define SACK_REORDER 2
 
 typedef enum
 {
@@ -23,6 +60,18 @@ typedef enum
   SESSION_STATE_ESTABLISHED
 } session_state_t;
 
+/* A data MSG in flight, as tracked on the scoreboard. */
+typedef struct
+{
+  uint16_t seq;
+  size_t   length;
+  time_t   last_sent;
+  uint32_t sent_order;    /* When it was last sent, relative to the others. */
+  size_t   transmissions;
+  NBBOOL   is_sacked;
+  NBBOOL   is_lost;
+} segment_t;
+
 typedef struct
 {
   /* Session information */
@@ -32,6 +81,7 @@ typedef struct
   uint16_t        my_seq;
   NBBOOL          is_closed;
   char           *name;
+  uint16_t        options;
 
   char           *tunnel_host;
   uint16_t        tunnel_port;
@@ -39,6 +89,31 @@ typedef struct
   buffer_t       *outgoing_data;
 
   time_t          last_transmit;
+
+  /* The packet_ids of the MSG we're waiting on (the original plus any FEC
+   * copies). Only answers to those are any use; anything else is an answer
+   * to a question we've stopped asking. */
+  uint16_t        packet_ids[FEC_MAX_COPIES + 1];
+  size_t          packet_id_count;
+  NBBOOL          is_answered;
+
+  NBBOOL          is_longpolling;
+  NBBOOL          is_receiving;
+
+  /* Set while the input driver is backed up; the server keeps whatever it
+   * has for us (we don't ACK it) till we're resumed. */
+  NBBOOL          is_paused;
+
+  /* The scoreboard (with OPT_SACK): the data MSGs in flight, oldest first,
+   * covering the outgoing buffer from my_seq on. */
+  segment_t       segments[SEND_WINDOW];
+  size_t          segment_count;
+  uint32_t        send_count;
+
+  /* Loss-rate sampling, for picking the FEC copy count in auto mode */
+  size_t          fec_copies;
+  size_t          fec_sent;
+  size_t          fec_answered;
 } session_t;
 typedef struct _session_entry_t
 {
@@ -50,6 +125,10 @@ static session_entry_t *first_session;
 
 #define RETRANSMIT_DELAY 1 /* Seconds */
 
+/* How long a long-poll can sit at the server before we decide it's lost. This
+ * has to be longer than the server holds them. */
+#define LONGPOLL_DELAY   6 /* Seconds */
+
 /* Allow anything to go out. Call this at the start or after receiving legit data. */
 static void reset_counter(session_t *session)
 {
@@ -62,14 +141,293 @@ static void update_counter(session_t *session)
   session->last_transmit = time(NULL);
 }
 
+/* Get the number of bytes on the scoreboard (always 0 without OPT_SACK). */
+static size_t scoreboard_bytes(session_t *session)
+{
+  size_t bytes = 0;
+  size_t i;
+
+  for(i = 0; i < session->segment_count; i++)
+    bytes += session->segments[i].length;
+  return bytes;
+}
+
+/* Get the number of bytes that haven't been sent at all yet. */
+static size_t unsent_bytes(session_t *session)
+{
+  return buffer_get_remaining_bytes(session->outgoing_data) - scoreboard_bytes(session);
+}
+
 /* Decide whether or not we should transmit data yet. */
 static NBBOOL can_i_transmit_yet(session_t *session)
 {
+  /* A long-poll is supposed to sit at the server; leave it be unless we have
+   * something new to say. */
+  if(session->is_longpolling)
+  {
+    if(unsent_bytes(session) > 0)
+      return TRUE;
+    return time(NULL) - session->last_transmit > LONGPOLL_DELAY;
+  }
+
   if(time(NULL) - session->last_transmit > RETRANSMIT_DELAY)
     return TRUE;
   return FALSE;
 }
 
+/* Add a packet's fate to the loss-rate sample, and pick a new FEC copy count
+ * once there's enough to go on. */
+static void fec_sample(session_t *session, NBBOOL is_answered)
+{
+  double lost;
+  double loss;
+  double low;
+  double high;
+  double n;
+  size_t copies;
+  size_t sent_copies;
+  size_t i;
+
+  session->fec_sent++;
+  if(is_answered)
+    session->fec_answered++;
+  else
+    LOG_INFO("Session %d: packet went unanswered", session->id);
+
+  if(!fec_auto || session->fec_sent < FEC_WINDOW)
+    return;
+
+  /* A packet is only lost if every copy of it is, so the loss rate we see
+   * is the real one raised to the power of (copies + 1); work backwards
+   * from that (a quick bisection, to stay out of libm). With SACK, the
+   * samples are window segments, which never have copies. */
+  sent_copies = (session->options & OPT_SACK) ? 0 : session->fec_copies;
+  lost = (double)(session->fec_sent - session->fec_answered) / session->fec_sent;
+  low  = 0.0;
+  high = 1.0;
+  for(i = 0; i < 20; i++)
+  {
+    loss = (low + high) / 2;
+    for(n = 1.0, copies = 0; copies <= sent_copies; copies++)
+      n *= loss;
+
+    if(n < lost)
+      low = loss;
+    else
+      high = loss;
+  }
+
+  /* Then send enough copies that losing all of them is rare. */
+  for(copies = 0; copies < FEC_MAX_COPIES; copies++)
+  {
+    for(n = 1.0, i = 0; i <= copies; i++)
+      n *= loss;
+    if(n < FEC_TARGET_LOSS)
+      break;
+  }
+
+  if(copies != session->fec_copies)
+    LOG_WARNING("Session %d is seeing about %d%% packet loss; sending %zd redundant copies of each packet", session->id, (int)(loss * 100), copies);
+
+  session->fec_copies   = copies;
+  session->fec_sent     = 0;
+  session->fec_answered = 0;
+}
+
+/* Start waiting on a new packet, folding the last one's fate into the
+ * loss-rate sample. */
+static void fec_new_round(session_t *session)
+{
+  /* Long-polls are supposed to go unanswered for a while, so they'd skew
+   * the sample. With SACK, the sample comes from the scoreboard instead
+   * (see scoreboard_ack()). */
+  if(session->packet_id_count > 0 && !session->is_longpolling && !(session->options & OPT_SACK))
+    fec_sample(session, session->is_answered);
+
+  session->packet_id_count = 0;
+  session->is_answered     = FALSE;
+}
+
+static void fec_add_packet(session_t *session, uint16_t packet_id)
+{
+  if(session->packet_id_count < FEC_MAX_COPIES + 1)
+    session->packet_ids[session->packet_id_count++] = packet_id;
+}
+
+static size_t fec_get_copies(session_t *session)
+{
+  if(fec_auto)
+    return session->fec_copies;
+  return MIN(fec_copies, FEC_MAX_COPIES);
+}
+
+static NBBOOL is_current_packet(session_t *session, uint16_t packet_id)
+{
+  size_t i;
+
+  for(i = 0; i < session->packet_id_count; i++)
+    if(session->packet_ids[i] == packet_id)
+      return TRUE;
+  return FALSE;
+}
+
+/* Send a single MSG, and return its packet_id. */
+static uint16_t post_msg(session_t *session, uint16_t seq, uint8_t *data, size_t length, uint8_t flags)
+{
+  packet_t *packet = packet_create_msg(session->id, seq, session->their_seq, data, length);
+  uint16_t  packet_id = packet->packet_id;
+
+  if(session->options & OPT_MSG_FLAGS)
+    packet_msg_set_flags(packet, flags);
+  if(session->options & OPT_SACK)
+    packet_msg_set_sack(packet, NULL, 0);
+
+  message_post_packet_out(packet);
+  packet_destroy(packet);
+
+  return packet_id;
+}
+
+/* Send a MSG, plus however many FEC copies are called for, and wait on its
+ * answer. Each copy gets its own packet_id so resolvers treat it as a
+ * separate question; the server sees the extras as retransmissions. */
+static void send_msg(session_t *session, uint16_t seq, uint8_t *data, size_t length, uint8_t flags, size_t copies)
+{
+  size_t i;
+
+  for(i = 0; i <= copies; i++)
+    fec_add_packet(session, post_msg(session, seq, data, length, flags));
+}
+
+/* (Re-)send a segment off the scoreboard. Segments don't get FEC copies (a
+ * window of them would multiply the queries just when loss is high), and
+ * aren't waited on like a lone MSG; the SACKs tell us what needs resending. */
+static void send_segment(session_t *session, segment_t *segment)
+{
+  uint8_t *data = safe_malloc(segment->length);
+  size_t   offset = (segment->seq - session->my_seq) & 0xFFFF;
+
+  buffer_read_bytes_at(session->outgoing_data, buffer_get_current_offset(session->outgoing_data) + offset, data, segment->length);
+  LOG_INFO("Sending a segment (SEQ = 0x%04x, %zd bytes, transmission %zd)", segment->seq, segment->length, segment->transmissions + 1);
+
+  post_msg(session, segment->seq, data, segment->length, 0);
+
+  segment->last_sent  = time(NULL);
+  segment->sent_order = ++session->send_count;
+  segment->transmissions++;
+  segment->is_lost    = FALSE;
+
+  safe_free(data);
+}
+
+/* With OPT_SACK, data goes out through the window instead of one MSG at a
+ * time: resend the holes, then fill the window with new segments. Returns
+ * TRUE if anything was sent. */
+static NBBOOL do_send_window(session_t *session)
+{
+  segment_t *segment;
+  NBBOOL     sent = FALSE;
+  size_t     in_flight;
+  size_t     max_length = max_packet_length - PACKET_MSG_SIZE - packet_get_msg_options_size(session->options);
+  size_t     i;
+
+  /* Resend only what the server doesn't have: segments the SACKs show were
+   * skipped over, or that just haven't been heard about in too long. */
+  for(i = 0; i < session->segment_count; i++)
+  {
+    segment = &session->segments[i];
+    if(segment->is_sacked)
+      continue;
+
+    if(segment->is_lost || time(NULL) - segment->last_sent > RETRANSMIT_DELAY)
+    {
+      send_segment(session, segment);
+      sent = TRUE;
+    }
+  }
+
+  in_flight = scoreboard_bytes(session);
+  while(session->segment_count < SEND_WINDOW && buffer_get_remaining_bytes(session->outgoing_data) > in_flight)
+  {
+    segment = &session->segments[session->segment_count++];
+    segment->seq           = (session->my_seq + in_flight) & 0xFFFF;
+    segment->length        = MIN(buffer_get_remaining_bytes(session->outgoing_data) - in_flight, max_length);
+    segment->transmissions = 0;
+    segment->is_sacked     = FALSE;
+
+    send_segment(session, segment);
+    in_flight += segment->length;
+    sent = TRUE;
+  }
+
+  /* The server lets go of any long-poll it's holding once it hears from us. */
+  if(sent)
+  {
+    update_counter(session);
+    session->is_longpolling = FALSE;
+  }
+
+  return sent;
+}
+
+/* Take acknowledged bytes off the front of the scoreboard. */
+static void scoreboard_ack(session_t *session, uint16_t bytes_acked)
+{
+  segment_t *segment;
+
+  while(session->segment_count > 0 && bytes_acked > 0)
+  {
+    segment = &session->segments[0];
+
+    if(bytes_acked < segment->length)
+    {
+      segment->seq     = (segment->seq + bytes_acked) & 0xFFFF;
+      segment->length -= bytes_acked;
+      break;
+    }
+
+    fec_sample(session, segment->transmissions == 1);
+    bytes_acked -= segment->length;
+
+    session->segment_count--;
+    memmove(&session->segments[0], &session->segments[1], session->segment_count * sizeof(segment_t));
+  }
+}
+
+/* Mark the segments the server says it has, and work out which of the rest
+ * have been skipped over enough times that they're probably lost. */
+static void scoreboard_sack(session_t *session, sack_range_t *ranges, uint8_t count)
+{
+  segment_t *segment;
+  size_t     later;
+  size_t     i, j;
+
+  for(i = 0; i < session->segment_count; i++)
+  {
+    segment = &session->segments[i];
+
+    for(j = 0; j < count && !segment->is_sacked; j++)
+    {
+      if(((segment->seq - ranges[j].start) & 0xFFFF) + segment->length <= ((ranges[j].end - ranges[j].start) & 0xFFFF))
+        segment->is_sacked = TRUE;
+    }
+  }
+
+  for(i = 0; i < session->segment_count; i++)
+  {
+    segment = &session->segments[i];
+    if(segment->is_sacked)
+      continue;
+
+    for(later = 0, j = 0; j < session->segment_count; j++)
+      if(session->segments[j].is_sacked && session->segments[j].sent_order > segment->sent_order)
+        later++;
+
+    if(later >= SACK_REORDER)
+      segment->is_lost = TRUE;
+  }
+}
+
 static session_t *sessions_get_by_id(uint16_t session_id)
 {
   session_entry_t *entry;
@@ -85,6 +443,29 @@ static void do_send_stuff(session_t *session)
   packet_t *packet;
   uint8_t  *data;
   size_t    length;
+  size_t    max_length;
+  uint8_t   flags = 0;
+  size_t    copies = 0;
+
+  /* Don't transmit until we know how big the packets can be. */
+  if(max_packet_length == 0)
+  {
+    LOG_INFO("Waiting for the output driver to set max_packet_length, not sending yet...");
+    return;
+  }
+
+  /* With SACK, the data in flight has its own timers on the scoreboard; the
+   * timer below is just for polls. */
+  if(session->state == SESSION_STATE_ESTABLISHED && (session->options & OPT_SACK))
+  {
+    if(do_send_window(session))
+      return;
+
+    /* The answers to the segments in flight will bring back whatever the
+     * server has for us, so there's no need to poll. */
+    if(session->segment_count > 0)
+      return;
+  }
 
   /* Don't transmit too quickly without receiving anything. */
   if(!can_i_transmit_yet(session))
@@ -97,33 +478,59 @@ static void do_send_stuff(session_t *session)
   {
     case SESSION_STATE_NEW:
       LOG_INFO("In SESSION_STATE_NEW, sending a SYN packet (SEQ = 0x%04x)...", session->my_seq);
-      packet = packet_create_syn(session->id, session->my_seq, 0);
+      packet = packet_create_syn(session->id, session->my_seq, SESSION_OPTIONS);
       if(session->name)
         packet_syn_set_name(packet, session->name);
       if(session->tunnel_host)
         packet_syn_set_tunnel(packet, session->tunnel_host, session->tunnel_port);
+      if(max_downstream_length)
+        packet_syn_set_max_downstream(packet, max_downstream_length);
 
       update_counter(session);
+      fec_new_round(session);
+      fec_add_packet(session, packet->packet_id);
       message_post_packet_out(packet);
 
       packet_destroy(packet);
       break;
 
     case SESSION_STATE_ESTABLISHED:
+      /* There's no point polling for data we can't take. */
+      if(session->is_paused && buffer_get_remaining_bytes(session->outgoing_data) == 0)
+        return;
+
+      /* With SACK, data only goes out through the window, so this is just a
+       * poll. */
+      max_length = max_packet_length - PACKET_MSG_SIZE - packet_get_msg_options_size(session->options);
+      if(session->options & OPT_SACK)
+        max_length = 0;
+
       /* Read data without consuming it (ie, leave it in the buffer till it's ACKed) */
-      data = buffer_read_remaining_bytes(session->outgoing_data, &length, max_packet_length - packet_get_msg_size(), FALSE);
+      data = buffer_read_remaining_bytes(session->outgoing_data, &length, max_length, FALSE);
       LOG_INFO("In SESSION_STATE_ESTABLISHED, sending a MSG packet (SEQ = 0x%04x, ACK = 0x%04x, %zd bytes of data...", session->my_seq, session->their_seq, length);
 
-      /* Create a packet with that data */
-      packet = packet_create_msg(session->id, session->my_seq, session->their_seq, data, length);
+      fec_new_round(session);
+      session->is_longpolling = FALSE;
+
+      /* If we have nothing to say, let the server hang onto the poll till it
+       * has something to say. */
+      if((session->options & OPT_MSG_FLAGS) && longpoll && length == 0)
+      {
+        flags |= MSG_FLAG_LONGPOLL;
+        session->is_longpolling = TRUE;
+      }
+
+      /* Only bother with FEC copies when data's moving one way or the other
+       * (and never for long-polls; the server would take each copy as the
+       * client giving up on the last). */
+      if(!session->is_longpolling && (length > 0 || session->is_receiving))
+        copies = fec_get_copies(session);
 
       /* Send the packet */
+      send_msg(session, session->my_seq, data, length, flags, copies);
       update_counter(session);
-      message_post_packet_out(packet);
 
       /* Free everything */
-      packet_destroy(packet);
-
       safe_free(data);
       break;
 
@@ -193,6 +600,14 @@ static void handle_config_int(char *name, int value)
 {
   if(!strcmp(name, "max_packet_length"))
     max_packet_length = value;
+  else if(!strcmp(name, "max_downstream_length"))
+    max_downstream_length = value;
+  else if(!strcmp(name, "longpoll"))
+    longpoll = value ? TRUE : FALSE;
+  else if(!strcmp(name, "fec_copies"))
+    fec_copies = value;
+  else if(!strcmp(name, "fec_auto"))
+    fec_auto = value ? TRUE : FALSE;
 }
 
 static void handle_config_string(char *name, char *value)
@@ -220,6 +635,7 @@ static uint16_t handle_create_session(char *tunnel_host, uint16_t tunnel_port)
   session->state         = SESSION_STATE_NEW;
   session->their_seq     = 0;
   session->is_closed     = FALSE;
+  session->options       = 0;
 
   session->tunnel_host = tunnel_host;
   session->tunnel_port = tunnel_port;
@@ -227,6 +643,16 @@ static uint16_t handle_create_session(char *tunnel_host, uint16_t tunnel_port)
   session->outgoing_data = buffer_create(BO_BIG_ENDIAN);
 
   session->last_transmit = 0;
+  session->packet_id_count = 0;
+  session->is_answered = FALSE;
+  session->is_longpolling = FALSE;
+  session->is_receiving = FALSE;
+  session->is_paused = FALSE;
+  session->segment_count = 0;
+  session->send_count = 0;
+  session->fec_copies = 0;
+  session->fec_sent = 0;
+  session->fec_answered = 0;
 
   /* Add it to the linked list. */
   entry = safe_malloc(sizeof(session_entry_t));
@@ -259,6 +685,34 @@ static void handle_close_session(uint16_t session_id)
   }
 }
 
+static void handle_pause_session(uint16_t session_id)
+{
+  session_t *session = sessions_get_by_id(session_id);
+  if(!session)
+  {
+    LOG_ERROR("Tried to access a non-existent session: %d", session_id);
+    return;
+  }
+
+  session->is_paused = TRUE;
+}
+
+static void handle_resume_session(uint16_t session_id)
+{
+  session_t *session = sessions_get_by_id(session_id);
+  if(!session)
+  {
+    LOG_ERROR("Tried to access a non-existent session: %d", session_id);
+    return;
+  }
+
+  session->is_paused = FALSE;
+
+  /* Go get whatever the server's been holding onto. */
+  reset_counter(session);
+  do_send_stuff(session);
+}
+
 static void handle_data_out(uint16_t session_id, uint8_t *data, size_t length)
 {
   session_t *session = sessions_get_by_id(session_id);
@@ -276,6 +730,83 @@ static void handle_data_out(uint16_t session_id, uint8_t *data, size_t length)
 
 }
 
+/* Handle a MSG from the server when OPT_SACK was negotiated. Any number of
+ * MSGs can be in flight, so the ACK and SACKs in each answer are taken on
+ * their own, whether or not its SEQ (and data) is the one we're expecting.
+ * Returns TRUE if something should go out right away. */
+static NBBOOL handle_msg_window(session_t *session, packet_t *packet)
+{
+  NBBOOL   poll_right_away = FALSE;
+  uint16_t bytes_acked = packet->body.msg.ack - session->my_seq;
+
+  /* Only what's in flight can be ACKed. Answers routinely overtake each
+   * other, and an ACK from behind my_seq wraps around to a big number; with
+   * more than 64KB queued, that could pass for data we haven't even sent. */
+  if(bytes_acked <= scoreboard_bytes(session))
+  {
+    if(bytes_acked != 0)
+    {
+      scoreboard_ack(session, bytes_acked);
+      buffer_consume(session->outgoing_data, bytes_acked);
+      session->my_seq = (session->my_seq + bytes_acked) & 0xFFFF;
+
+      /* The window's moving, so the link's alive; in long-poll mode, that
+       * means we can put a poll back at the server once it drains. */
+      reset_counter(session);
+      if(longpoll && (session->options & OPT_MSG_FLAGS))
+        poll_right_away = TRUE;
+    }
+
+    scoreboard_sack(session, packet->body.msg.sack, packet->body.msg.sack_count);
+  }
+  else
+  {
+    /* Most likely an answer that was overtaken by a later one. */
+    LOG_INFO("Stale ACK received (%d bytes acked; %u bytes in flight)", bytes_acked, (unsigned int)scoreboard_bytes(session));
+  }
+
+  /* The answer to a poll lets the next poll go. */
+  if(is_current_packet(session, packet->packet_id) && !session->is_answered)
+  {
+    session->is_answered = TRUE;
+    reset_counter(session);
+
+    if(longpoll && (session->options & OPT_MSG_FLAGS))
+      poll_right_away = TRUE;
+  }
+
+  if(session->is_paused && packet->body.msg.data_length > 0)
+  {
+    LOG_INFO("Session is paused, leaving %u bytes with the server", (unsigned int)packet->body.msg.data_length);
+  }
+  else if(packet->body.msg.seq == session->their_seq)
+  {
+    session->their_seq = (session->their_seq + packet->body.msg.data_length) & 0xFFFF;
+    session->is_receiving = packet->body.msg.data_length > 0;
+
+    if(packet->body.msg.data_length > 0)
+      message_post_data_in(session->id, packet->body.msg.data, packet->body.msg.data_length);
+
+    /* Go right back for more if there is (or might be) more. */
+    if((packet->body.msg.data_length > 0 && !(session->options & OPT_MSG_FLAGS)) || ((session->options & OPT_MSG_FLAGS) && (packet->body.msg.flags & MSG_FLAG_MORE)))
+    {
+      reset_counter(session);
+      poll_right_away = TRUE;
+    }
+  }
+  else if(packet->body.msg.data_length > 0)
+  {
+    LOG_INFO("Received data we already have (SEQ = 0x%04x, expected 0x%04x)", packet->body.msg.seq, session->their_seq);
+  }
+
+  /* Fill any room that just opened up in the window, and resend anything
+   * the SACKs show went missing. */
+  if(unsent_bytes(session) > 0 || session->segment_count > 0)
+    poll_right_away = TRUE;
+
+  return poll_right_away;
+}
+
 static void handle_packet_in(packet_t *packet)
 {
   NBBOOL poll_right_away = FALSE;
@@ -293,7 +824,9 @@ static void handle_packet_in(packet_t *packet)
       {
         LOG_INFO("In SESSION_STATE_NEW, received SYN (ISN = 0x%04x)", packet->body.syn.seq);
         session->their_seq = packet->body.syn.seq;
+        session->options = packet->body.syn.options & SESSION_OPTIONS;
         session->state = SESSION_STATE_ESTABLISHED;
+        session->is_answered = TRUE;
       }
       else if(packet->packet_type == PACKET_TYPE_MSG)
       {
@@ -321,19 +854,58 @@ static void handle_packet_in(packet_t *packet)
       {
         LOG_INFO("In SESSION_STATE_ESTABLISHED, received a MSG");
 
+        /* Pull out the optional fields we agreed on in the SYN. */
+        if(!packet_msg_parse_options(packet, session->options))
+        {
+          LOG_WARNING("MSG is too short to hold its options (ignoring)");
+          return;
+        }
+
+        if(session->options & OPT_SACK)
+        {
+          if(handle_msg_window(session, packet))
+            do_send_stuff(session);
+          return;
+        }
+
+        /* Only the answer to our latest packet reflects everything we've
+         * sent; acting on an older one (say, a long-poll the server let go
+         * after we'd moved on) would knock the SEQ/ACK numbers out of step. */
+        if(!is_current_packet(session, packet->packet_id))
+        {
+          LOG_INFO("Received a response to an old packet (ignoring)");
+          return;
+        }
+
+        /* Once one copy of a packet is answered, the rest are noise. */
+        if(session->is_answered)
+        {
+          LOG_INFO("Received a response to a redundant copy (ignoring)");
+          return;
+        }
+
         /* Validate the SEQ */
         if(packet->body.msg.seq == session->their_seq)
         {
           /* Verify the ACK is sane */
           uint16_t bytes_acked = packet->body.msg.ack - session->my_seq;
 
+          /* If we're paused, leave the data with the server (by not ACKing
+           * it) till we can take it. */
+          size_t data_length = session->is_paused ? 0 : packet->body.msg.data_length;
+
           if(bytes_acked <= buffer_get_remaining_bytes(session->outgoing_data))
           {
             /* Reset the retransmit counter since we got some valid data. */
             reset_counter(session);
+            session->is_answered = TRUE;
+            session->is_receiving = data_length > 0;
+
+            if(data_length < packet->body.msg.data_length)
+              LOG_INFO("Session is paused, leaving %u bytes with the server", (unsigned int)packet->body.msg.data_length);
 
             /* Increment their sequence number */
-            session->their_seq = (session->their_seq + packet->body.msg.data_length) & 0xFFFF;
+            session->their_seq = (session->their_seq + data_length) & 0xFFFF;
 
             /* Remove the acknowledged data from the buffer */
             buffer_consume(session->outgoing_data, bytes_acked);
@@ -345,16 +917,35 @@ static void handle_packet_in(packet_t *packet)
               poll_right_away = TRUE;
             }
 
-            /* Print the data, if we received any, and then immediately receive more. */
-            if(packet->body.msg.data_length > 0)
+            /* Print the data, if we received any. */
+            if(data_length > 0)
             {
-              message_post_data_in(session->id, packet->body.msg.data, packet->body.msg.data_length);
-              poll_right_away = TRUE;
+              message_post_data_in(session->id, packet->body.msg.data, data_length);
+
+              /* If the server can't tell us whether there's more, assume
+               * there is and go right back for it. */
+              if(!(session->options & OPT_MSG_FLAGS))
+                poll_right_away = TRUE;
             }
+
+            /* If the server says there's more queued up, keep polling
+             * back-to-back till it's drained. Otherwise, the ACK for this
+             * data can ride along with the next poll. */
+            if((session->options & OPT_MSG_FLAGS) && (packet->body.msg.flags & MSG_FLAG_MORE) && !session->is_paused)
+              poll_right_away = TRUE;
+
+            /* Anything that was queued while this packet was in flight can
+             * go now, too. */
+            if(buffer_get_remaining_bytes(session->outgoing_data) > 0)
+              poll_right_away = TRUE;
+
+            /* In long-poll mode, always keep a poll waiting at the server. */
+            if(longpoll && (session->options & OPT_MSG_FLAGS))
+              poll_right_away = TRUE;
           }
           else
           {
-            LOG_WARNING("Bad ACK received (%d bytes acked; %d bytes in the buffer)", bytes_acked, buffer_get_remaining_bytes(session->outgoing_data));
+            LOG_WARNING("Bad ACK received (%d bytes acked; %u bytes in the buffer)", bytes_acked, (unsigned int)buffer_get_remaining_bytes(session->outgoing_data));
             return;
           }
         }
@@ -430,6 +1021,14 @@ static void handle_message(message_t *message, void *param)
       handle_close_session(message->message.close_session.session_id);
       break;
 
+    case MESSAGE_PAUSE_SESSION:
+      handle_pause_session(message->message.pause_session.session_id);
+      break;
+
+    case MESSAGE_RESUME_SESSION:
+      handle_resume_session(message->message.resume_session.session_id);
+      break;
+
     case MESSAGE_DATA_OUT:
       handle_data_out(message->message.data_out.session_id, message->message.data_out.data, message->message.data_out.length);
       break;
@@ -453,6 +1052,8 @@ void sessions_init()
   message_subscribe(MESSAGE_SHUTDOWN,       handle_message, NULL);
   message_subscribe(MESSAGE_CREATE_SESSION, handle_message, NULL);
   message_subscribe(MESSAGE_CLOSE_SESSION,  handle_message, NULL);
+  message_subscribe(MESSAGE_PAUSE_SESSION,  handle_message, NULL);
+  message_subscribe(MESSAGE_RESUME_SESSION, handle_message, NULL);
   message_subscribe(MESSAGE_DATA_OUT,       handle_message, NULL);
   message_subscribe(MESSAGE_PACKET_IN,      handle_message, NULL);
   message_subscribe(MESSAGE_HEARTBEAT,      handle_message, NULL);
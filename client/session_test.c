@@ -0,0 +1,330 @@
+/* session_test.c
+ * Created October/2026
+ *
+ * (See LICENSE.txt)
+ *
+ * Runs sessions against a fake server and checks that all the data makes it
+ * across. Run it with 'make test'.
+ *
+ * The sessions negotiate OPT_SACK and run with automatic FEC. There are two
+ * tests:
+ *
+ * - "lossy": the fake link drops some of the queries. The window's segments
+ *   mustn't be sent with FEC copies (on top of their retransmissions), so the
+ *   data that goes out has to stay within a small multiple of what there is
+ *   to send.
+ *
+ * - "reordered": nothing's dropped, but the server takes the segments in
+ *   swapped pairs, and every so often replays its very first answer (an ACK
+ *   that's long stale). More than 64KB is queued, so the stale ACK looks like
+ *   it's acknowledging most of the buffer unless it's checked against what's
+ *   actually in flight.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "memory.h"
+#include "message.h"
+#include "packet.h"
+#include "session.h"
+#include "types.h"
+
+/* The most data a test sends, and how long its packets can be. */
+#define TEST_DATA_MAX      70000
+#define TEST_PACKET_LENGTH 64
+
+/* The session can't send more than this many times the data (FEC copies on
+ * each segment would take it to three times or more in the lossy test). */
+#define TEST_MAX_OVERHEAD 2
+
+/* How long (in seconds) each session gets to finish. */
+#define TEST_TIMEOUT 60
+
+/* The most packets that can be waiting on the fake server. */
+#define QUEUE_MAX 256
+
+typedef struct
+{
+  char   *name;
+  size_t  length;
+  int     loss;   /* One query in 'loss' is dropped (0 for none). */
+  NBBOOL  reorder;
+  int     replay; /* Every 'replay' answers, replay the first (0 for never). */
+} test_t;
+
+static test_t tests[] =
+{
+  { "lossy",     5000,         5, FALSE, 0  },
+  { "reordered", TEST_DATA_MAX, 0, TRUE,  10 },
+  { NULL, 0, 0, FALSE, 0 }
+};
+
+static uint8_t   data[TEST_DATA_MAX];
+
+/* The packets the session has sent, waiting to be handled. */
+static packet_t *queue[QUEUE_MAX];
+static size_t    queue_length;
+
+/* The fake server's side of the session. */
+static test_t   *test;
+static uint16_t  session_id;
+static uint16_t  client_isn;
+static uint16_t  server_seq = 0x4000;
+static NBBOOL    received[TEST_DATA_MAX];
+static size_t    acked;
+static size_t    answers;
+static packet_t *first_answer;
+static size_t    bytes_sent;
+static size_t    queries;
+static size_t    dropped;
+static size_t    replayed;
+
+/* A fixed sequence of drops, so every run is the same (and rand() is left to
+ * the session). */
+static uint32_t  loss_state = 12345;
+
+static void fail(char *message)
+{
+  fprintf(stderr, "FAIL (%s): %s\n", test->name, message);
+  exit(1);
+}
+
+static NBBOOL is_dropped()
+{
+  if(test->loss == 0)
+    return FALSE;
+
+  loss_state = (loss_state * 1103515245) + 12345;
+  return ((loss_state >> 16) % test->loss) == 0;
+}
+
+static void handle_packet_out(message_t *message, void *param)
+{
+  if(queue_length == QUEUE_MAX)
+    fail("too many packets in flight");
+
+  queue[queue_length++] = packet_copy(message->message.packet_out.packet);
+}
+
+/* Send a reply to the session the way the DNS driver would: as bytes off the
+ * wire. */
+static void reply(packet_t *packet)
+{
+  uint8_t  *bytes;
+  size_t    length;
+  packet_t *parsed;
+
+  bytes  = packet_to_bytes(packet, &length, NULL);
+  parsed = packet_parse(bytes, length, NULL);
+  message_post_packet_in(parsed);
+
+  packet_destroy(parsed);
+  safe_free(bytes);
+  packet_destroy(packet);
+}
+
+static void handle_syn(packet_t *packet)
+{
+  packet_t *response = packet_create_syn(packet->session_id, server_seq, packet->body.syn.options & (OPT_MSG_FLAGS | OPT_SACK));
+
+  if(!(packet->body.syn.options & OPT_SACK))
+    fail("the session didn't ask for OPT_SACK");
+
+  client_isn = packet->body.syn.seq;
+  response->packet_id = packet->packet_id;
+  reply(response);
+}
+
+static void handle_msg(packet_t *packet)
+{
+  packet_t     *response;
+  sack_range_t  ranges[SACK_MAX_RANGES];
+  uint8_t       count = 0;
+  size_t        offset;
+  size_t        i;
+
+  queries++;
+  bytes_sent += packet->body.msg.data_length;
+  if(is_dropped())
+  {
+    dropped++;
+    return;
+  }
+
+  /* The SEQ only has 16 bits, so it's taken relative to what we've ACKed
+   * (resent data can be from behind that). */
+  offset = (packet->body.msg.seq - (client_isn + acked)) & 0xFFFF;
+  if(offset >= 0x8000)
+    offset = acked - (0x10000 - offset);
+  else
+    offset = acked + offset;
+  if(packet->body.msg.data_length > 0)
+  {
+    if(offset + packet->body.msg.data_length > test->length)
+      fail("data was sent past the end");
+    if(memcmp(data + offset, packet->body.msg.data, packet->body.msg.data_length))
+      fail("the data doesn't match");
+  }
+
+  for(i = 0; i < packet->body.msg.data_length; i++)
+    received[offset + i] = TRUE;
+  while(acked < test->length && received[acked])
+    acked++;
+
+  /* SACK whatever we have beyond the ACK. */
+  i = acked;
+  while(i < test->length && count < SACK_MAX_RANGES)
+  {
+    if(!received[i])
+    {
+      i++;
+      continue;
+    }
+
+    ranges[count].start = (client_isn + i) & 0xFFFF;
+    while(i < test->length && received[i])
+      i++;
+    ranges[count].end = (client_isn + i) & 0xFFFF;
+    count++;
+  }
+
+  response = packet_create_msg(packet->session_id, server_seq, (client_isn + acked) & 0xFFFF, NULL, 0);
+  response->packet_id = packet->packet_id;
+  packet_msg_set_flags(response, 0);
+  packet_msg_set_sack(response, ranges, count);
+
+  answers++;
+  if(!first_answer)
+    first_answer = packet_copy(response);
+  reply(response);
+
+  /* An answer that was held up somewhere, arriving well after its time. */
+  if(test->replay && (answers % test->replay) == 0)
+  {
+    replayed++;
+    reply(packet_copy(first_answer));
+  }
+}
+
+/* Handle everything the session's sent, including whatever it sends in
+ * response. Returns FALSE if there was nothing to handle. */
+static NBBOOL run_server()
+{
+  packet_t *packets[QUEUE_MAX];
+  packet_t *packet;
+  size_t    count;
+  size_t    i;
+
+  if(queue_length == 0)
+    return FALSE;
+
+  while(queue_length > 0)
+  {
+    count = queue_length;
+    memcpy(packets, queue, count * sizeof(packet_t*));
+    queue_length = 0;
+
+    for(i = 0; i < count; i++)
+    {
+      /* Reordering swaps each pair (any more than that, and the session
+       * would rightly take the segments that were overtaken as lost). */
+      if(test->reorder && (i ^ 1) < count)
+        packet = packets[i ^ 1];
+      else
+        packet = packets[i];
+
+      /* Anything left over from the last test is ignored. */
+      if(packet->session_id == session_id)
+      {
+        if(packet->packet_type == PACKET_TYPE_SYN)
+          handle_syn(packet);
+        else if(packet->packet_type == PACKET_TYPE_MSG)
+          handle_msg(packet);
+      }
+
+      packet_destroy(packet);
+    }
+  }
+
+  return TRUE;
+}
+
+static void discard_queue()
+{
+  size_t i;
+
+  for(i = 0; i < queue_length; i++)
+    packet_destroy(queue[i]);
+  queue_length = 0;
+}
+
+static void run_test()
+{
+  time_t start = time(NULL);
+
+  memset(received, 0, sizeof(received));
+  acked        = 0;
+  answers      = 0;
+  first_answer = NULL;
+  bytes_sent   = 0;
+  queries      = 0;
+  dropped      = 0;
+  replayed     = 0;
+
+  session_id = message_post_create_session();
+  message_post_data_out(session_id, data, test->length);
+
+  while(acked < test->length)
+  {
+    if(time(NULL) - start > TEST_TIMEOUT)
+      fail("timed out");
+
+    /* With nothing to answer, let time pass till something's resent. */
+    if(!run_server())
+    {
+      sleep(1);
+      message_post_heartbeat();
+    }
+  }
+
+  printf("%s: %u bytes sent as %u bytes in %u queries (%u dropped, %u stale answers)\n", test->name, (unsigned int)test->length, (unsigned int)bytes_sent, (unsigned int)queries, (unsigned int)dropped, (unsigned int)replayed);
+  if(bytes_sent > test->length * TEST_MAX_OVERHEAD)
+    fail("too much data was sent");
+
+  /* The session's done; let it go. */
+  message_post_close_session(session_id);
+  message_post_heartbeat();
+  discard_queue();
+
+  if(first_answer)
+    packet_destroy(first_answer);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t i;
+
+  for(i = 0; i < TEST_DATA_MAX; i++)
+    data[i] = (uint8_t) (i * 7);
+
+  sessions_init();
+  message_subscribe(MESSAGE_PACKET_OUT, handle_packet_out, NULL);
+
+  message_post_config_int("max_packet_length", TEST_PACKET_LENGTH);
+  message_post_config_int("fec_auto", TRUE);
+
+  for(test = tests; test->name; test++)
+    run_test();
+
+  message_cleanup();
+  print_memory();
+
+  printf("PASS\n");
+
+  return 0;
+}
@@ -19,11 +19,11 @@ int main(int argc, const char *argv[])
   packet_print(packet);
 
   /* Convert it to bytes and free the original */
-  bytes = packet_to_bytes(packet, &length);
+  bytes = packet_to_bytes(packet, &length, NULL);
   packet_destroy(packet);
 
   /* Parse the bytes from the old packet to create a new one */
-  packet = packet_parse(bytes, length);
+  packet = packet_parse(bytes, length, NULL);
   packet_print(packet);
   packet_destroy(packet);
   safe_free(bytes);
@@ -33,11 +33,11 @@ int main(int argc, const char *argv[])
   packet_print(packet);
 
   /* Convert it to bytes and free the orignal */
-  bytes = packet_to_bytes(packet, &length);
+  bytes = packet_to_bytes(packet, &length, NULL);
   packet_destroy(packet);
 
   /* Parse the bytes from the old packet to create a new one */
-  packet = packet_parse(bytes, length);
+  packet = packet_parse(bytes, length, NULL);
   packet_print(packet);
   packet_destroy(packet);
   safe_free(bytes);
@@ -47,12 +47,12 @@ int main(int argc, const char *argv[])
   packet_print(packet);
 
   /* Convert it to bytes and free the orignal */
-  bytes = packet_to_bytes(packet, &length);
+  bytes = packet_to_bytes(packet, &length, NULL);
   packet_destroy(packet);
   safe_free(bytes);
 
   /* Parse the bytes from the old packet to create a new one */
-  packet = packet_parse(bytes, length);
+  packet = packet_parse(bytes, length, NULL);
   packet_print(packet);
   packet_destroy(packet);
 
@@ -29,6 +29,14 @@ typedef void(session_callback_t)(uint16_t session_id, uint8_t *data, size_t leng
 typedef uint16_t(session_create_callback_t)();
 typedef void(session_closed_callback_t)(uint16_t session_id);
 
+/* One piece of some data that's sent in pieces (see udp_send_segments()), so
+ * the pieces never have to be copied together. */
+typedef struct
+{
+  void   *data;
+  size_t  length;
+} data_segment_t;
+
 #ifndef TRUE
 typedef enum
 {
@@ -5,6 +5,7 @@
  * (See LICENSE.txt)
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +19,7 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #endif
 
 #include "udp.h"
@@ -65,10 +67,31 @@ size_t udp_read(int s, void *buffer, size_t buffer_length, struct sockaddr_in *f
 }
 
 void udp_send(int sock, char *address, uint16_t port, void *data, size_t length)
+{
+  data_segment_t segment;
+
+  segment.data   = data;
+  segment.length = length;
+
+  udp_send_segments(sock, address, port, &segment, 1);
+}
+
+void udp_send_segments(int sock, char *address, uint16_t port, data_segment_t *segments, size_t count)
 {
   int    result;
+  size_t i;
   struct sockaddr_in serv_addr;
   struct hostent *server;
+#ifdef WIN32
+  WSABUF buffers[UDP_MAX_SEGMENTS];
+  DWORD  sent;
+#else
+  struct iovec  buffers[UDP_MAX_SEGMENTS];
+  struct msghdr msg;
+#endif
+
+  if(count > UDP_MAX_SEGMENTS)
+    DIE("udp: too many segments");
 
   /* Look up the host */
   server = gethostbyname(address);
@@ -84,9 +107,32 @@ void udp_send(int sock, char *address, uint16_t port, void *data, size_t length)
     serv_addr.sin_port   = htons(port);
     memcpy(&serv_addr.sin_addr, server->h_addr_list[0], server->h_length);
 
-    result = sendto(sock, data, length, 0, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr_in));
+#ifdef WIN32
+    for(i = 0; i < count; i++)
+    {
+      buffers[i].buf = segments[i].data;
+      buffers[i].len = segments[i].length;
+    }
+
+    result = WSASendTo(sock, buffers, count, &sent, 0, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr_in), NULL, NULL);
+#else
+    for(i = 0; i < count; i++)
+    {
+      buffers[i].iov_base = segments[i].data;
+      buffers[i].iov_len  = segments[i].length;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name    = &serv_addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = buffers;
+    msg.msg_iovlen  = count;
+
+    result = sendmsg(sock, &msg, 0);
+#endif
 
-    if( result < 0 )
+    /* If the socket is non-blocking and its buffer is full, the packet's just lost (like any other UDP packet). */
+    if( result < 0 && errno != EAGAIN && errno != EWOULDBLOCK )
       nbdie("udp: couldn't send data");
   }
 }
@@ -33,6 +33,11 @@ int udp_create_socket(uint16_t port, char *local_address);
 /* Send data to the given address on the given port. */
 void   udp_send(int sock, char *address, uint16_t port, void *data, size_t length);
 
+/* Send the segments, in order, as one packet (with a single system call). At
+ * most UDP_MAX_SEGMENTS can be sent at once. */
+#define UDP_MAX_SEGMENTS 16
+void   udp_send_segments(int sock, char *address, uint16_t port, data_segment_t *segments, size_t count);
+
 /* Close the UDP socket. */
 int    udp_close(int s);
 
@@ -30,6 +30,17 @@ require 'trollop'
 class Dnscat2
   @@tunnels = {}
 
+  # The SYN options we know how to handle; whichever of these the client asks
+  # for get echoed back and used for the rest of the session
+  SUPPORTED_OPTIONS = Packet::OPT_MSG_FLAGS | Packet::OPT_SACK
+
+  # The longest we'll sit on an idle long-poll, in seconds; this has to stay
+  # under what recursive resolvers will wait before giving up on us
+  @@longpoll_timeout = 3.0
+  def Dnscat2.set_longpoll_timeout(timeout)
+    @@longpoll_timeout = timeout
+  end
+
   # Begin subscriber stuff (this should be in a mixin, but static stuff doesn't
   # really seem to work
   @@subscribers = []
@@ -65,6 +76,8 @@ class Dnscat2
 
     session.set_their_seq(packet.seq)
     session.set_name(packet.name)
+    session.set_max_downstream(packet.max_downstream)
+    session.set_options(packet.options & SUPPORTED_OPTIONS)
     session.set_established()
 
     if(!packet.tunnel_host.nil?)
@@ -80,10 +93,84 @@ class Dnscat2
 
     Dnscat2.notify_subscribers(:dnscat2_syn_received, [session.id, session.my_seq, packet.seq])
 
-    return Packet.create_syn(packet.packet_id, session.id, session.my_seq, nil)
+    return Packet.create_syn(packet.packet_id, session.id, session.my_seq, session.options)
+  end
+
+  # Read as much outgoing data as fits in a MSG, after the header and
+  # whichever optional fields the session negotiated
+  def Dnscat2.read_outgoing(session, max_length)
+    sack_count = 0
+    if((session.options & Packet::OPT_SACK) == Packet::OPT_SACK)
+      sack_count = session.sack_ranges.length
+    end
+
+    return session.read_outgoing(max_length - Packet.msg_header_size(session.options, sack_count))
+  end
+
+  # Build a MSG with the given data, adding whichever optional fields the
+  # session negotiated
+  def Dnscat2.create_msg(packet, session, data)
+    flags = nil
+    if((session.options & Packet::OPT_MSG_FLAGS) == Packet::OPT_MSG_FLAGS)
+      flags = 0
+
+      # Let the client know it should come straight back for the rest
+      if(session.more_outgoing?(data.length))
+        flags |= Packet::MSG_FLAG_MORE
+      end
+    end
+
+    # Tell the client which out-of-order data we've got, so it only resends
+    # the gaps
+    sack = nil
+    if((session.options & Packet::OPT_SACK) == Packet::OPT_SACK)
+      sack = session.sack_ranges
+    end
+
+    return Packet.create_msg(packet.packet_id, session.id, session.my_seq, session.their_seq, data, flags, sack)
+  end
+
+  # Check if this is a poll we're allowed to sit on: the client set the
+  # LONGPOLL flag, has nothing to tell us, and we have nothing to tell it (and
+  # the transport can answer later)
+  def Dnscat2.longpoll?(packet, session, deferral)
+    if(deferral.nil? || @@longpoll_timeout <= 0 || packet.flags.nil?)
+      return false
+    end
+
+    if((packet.flags & Packet::MSG_FLAG_LONGPOLL) != Packet::MSG_FLAG_LONGPOLL)
+      return false
+    end
+
+    return packet.data.length == 0 && !session.more_outgoing?(0)
+  end
+
+  # Hold the poll until there's data for it or it times out, then answer it
+  # the same way we'd have answered it right away
+  def Dnscat2.hold_msg(packet, session, max_length, deferral)
+    session.hold(packet.packet_id) do |superseded|
+      # The client isn't listening for this one anymore, so don't bother
+      # sending anything it might act on
+      response = nil
+
+      if(!superseded)
+        new_data = read_outgoing(session, max_length)
+        response = create_msg(packet, session, new_data)
+        Dnscat2.notify_subscribers(:dnscat2_send, [Packet.parse(response)])
+      end
+
+      deferral.respond(response)
+    end
+
+    deferral.defer(@@longpoll_timeout) do
+      session.expire_held(packet.packet_id)
+    end
   end
 
-  def Dnscat2.handle_msg(pipe, packet, session, max_length)
+  def Dnscat2.handle_msg(pipe, packet, session, max_length, deferral = nil)
+    # Don't send more than the client told us it can receive
+    max_length = session.max_length(max_length)
+
     if(!session.msg_valid?())
       Dnscat2.notify_subscribers(:dnscat2_state_error, [session.id, "MSG received in invalid state; sending FIN"])
 
@@ -93,44 +180,70 @@ class Dnscat2
       return Packet.create_fin(packet.packet_id, session.id)
     end
 
-    # Validate the sequence number
-    if(session.their_seq != packet.seq)
-      Dnscat2.notify_subscribers(:dnscat2_msg_bad_seq, [session.their_seq, packet.seq])
+    # Pull out the optional fields we agreed on in the SYN
+    packet.parse_msg_options(session.options)
 
-      # Re-send the last packet
-      old_data = session.read_outgoing(max_length - Packet.msg_header_size)
-      return Packet.create_msg(packet.packet_id, session.id, session.my_seq, session.their_seq, old_data)
-    end
+    # If we're holding an older poll, the client has given up on it
+    session.supersede_held(packet.packet_id)
 
-    if(!session.valid_ack?(packet.ack))
-      Dnscat2.notify_subscribers(:dnscat2_msg_bad_ack, [session.my_seq, packet.ack])
+    if((session.options & Packet::OPT_SACK) == Packet::OPT_SACK)
+      # With SACK, the client can have several MSGs in flight, so they can
+      # show up in any order. The ACK stands on its own (an old one is just
+      # stale, not an error), and the data is slotted in wherever it goes.
+      if(session.valid_ack?(packet.ack))
+        session.ack_outgoing(packet.ack)
+      elsif(((packet.ack - session.my_seq) & 0xFFFF) < 0x8000)
+        Dnscat2.notify_subscribers(:dnscat2_msg_bad_ack, [session.my_seq, packet.ack])
+      end
 
-      # Re-send the last packet
-      old_data = session.read_outgoing(max_length - Packet.msg_header_size)
-      return Packet.create_msg(packet.packet_id, session.id, session.my_seq, session.their_seq, old_data)
-    end
+      data = session.receive_segment(packet.seq, packet.data)
+    else
+      # Validate the sequence number
+      if(session.their_seq != packet.seq)
+        Dnscat2.notify_subscribers(:dnscat2_msg_bad_seq, [session.their_seq, packet.seq])
 
-    # Acknowledge the data that has been received so far
-    # Note: this is where @my_seq is updated
-    session.ack_outgoing(packet.ack)
+        # Re-send the last packet
+        old_data = read_outgoing(session, max_length)
+        return create_msg(packet, session, old_data)
+      end
 
-    # Write the incoming data to the session
-    session.queue_incoming(packet.data)
+      if(!session.valid_ack?(packet.ack))
+        Dnscat2.notify_subscribers(:dnscat2_msg_bad_ack, [session.my_seq, packet.ack])
+
+        # Re-send the last packet
+        old_data = read_outgoing(session, max_length)
+        return create_msg(packet, session, old_data)
+      end
 
-    # Increment the expected sequence number
-    session.increment_their_seq(packet.data.length)
+      # Acknowledge the data that has been received so far
+      # Note: this is where @my_seq is updated
+      session.ack_outgoing(packet.ack)
+
+      # Increment the expected sequence number
+      data = packet.data
+      session.increment_their_seq(data.length)
+    end
+
+    # Write the incoming data to the session
+    session.queue_incoming(data)
 
     # Send the data through a tunnel, if necessary
     if(!@@tunnels[session.id].nil?)
       # Send the data on if it's a tunnel
-      @@tunnels[session.id].send(packet.data)
+      @@tunnels[session.id].send(data)
+    end
+
+    if(longpoll?(packet, session, deferral))
+      Dnscat2.notify_subscribers(:dnscat2_msg, [packet.data, ''])
+      hold_msg(packet, session, max_length, deferral)
+      return nil
     end
 
-    new_data = session.read_outgoing(max_length - Packet.msg_header_size)
+    new_data = read_outgoing(session, max_length)
     Dnscat2.notify_subscribers(:dnscat2_msg, [packet.data, new_data])
 
     # Build the new packet
-    return Packet.create_msg(packet.packet_id, session.id, session.my_seq, session.their_seq, new_data)
+    return create_msg(packet, session, new_data)
   end
 
   def Dnscat2.handle_fin(pipe, packet, session)
@@ -146,8 +259,20 @@ class Dnscat2
     return Packet.create_fin(packet.packet_id, session.id)
   end
 
+  # PINGs are sessionless; the client uses them to probe how much data fits
+  # through the path in each direction, so we pad the response out to the
+  # length it asked for (or as close as the transport allows)
+  def Dnscat2.handle_ping(pipe, packet, max_length)
+    length = [packet.response_length, max_length].min
+    padding = [length - Packet.ping_header_size, 0].max
+
+    return Packet.create_ping(packet.packet_id, length, padding)
+  end
+
   def Dnscat2.go(pipe)
-    pipe.recv() do |data, max_length|
+    # 'deferral' is only given by transports that can answer a query later
+    # (see DriverDNS::Deferral)
+    pipe.recv() do |data, max_length, deferral|
       session_id = nil
 
       begin
@@ -155,6 +280,13 @@ class Dnscat2
 
         Dnscat2.notify_subscribers(:dnscat2_recv, [packet])
 
+        # PINGs don't belong to a session, so handle them before looking one up
+        if(packet.type == Packet::MESSAGE_TYPE_PING)
+          response = handle_ping(pipe, packet, max_length)
+          Dnscat2.notify_subscribers(:dnscat2_send, [Packet.parse(response)])
+          next response
+        end
+
         # Store the session_id in a variable so we can close it if there's a problem
         session_id = packet.session_id
 
@@ -176,7 +308,7 @@ class Dnscat2
           if(packet.type == Packet::MESSAGE_TYPE_SYN)
             response = handle_syn(pipe, packet, session)
           elsif(packet.type == Packet::MESSAGE_TYPE_MSG)
-            response = handle_msg(pipe, packet, session, max_length)
+            response = handle_msg(pipe, packet, session, max_length, deferral)
           elsif(packet.type == Packet::MESSAGE_TYPE_FIN)
             response = handle_fin(pipe, packet, session)
           else
@@ -265,6 +397,8 @@ opts = Trollop::options do
     :type => :boolean,  :default => false
   opt :signals,        "Use to disable signals, which break rvmsudo",
     :type => :boolean,  :default => true
+  opt :longpoll_timeout, "The longest (in seconds) to hold a client's idle long-poll; keep it under resolver timeouts (0 = don't hold them)",
+    :type => :float,    :default => 3.0
 end
 
 opts[:debug].upcase!()
@@ -281,6 +415,11 @@ if(opts[:tcpport] < 0 || opts[:tcpport] > 65535)
   Trollop::die :dnsport, "must be a valid port"
 end
 
+if(opts[:longpoll_timeout] < 0)
+  Trollop::die :longpoll_timeout, "can't be negative"
+end
+Dnscat2.set_longpoll_timeout(opts[:longpoll_timeout])
+
 threads = []
 if(opts[:dns])
   threads << Thread.new do
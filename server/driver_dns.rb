@@ -55,6 +55,54 @@ class DriverDNS
   MAX_A_LENGTH = (MAX_A_RECORDS * 4) - 1 # Minus one because it's a length prefixed value
   MAX_MX_LENGTH = 250
 
+  # Encodes a response for a TXT record (nil means there's nothing to say)
+  def DriverDNS.encode_txt(response)
+    if(response.nil?)
+      Log.INFO("Sending nil response...")
+      return ''
+    end
+
+    return "#{response.unpack("H*").pop}"
+  end
+
+  # Handed to dnscat2 along with each TXT query, so it can choose to hold on
+  # to the query (a long-poll) and answer it later. defer() has to be called
+  # from inside the reactor (ie, while handling the query), but respond() can
+  # be called from any thread, and only the first response counts.
+  class Deferral
+    def initialize(transaction)
+      @transaction = transaction
+      @deferred    = false
+      @responded   = false
+    end
+
+    def deferred?()
+      return @deferred
+    end
+
+    # Hold the query; the block is called if it's still waiting after
+    # 'timeout' seconds
+    def defer(timeout)
+      @deferred = true
+      EventMachine.add_timer(timeout) do
+        yield
+      end
+    end
+
+    def respond(response)
+      EventMachine.next_tick do
+        if(!@responded)
+          @responded = true
+
+          response = DriverDNS.encode_txt(response)
+          Log.INFO("Sending (held):  #{response}")
+          @transaction.respond!(response)
+          @transaction.succeed()
+        end
+      end
+    end
+  end
+
   def DriverDNS.parse_name(name, domain)
     Log.INFO("Parsing: #{name}")
 
@@ -85,16 +133,18 @@ class DriverDNS
         begin
           name, domain = DriverDNS.parse_name(transaction.name, domain)
 
-          response = yield(name, MAX_TXT_LENGTH / 2) # TODO: Should be '2'
+          deferral = Deferral.new(transaction)
+          response = yield(name, MAX_TXT_LENGTH / 2, deferral) # TODO: Should be '2'
 
-          if(response.nil?)
-            Log.INFO("Sending nil response...")
-            response = ''
+          if(deferral.deferred?)
+            # Don't let rubydns answer it when we return; the deferral will
+            Log.INFO("Holding the response...")
+            transaction.defer!()
           else
-            response = "#{response.unpack("H*").pop}"
+            response = DriverDNS.encode_txt(response)
+            Log.INFO("Sending:  #{response}")
+            transaction.respond!(response)
           end
-          Log.INFO("Sending:  #{response}")
-          transaction.respond!(response)
         rescue SystemExit
           exit
         rescue DnscatException => e
@@ -15,14 +15,34 @@ class Packet
   MESSAGE_TYPE_SYN        = 0x00
   MESSAGE_TYPE_MSG        = 0x01
   MESSAGE_TYPE_FIN        = 0x02
+  MESSAGE_TYPE_PING       = 0x03
   MESSAGE_TYPE_STRAIGHTUP = 0xFF
 
   OPT_NAME                = 0x01
   OPT_TUNNEL              = 0x02
+  OPT_DOWNSTREAM          = 0x08
+  OPT_MSG_FLAGS           = 0x10
+  OPT_SACK                = 0x20
+
+  # The most selective-ACK ranges a MSG can carry (with OPT_SACK)
+  SACK_MAX_RANGES         = 4
+
+  # MSG flags (only present if OPT_MSG_FLAGS was negotiated)
+  MSG_FLAG_MORE           = 0x01
+  MSG_FLAG_LONGPOLL       = 0x02
 
   attr_reader :data, :type, :packet_id, :session_id, :options, :seq, :ack
   attr_reader :name
   attr_reader :tunnel_host, :tunnel_port
+  attr_reader :max_downstream
+  attr_reader :flags
+  attr_reader :sack
+  attr_reader :response_length, :padding_length
+
+  # The filler in a PING is a counting pattern, so damage is easy to spot
+  def Packet.ping_filler(length)
+    return (0...length).map() { |i| i & 0xFF }.pack("C*")
+  end
 
   def at_least?(data, needed)
     if(data.length < needed)
@@ -66,6 +86,13 @@ class Packet
       data = data[(@tunnel_host.length + 1 + 2)..-1]
     end
 
+    @max_downstream = nil
+    if((@options & OPT_DOWNSTREAM) == OPT_DOWNSTREAM)
+      at_least?(data, 2)
+      @max_downstream = data.unpack("n").pop
+      data = data[2..-1]
+    end
+
     # Verify that that was the entire packet
     if(data.length > 0)
       raise(DnscatException, "Extra data on the end of an SYN packet :: #{data.unpack("H*")}")
@@ -77,12 +104,48 @@ class Packet
     @data = data[4..-1] # Remove the first four bytes
   end
 
+  # The optional MSG fields depend on what the session negotiated, which the
+  # parser has no way of knowing, so the caller pulls them out once it does
+  def parse_msg_options(options)
+    @flags = nil
+
+    if((options & OPT_MSG_FLAGS) == OPT_MSG_FLAGS)
+      at_least?(@data, 1)
+      @flags = @data.unpack("C").pop
+      @data = @data[1..-1]
+    end
+
+    @sack = nil
+    if((options & OPT_SACK) == OPT_SACK)
+      at_least?(@data, 1)
+      count = @data.unpack("C").pop
+      if(count > SACK_MAX_RANGES)
+        raise(DnscatException, "Too many SACK ranges: #{count}")
+      end
+
+      at_least?(@data, 1 + (count * 4))
+      @sack = @data[1, count * 4].unpack("n*").each_slice(2).to_a()
+      @data = @data[(1 + (count * 4))..-1]
+    end
+  end
+
   def parse_fin(data)
     if(data.length > 0)
       raise(DnscatException, "Extra data on the end of a FIN packet")
     end
   end
 
+  def parse_ping(data)
+    at_least?(data, 2)
+    @response_length = data.unpack("n").pop
+    padding = data[2..-1]
+
+    if(padding != Packet.ping_filler(padding.length))
+      raise(DnscatException, "PING packet was damaged in transit")
+    end
+    @padding_length = padding.length
+  end
+
   def parse_straightup(data)
     raise(Exception, "Not implemented yet")
   end
@@ -98,6 +161,8 @@ class Packet
       parse_msg(data)
     elsif(@type == MESSAGE_TYPE_FIN)
       parse_fin(data)
+    elsif(@type == MESSAGE_TYPE_PING)
+      parse_ping(data)
     elsif(@type == MESSAGE_TYPE_STRAIGHTUP) # TODO
       parse_straightup(data)
     else
@@ -122,12 +187,24 @@ class Packet
     return create_syn(0, 0, 0, nil).length
   end
 
-  def Packet.create_msg(packet_id, session_id, seq, ack, msg)
-    return create_header(MESSAGE_TYPE_MSG, packet_id, session_id) + [seq, ack, msg].pack("nnA*")
+  # 'flags' should only be given if the session negotiated OPT_MSG_FLAGS, and
+  # 'sack' (a list of [start, end] ranges) only if it negotiated OPT_SACK
+  def Packet.create_msg(packet_id, session_id, seq, ack, msg, flags = nil, sack = nil)
+    packet = create_header(MESSAGE_TYPE_MSG, packet_id, session_id) + [seq, ack].pack("nn")
+    if(!flags.nil?)
+      packet += [flags].pack("C")
+    end
+    if(!sack.nil?)
+      packet += [sack.length].pack("C") + sack.flatten.pack("n*")
+    end
+
+    return packet + [msg].pack("A*")
   end
 
-  def Packet.msg_header_size()
-    return create_msg(0, 0, 0, 0, "").length
+  def Packet.msg_header_size(options = 0, sack_count = 0)
+    flags = ((options & OPT_MSG_FLAGS) == OPT_MSG_FLAGS) ? 0 : nil
+    sack  = ((options & OPT_SACK) == OPT_SACK) ? [[0, 0]] * sack_count : nil
+    return create_msg(0, 0, 0, 0, "", flags, sack).length
   end
 
   def Packet.create_fin(packet_id, session_id)
@@ -138,14 +215,30 @@ class Packet
     return create_fin(0, 0).length
   end
 
+  def Packet.create_ping(packet_id, response_length, padding_length)
+    return create_header(MESSAGE_TYPE_PING, packet_id, 0) + [response_length].pack("n") + Packet.ping_filler(padding_length)
+  end
+
+  def Packet.ping_header_size()
+    return create_ping(0, 0, 0).length
+  end
+
   def to_s()
     if(@type == MESSAGE_TYPE_SYN)
       return "[[SYN]] :: packet_id = %04x, session = %04x, seq = %04x, options = %04x" % [@packet_id, @session_id, @seq, @options]
     elsif(@type == MESSAGE_TYPE_MSG)
       data = @data.gsub(/\n/, '\n')
+      if(!@sack.nil? && @sack.length > 0)
+        return "[[MSG]] :: packet_id = %04x, session = %04x, seq = %04x, ack = %04x, sack = %s, data = \"%s\"" % [@packet_id, @session_id, @seq, @ack, @sack.map() { |r| "%04x-%04x" % r }.join(','), data]
+      end
+      if(!@flags.nil?)
+        return "[[MSG]] :: packet_id = %04x, session = %04x, seq = %04x, ack = %04x, flags = %02x, data = \"%s\"" % [@packet_id, @session_id, @seq, @ack, @flags, data]
+      end
       return "[[MSG]] :: packet_id = %04x, session = %04x, seq = %04x, ack = %04x, data = \"%s\"" % [@packet_id, @session_id, @seq, @ack, data]
     elsif(@type == MESSAGE_TYPE_FIN)
       return "[[FIN]] :: packet_id = %04x, session = %04x" % [@packet_id, @session_id]
+    elsif(@type == MESSAGE_TYPE_PING)
+      return "[[PING]] :: packet_id = %04x, response_length = %d, padding = %d bytes" % [@packet_id, @response_length, @padding_length]
     end
   end
 end
@@ -11,6 +11,7 @@
 
 require 'log'
 require 'dnscat_exception'
+require 'packet'
 
 class Session
   @@sessions = {}
@@ -18,6 +19,11 @@ class Session
 
   attr_reader :id, :state, :their_seq, :my_seq
   attr_reader :name
+  attr_reader :max_downstream
+  attr_reader :options
+
+  # The furthest past their_seq we'll buffer out-of-order data (with OPT_SACK)
+  MAX_SEGMENT_WINDOW = 0x4000
 
   # Session states
   STATE_NEW         = 0x00
@@ -55,6 +61,15 @@ class Session
     @incoming_data = ''
     @outgoing_data = ''
     @name = ''
+    @max_downstream = nil # nil = whatever the transport can carry
+    @options = 0
+
+    # Out-of-order data (with OPT_SACK), indexed by sequence number
+    @segments = {}
+
+    # Long-polls we're holding on to (see hold())
+    @held = []
+    @held_packet_id = nil
 
     Session.notify_subscribers(:session_created, [@id])
   end
@@ -89,6 +104,26 @@ class Session
     @name = name
   end
 
+  # The SYN options both sides agreed on, which decide what optional fields
+  # the MSGs carry
+  def set_options(options)
+    @options = options
+  end
+
+  def set_max_downstream(max_downstream)
+    @max_downstream = max_downstream
+  end
+
+  # Work out how long our packets can be, given what the transport can carry
+  # and what the client said it can receive
+  def max_length(transport_max)
+    if(@max_downstream.nil?)
+      return transport_max
+    end
+
+    return [transport_max, @max_downstream].min
+  end
+
   def increment_their_seq(n)
     if(@state != STATE_ESTABLISHED)
       raise(DnscatException, "Trying to increment remote side's SEQ in the wrong state")
@@ -118,12 +153,92 @@ class Session
     end
   end
 
+  # With OPT_SACK, data can show up in any order. Buffer whatever's ahead of
+  # what we're expecting, and return whatever's now in order (advancing
+  # their_seq past it).
+  def receive_segment(seq, data)
+    offset = (seq - @their_seq) & 0xFFFF
+
+    # Anything from before their_seq is a retransmission we already have
+    if(offset >= 0x8000)
+      behind = 0x10000 - offset
+      if(behind >= data.length)
+        return ''
+      end
+
+      data = data[behind..-1]
+      seq = @their_seq
+      offset = 0
+    end
+
+    if(offset > MAX_SEGMENT_WINDOW)
+      Log.WARNING("Dropping data that's too far ahead of the expected SEQ (#{offset} bytes)")
+      return ''
+    end
+
+    if(data.length > 0 && (@segments[seq].nil? || @segments[seq].length < data.length))
+      @segments[seq] = data
+    end
+
+    # Pull out whatever's now contiguous
+    received = ''
+    loop do
+      found = false
+
+      @segments.keys.each do |segment_seq|
+        # How far their_seq is into this segment
+        into = (@their_seq - segment_seq) & 0xFFFF
+        if(into >= 0x8000)
+          next
+        end
+
+        segment = @segments.delete(segment_seq)
+        if(into < segment.length)
+          received += segment[into..-1]
+          increment_their_seq(segment.length - into)
+          found = true
+        end
+      end
+
+      break if !found
+    end
+
+    return received
+  end
+
+  # The blocks of out-of-order data we're holding, as [start, end] ranges
+  # (merged, closest first), for the SACK field
+  def sack_ranges(max = Packet::SACK_MAX_RANGES)
+    ranges = @segments.map() do |seq, data|
+      offset = (seq - @their_seq) & 0xFFFF
+      [offset, offset + data.length]
+    end
+
+    merged = []
+    ranges.sort.each do |range|
+      if(merged.length > 0 && range[0] <= merged[-1][1])
+        merged[-1][1] = [merged[-1][1], range[1]].max
+      else
+        merged << range
+      end
+    end
+
+    return merged[0, max].map() do |range|
+      [(@their_seq + range[0]) & 0xFFFF, (@their_seq + range[1]) & 0xFFFF]
+    end
+  end
+
   def read_outgoing(n)
     ret = @outgoing_data[0,n]
     Session.notify_subscribers(:session_data_sent, [@id, ret])
     return ret
   end
 
+  # Check if there's more data waiting than the 'n' bytes just sent
+  def more_outgoing?(n)
+    return @outgoing_data.length > n
+  end
+
   def ack_outgoing(n)
     # "n" is the current ACK value
     bytes_acked = (n - @my_seq)
@@ -149,6 +264,57 @@ class Session
   def queue_outgoing(data)
     @outgoing_data = @outgoing_data + data
     Session.notify_subscribers(:session_data_queued, [@id, data])
+
+    # Now that there's something to say, answer anybody who's waiting. The
+    # held polls belong to the DNS reactor (hold() and expire_held() are called
+    # from it), but data is queued from the tunnels' and the UI's threads too,
+    # so the release is handed to the reactor rather than racing it.
+    if(data.length > 0)
+      if(defined?(EventMachine) && EventMachine.reactor_running?() && !EventMachine.reactor_thread?())
+        EventMachine.next_tick do
+          release_held()
+        end
+      else
+        release_held()
+      end
+    end
+  end
+
+  # Hang on to a long-poll till we have something to send it; the block is
+  # called (with 'true' if the client has since moved on and the answer is
+  # pointless) when the poll is released. Retransmissions of the same poll are
+  # all held together.
+  def hold(packet_id, &callback)
+    supersede_held(packet_id)
+
+    @held_packet_id = packet_id
+    @held << callback
+  end
+
+  def release_held(superseded = false)
+    held = @held
+    @held = []
+    @held_packet_id = nil
+
+    held.each do |callback|
+      callback.call(superseded)
+    end
+  end
+
+  # Give up holding a long-poll after its time's up (if it hasn't already
+  # been answered)
+  def expire_held(packet_id)
+    if(@held_packet_id == packet_id)
+      release_held()
+    end
+  end
+
+  # A new packet from the client means it's no longer waiting on whatever
+  # we're holding (unless the packet is a retransmission of it)
+  def supersede_held(packet_id)
+    if(!@held_packet_id.nil? && @held_packet_id != packet_id)
+      release_held(true)
+    end
   end
 
   def Session.exists?(id)
@@ -171,6 +337,7 @@ class Session
   end
 
   def destroy()
+    release_held(true)
     Session.destroy(@id)
   end
 end
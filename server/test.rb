@@ -22,6 +22,8 @@ class Test
 
   SESSION_ID = 0x1234
 
+  MAX_LENGTH = 125
+
   def initialize()
     @data = []
 
@@ -29,6 +31,18 @@ class Test
     their_seq  = THEIR_ISN
     packet_id  = rand(0xFFFF)
 
+    @data << {
+      :send => Packet.create_ping(packet_id, 40, 0),
+      :recv => Packet.create_ping(packet_id, 40, 40 - Packet.ping_header_size),
+      :name => "Sending a PING asking for a 40-byte response",
+    }
+
+    @data << {
+      :send => Packet.create_ping(packet_id, 1000, 64),
+      :recv => Packet.create_ping(packet_id, MAX_LENGTH, MAX_LENGTH - Packet.ping_header_size),
+      :name => "Sending a PING asking for more than the transport can carry (should be cut down)",
+    }
+
     @data << {
       :send => Packet.create_msg(packet_id, SESSION_ID, my_seq, their_seq, MY_DATA),
       :recv => Packet.create_fin(packet_id, SESSION_ID),
@@ -204,6 +218,53 @@ class Test
       :name => "Sending a FIN for a session that's already closed, it should ignore it",
     }
 
+    # A session that negotiates MSG flags
+    my_seq     = MY_ISN
+    their_seq  = THEIR_ISN
+    @data << {
+      :send => Packet.create_syn(packet_id, 0x4422, my_seq, Packet::OPT_MSG_FLAGS),
+      :recv => Packet.create_syn(packet_id, 0x4422, their_seq, Packet::OPT_MSG_FLAGS),
+      :name => "Sending a SYN asking for MSG flags, which should be echoed back",
+    }
+
+    @data << {
+      :send => Packet.create_msg(packet_id, 0x4422, my_seq,    their_seq,               MY_DATA, 0),
+      :recv => Packet.create_msg(packet_id, 0x4422, their_seq, my_seq + MY_DATA.length, "",      0),
+      :name => "Sending data with flags, expecting flags (and no MSG_FLAG_MORE) back",
+    }
+
+    @data << {
+      :send => Packet.create_fin(packet_id, 0x4422),
+      :recv => Packet.create_fin(packet_id, 0x4422),
+      :name => "Sending a FIN, should receive a FIN",
+    }
+
+    my_seq     = MY_ISN
+    their_seq  = THEIR_ISN
+    @data << {
+      :send => Packet.create_syn(packet_id, 0x4433, my_seq, Packet::OPT_SACK),
+      :recv => Packet.create_syn(packet_id, 0x4433, their_seq, Packet::OPT_SACK),
+      :name => "Sending a SYN asking for SACK, which should be echoed back",
+    }
+
+    @data << {
+      :send => Packet.create_msg(packet_id, 0x4433, my_seq + 4, their_seq, "EFGH", nil, []),
+      :recv => Packet.create_msg(packet_id, 0x4433, their_seq,  my_seq,    "",     nil, [[my_seq + 4, my_seq + 8]]),
+      :name => "Sending data out of order, expecting it to be SACKed",
+    }
+
+    @data << {
+      :send => Packet.create_msg(packet_id, 0x4433, my_seq,    their_seq,  "ABCD", nil, []),
+      :recv => Packet.create_msg(packet_id, 0x4433, their_seq, my_seq + 8, "",     nil, []),
+      :name => "Filling in the gap, expecting the ACK to cover both",
+    }
+
+    @data << {
+      :send => Packet.create_fin(packet_id, 0x4433),
+      :recv => Packet.create_fin(packet_id, 0x4433),
+      :name => "Sending a FIN, should receive a FIN",
+    }
+
     return
   end
 
@@ -214,7 +275,7 @@ class Test
       end
 
       out = @data.shift
-      response = yield(out[:send])
+      response = yield(out[:send], MAX_LENGTH)
 
       if(response != out[:recv])
         @@failure += 1